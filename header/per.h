@@ -38,6 +38,7 @@ typedef struct {
     SumTreeSample *items;
     size_t         count;
     double        *importance_weights;
+    size_t         capacity;
 } Batch;
 
 void free_per(PER *per) {
@@ -47,13 +48,13 @@ void free_per(PER *per) {
     free(per);
 }
 
-PER *create_prioritized_replay(size_t capacity, size_t elem_size, double alpha, double beta) {
+PER *create_prioritized_replay_ex(size_t capacity, size_t elem_size, double alpha, double beta, SumTreeConfig config) {
     PER *per = (PER *)malloc(sizeof(PER));
     if (per == NULL) {
         return NULL;
     }
 
-    per->tree = create_sum_tree(capacity, elem_size);
+    per->tree = create_sum_tree_ex(capacity, elem_size, config);
 
     if (!per->tree) {
         free(per);
@@ -66,12 +67,155 @@ PER *create_prioritized_replay(size_t capacity, size_t elem_size, double alpha,
     return per;
 }
 
+PER *create_prioritized_replay(size_t capacity, size_t elem_size, double alpha, double beta) {
+    return create_prioritized_replay_ex(capacity, elem_size, alpha, beta, (SumTreeConfig){0});
+}
+
+// Reseeds the sampler for reproducible runs, each PER draws from its own generator
+void per_seed(PER *per, uint64_t seed) {
+    sum_tree_seed(per->tree, seed);
+}
+
+#if defined(__AVX2__) && defined(__FMA__)
+#define PER_SIMD_MATH 1
+#endif
+
+#if defined(PER_SIMD_MATH)
+// Cephes style log for strictly positive, normal inputs: log(1 + x) = x - x^2 / 2 + x^3 P(x) / Q(x)
+// on the mantissa, plus the exponent times log(2) split in two parts.
+static inline __m256d per_log_pd(__m256d x) {
+    const __m256d one   = _mm256_set1_pd(1.0);
+    const __m256i bits  = _mm256_castpd_si256(x);
+    const __m256i magic = _mm256_set1_epi64x(0x4330000000000000LL); // 2^52, turns small ints into doubles
+
+    // frexp: mantissa in [0.5, 1) and the matching exponent
+    __m256d exponent = _mm256_sub_pd(_mm256_castsi256_pd(_mm256_or_si256(_mm256_srli_epi64(bits, 52), magic)),
+                                     _mm256_set1_pd(4503599627370496.0 + 1022.0));
+    __m256d mantissa = _mm256_castsi256_pd(_mm256_or_si256(_mm256_and_si256(bits, _mm256_set1_epi64x(0x000FFFFFFFFFFFFFLL)),
+                                                           _mm256_set1_epi64x(0x3FE0000000000000LL)));
+
+    // Move the mantissa into [sqrt(0.5), sqrt(2)) before taking log(1 + x)
+    __m256d small    = _mm256_cmp_pd(mantissa, _mm256_set1_pd(0.70710678118654752440), _CMP_LT_OQ);
+    exponent         = _mm256_sub_pd(exponent, _mm256_and_pd(small, one));
+    mantissa         = _mm256_sub_pd(_mm256_add_pd(mantissa, _mm256_and_pd(small, mantissa)), one);
+    __m256d m        = mantissa;
+    __m256d z        = _mm256_mul_pd(m, m);
+
+    __m256d p = _mm256_set1_pd(1.01875663804580931796E-4);
+    p         = _mm256_fmadd_pd(p, m, _mm256_set1_pd(4.97494994976747001425E-1));
+    p         = _mm256_fmadd_pd(p, m, _mm256_set1_pd(4.70579119878881725854E0));
+    p         = _mm256_fmadd_pd(p, m, _mm256_set1_pd(1.44989225341610930846E1));
+    p         = _mm256_fmadd_pd(p, m, _mm256_set1_pd(1.79368678507819816313E1));
+    p         = _mm256_fmadd_pd(p, m, _mm256_set1_pd(7.70838733755885391666E0));
+
+    __m256d q = _mm256_add_pd(m, _mm256_set1_pd(1.12873587189167450590E1));
+    q         = _mm256_fmadd_pd(q, m, _mm256_set1_pd(4.52279145837532221105E1));
+    q         = _mm256_fmadd_pd(q, m, _mm256_set1_pd(8.29875266912776603211E1));
+    q         = _mm256_fmadd_pd(q, m, _mm256_set1_pd(7.11544750618563894466E1));
+    q         = _mm256_fmadd_pd(q, m, _mm256_set1_pd(2.31251620126765340583E1));
+
+    __m256d y = _mm256_mul_pd(m, _mm256_div_pd(_mm256_mul_pd(z, p), q));
+    y         = _mm256_fnmadd_pd(exponent, _mm256_set1_pd(2.121944400546905827679e-4), y);
+    y         = _mm256_fnmadd_pd(z, _mm256_set1_pd(0.5), y);
+    __m256d r = _mm256_add_pd(m, y);
+    return _mm256_fmadd_pd(exponent, _mm256_set1_pd(0.693359375), r);
+}
+
+// Cephes style exp: x = n log(2) + r, e^r from a Pade approximant, 2^n assembled in the exponent bits
+static inline __m256d per_exp_pd(__m256d x) {
+    x = _mm256_min_pd(x, _mm256_set1_pd(709.436139303102));
+    x = _mm256_max_pd(x, _mm256_set1_pd(-708.39641853226408));
+
+    __m256d n = _mm256_round_pd(_mm256_mul_pd(x, _mm256_set1_pd(1.4426950408889634073599)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    x         = _mm256_fnmadd_pd(n, _mm256_set1_pd(6.93145751953125E-1), x);
+    x         = _mm256_fnmadd_pd(n, _mm256_set1_pd(1.42860682030941723212E-6), x);
+
+    __m256d xx = _mm256_mul_pd(x, x);
+    __m256d p  = _mm256_set1_pd(1.26177193074810590878E-4);
+    p          = _mm256_fmadd_pd(p, xx, _mm256_set1_pd(3.02994407707441961300E-2));
+    p          = _mm256_fmadd_pd(p, xx, _mm256_set1_pd(9.99999999999999999910E-1));
+    p          = _mm256_mul_pd(p, x);
+
+    __m256d q = _mm256_set1_pd(3.00198505138664455042E-6);
+    q         = _mm256_fmadd_pd(q, xx, _mm256_set1_pd(2.52448340349684104192E-3));
+    q         = _mm256_fmadd_pd(q, xx, _mm256_set1_pd(2.27265548208155028766E-1));
+    q         = _mm256_fmadd_pd(q, xx, _mm256_set1_pd(2.00000000000000000009E0));
+
+    __m256d e = _mm256_div_pd(p, _mm256_sub_pd(q, p));
+    e         = _mm256_fmadd_pd(e, _mm256_set1_pd(2.0), _mm256_set1_pd(1.0));
+
+    // 2^n: n + 1023 goes straight into the exponent field
+    __m256i biased = _mm256_castpd_si256(_mm256_add_pd(n, _mm256_set1_pd(4503599627370496.0 + 1023.0)));
+    __m256d scale  = _mm256_castsi256_pd(_mm256_slli_epi64(biased, 52));
+    return _mm256_mul_pd(e, scale);
+}
+
+static inline __m256d per_pow_pd(__m256d base, double exponent) {
+    if (exponent == 1.0)
+        return base;
+    if (exponent == 0.5)
+        return _mm256_sqrt_pd(base);
+    return per_exp_pd(_mm256_mul_pd(per_log_pd(base), _mm256_set1_pd(exponent)));
+}
+
+static inline __m256i per_tail_mask(size_t remaining) {
+    return _mm256_cmpgt_epi64(_mm256_set1_epi64x((long long)remaining), _mm256_setr_epi64x(0, 1, 2, 3));
+}
+#endif
+
+static inline double per_pow(double base, double exponent) {
+    if (exponent == 1.0)
+        return base;
+    if (exponent == 0.5)
+        return sqrt(base);
+    return pow(base, exponent);
+}
+
+// out[i] = base[i]^exponent for strictly positive bases. Works in place. Exponents 1.0 and 0.5 skip the
+// log/exp round trip entirely; with AVX2 + FMA everything else goes through a 4-wide exp(exponent * log(base)).
+void per_pow_batch(const double *base, double exponent, double *out, size_t count) {
+    size_t i = 0;
+#if defined(PER_SIMD_MATH)
+    for (; i + 4 <= count; i += 4) {
+        _mm256_storeu_pd(out + i, per_pow_pd(_mm256_loadu_pd(base + i), exponent));
+    }
+    if (i < count) {
+        // Finish the tail with masked lanes so every element sees the same approximation
+        __m256i mask = per_tail_mask(count - i);
+        __m256d x    = _mm256_maskload_pd(base + i, mask);
+        x            = _mm256_blendv_pd(_mm256_set1_pd(1.0), x, _mm256_castsi256_pd(mask));
+        _mm256_maskstore_pd(out + i, mask, per_pow_pd(x, exponent));
+    }
+#else
+    for (; i < count; ++i) {
+        out[i] = per_pow(base[i], exponent);
+    }
+#endif
+}
+
 double calculate_priority(const PER *per, double td_error) {
-    return pow(fabs(td_error) + EPS, per->alpha);
+    return per_pow(fabs(td_error) + EPS, per->alpha);
+}
+
+// Batch version of calculate_priority, (|td| + EPS)^alpha for a whole TD error array
+void calculate_priorities(const PER *per, const double *td_errors, double *out_priorities, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        out_priorities[i] = fabs(td_errors[i]) + EPS;
+    }
+    per_pow_batch(out_priorities, per->alpha, out_priorities, count);
+}
+
+// With SumTreeConfig.min_max the max tree is the source of max_priority, so it comes back down once
+// update_per_priorities lowers the largest priority. New entries are written at max_priority, so adds and
+// overwrites never lower it. Without it max_priority only ever grows.
+static inline void per_refresh_max_priority(PER *per) {
+    if (per->tree->min_max != NULL && sum_tree_max_priority(per->tree) > 0.0)
+        per->max_priority = sum_tree_max_priority(per->tree);
 }
 
 void add_to_per(PER *per, const void *item) {
     sum_tree_add(per->tree, item, per->max_priority);
+    per_refresh_max_priority(per);
 }
 
 void calculate_sampling_priorities(const Batch *batch, double *out_importance_weights, double tree_top_value, size_t total_entry_count, double beta) {
@@ -80,23 +224,20 @@ void calculate_sampling_priorities(const Batch *batch, double *out_importance_we
         return;
     }
 
-    double max_importance_weight = 0.0;
-
+    // w = (N * P)^-beta, computed as (1 / (N * P))^beta for the whole batch at once
     for (size_t i = 0; i < batch->count; ++i) {
-        if (tree_top_value <= 0.0) {
-            out_importance_weights[i] = 0.0;
-            continue;
-        }
-
         double prob = batch->items[i].priority / tree_top_value;
         if (prob < 1e-12)
             prob = 1e-12;
 
-        double w                  = pow(1.0 / ((double)total_entry_count * prob), beta);
-        out_importance_weights[i] = w;
+        out_importance_weights[i] = 1.0 / ((double)total_entry_count * prob);
+    }
 
-        if (w > max_importance_weight)
-            max_importance_weight = w;
+    per_pow_batch(out_importance_weights, beta, out_importance_weights, batch->count);
+
+    double max_importance_weight = 0.0;
+    for (size_t i = 0; i < batch->count; ++i) {
+        max_importance_weight = fmax(max_importance_weight, out_importance_weights[i]);
     }
 
     // Normalise once - guard against division by zero
@@ -110,19 +251,73 @@ void calculate_sampling_priorities(const Batch *batch, double *out_importance_we
     }
 }
 
+// Importance weights of count sampled priorities, (min_priority / priority)^beta with the same 1e-12
+// probability floor as calculate_sampling_priorities. min_priority is the smallest priority of the whole
+// buffer, or 0 to normalize by the smallest sampled one, which is the same as dividing by the batch maximum
+// weight. priorities and out may be the same array.
+void per_normalize_priorities(const double *priorities, size_t count, double total, double min_priority, double beta, double *out) {
+    if (total <= 0.0) {
+        memset(out, 0, count * sizeof *out);
+        return;
+    }
+
+    double priority_floor = 1e-12 * total;
+    if (min_priority > 0.0) {
+        min_priority = fmax(min_priority, priority_floor);
+    } else {
+        min_priority = total;
+        for (size_t i = 0; i < count; ++i) {
+            min_priority = fmin(min_priority, fmax(priorities[i], priority_floor));
+        }
+    }
+
+    // A concurrent writer can leave a sample below the global minimum it was normalized by
+    for (size_t i = 0; i < count; ++i) {
+        out[i] = fmin(1.0, min_priority / fmax(priorities[i], priority_floor));
+    }
+
+    per_pow_batch(out, beta, out, count);
+}
+
+// Smallest positive priority of the whole buffer for per_normalize_priorities, 0 without
+// SumTreeConfig.min_max
+static inline double per_global_min_priority(const SumTree *tree) {
+    return tree->min_max != NULL ? sum_tree_min_priority(tree) : 0.0;
+}
+
+// Importance weights of samples drawn from tree. Trees with SumTreeConfig.min_max normalize by the global
+// minimum priority, others by the smallest sampled one.
+void per_normalize_weights(const SumTree *tree, const SumTreeSample *samples, size_t count, double beta, double *out) {
+    for (size_t i = 0; i < count; ++i) {
+        out[i] = samples[i].priority;
+    }
+    per_normalize_priorities(out, count, sum_tree_total(tree), per_global_min_priority(tree), beta, out);
+}
+
+// Standard global normalization, for trees with SumTreeConfig.min_max: the largest weight of the whole
+// buffer belongs to its smallest priority, so w = (N * P)^-beta / max w = (min_priority / priority)^beta.
+// Weights are comparable across batches, unlike the batch maximum normalization above.
+void calculate_sampling_priorities_global(const Batch *batch, double *out_importance_weights, double tree_top_value, double min_priority, double beta) {
+    for (size_t i = 0; i < batch->count; ++i) {
+        out_importance_weights[i] = batch->items[i].priority;
+    }
+    per_normalize_priorities(out_importance_weights, batch->count, tree_top_value, min_priority, beta, out_importance_weights);
+}
+
 static inline void free_batch(Batch *b) {
     free(b->items);
     free(b->importance_weights);
     b->items              = NULL;
     b->importance_weights = NULL;
+    b->count              = 0;
+    b->capacity           = 0;
 }
 
-Batch sample_from_per(PER *per, size_t batch_size) {
-    assert(per->tree->num_entries >= batch_size);
-
+// Allocates a batch that sample_from_per_into can refill every step without touching the allocator
+Batch create_batch(size_t capacity) {
     Batch batch              = {0};
-    batch.items              = (SumTreeSample *)malloc(batch_size * sizeof(batch.items[0]));
-    batch.importance_weights = (double *)malloc(batch_size * sizeof(double));
+    batch.items              = (SumTreeSample *)malloc(capacity * sizeof(batch.items[0]));
+    batch.importance_weights = (double *)malloc(capacity * sizeof(double));
 
     if (!batch.items || !batch.importance_weights) {
         free(batch.items);
@@ -130,46 +325,82 @@ Batch sample_from_per(PER *per, size_t batch_size) {
         return (Batch){0};
     }
 
-    batch.count = batch_size;
+    batch.capacity = capacity;
+    return batch;
+}
+
+// Fused hot path: one stratified descent over the whole batch that prefetches payloads as soon as each
+// lane lands, a pass that copies every payload into out_items (batch_size * elem_size bytes, may be NULL),
+// and per_normalize_weights for the importance weights.
+void sample_from_per_fused(PER *per, size_t batch_size, SumTreeSample *out_samples, double *out_weights, void *out_items) {
+    assert(per->tree->num_entries >= batch_size);
 
-    double tree_top_value = per->tree->priority_tree[0];
+    SumTree *tree           = per->tree;
+    double   tree_top_value = sum_tree_total(tree);
     if (tree_top_value <= 0.0) {
         for (size_t i = 0; i < batch_size; ++i) {
-            batch.items[i]              = (SumTreeSample){0};
-            batch.importance_weights[i] = 0.0;
+            out_samples[i] = (SumTreeSample){0};
+            out_weights[i] = 0.0;
         }
-        return batch;
+        return;
     }
 
-    double segment = tree_top_value / (double)batch_size;
-
     per->beta = fmin(1.0, per->beta + BETA_INC);
 
-    for (size_t i = 0; i < batch_size; ++i) {
-        double a = segment * (double)i;
-        double b = segment * (double)(i + 1);
-        double x = rand_double_range(a, b);
+    // Stage the stratified targets in the weights buffer, per_normalize_weights overwrites them
+    rng_fill_stratified(&tree->rng, out_weights, batch_size, tree_top_value);
+    if (out_items != NULL)
+        sum_tree_get_batch_prefetch_items(tree, out_weights, batch_size, out_samples);
+    else
+        sum_tree_get_batch(tree, out_weights, batch_size, out_samples);
+
+    if (out_items != NULL) {
+        size_t elem_size = tree->elem_size;
+        for (size_t i = 0; i < batch_size; ++i) {
+            memcpy((char *)out_items + i * elem_size, sumtree_data_ptr(tree, out_samples[i].d_idx), elem_size);
+        }
+    }
+
+    per_normalize_weights(tree, out_samples, batch_size, per->beta, out_weights);
+}
 
-        // keep strictly inside [0, tree_top_value)
-        if (x >= tree_top_value)
-            x = nextafter(tree_top_value, 0.0);
+// Samples into a batch made by create_batch. When out_items is not NULL the payload of every sample is
+// copied into it back to back, batch_size * elem_size bytes in sample order.
+void sample_from_per_into(PER *per, Batch *batch, size_t batch_size, void *out_items) {
+    assert(batch->capacity >= batch_size);
 
-        sum_tree_get(per->tree, x, &batch.items[i], NULL);
+    batch->count = batch_size;
+    sample_from_per_fused(per, batch_size, batch->items, batch->importance_weights, out_items);
+}
+
+Batch sample_from_per(PER *per, size_t batch_size) {
+    assert(per->tree->num_entries >= batch_size);
+
+    Batch batch = create_batch(batch_size);
+    if (batch.items == NULL) {
+        return batch;
     }
 
-    calculate_sampling_priorities(&batch, batch.importance_weights,
-                                  tree_top_value, per->tree->num_entries, per->beta);
+    sample_from_per_into(per, &batch, batch_size, NULL);
     return batch;
 }
 
 void update_per_priorities(PER *per, TD_ERRORS *td_errors, size_t *priority_indices) {
     assert(per && per->tree && td_errors && priority_indices);
 
-    for (size_t idx = 0; idx < td_errors->count; ++idx) {
-        double new_priority = calculate_priority(per, td_errors->items[idx]);
-        sum_tree_update(per->tree, priority_indices[idx], new_priority);
-        per->max_priority = fmax(per->max_priority, new_priority);
+    double new_priorities[SUM_TREE_BATCH_LANES];
+
+    for (size_t start = 0; start < td_errors->count; start += SUM_TREE_BATCH_LANES) {
+        size_t chunk = min_size_t(SUM_TREE_BATCH_LANES, td_errors->count - start);
+
+        calculate_priorities(per, td_errors->items + start, new_priorities, chunk);
+        for (size_t idx = 0; idx < chunk; ++idx) {
+            per->max_priority = fmax(per->max_priority, new_priorities[idx]);
+        }
+
+        sum_tree_update_batch(per->tree, priority_indices + start, new_priorities, chunk);
     }
+    per_refresh_max_priority(per);
 }
 
 void show_batch(Batch *batch) {
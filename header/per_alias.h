@@ -0,0 +1,296 @@
+#ifndef HEADER_PER_ALIAS_H
+#define HEADER_PER_ALIAS_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+#include "per.h"
+
+// Vose alias tables over the leaves of a PER, for phases where priorities stay put (evaluation, frozen
+// priorities between update rounds). A fresh table draws each sample in O(1) instead of an O(log n)
+// descent.
+//
+// The leaves are cut into one block per build thread. Every block gets its own alias table, built in
+// parallel, and a small alias table over the block totals picks the block, so a draw is two O(1) lookups
+// and stays exact.
+//
+// Adds and priority updates go through alias_per_add / alias_per_update, which count how far the table
+// is behind the tree. A stale table is never used: sampling falls back to the tree until enough has
+// happened to make a rebuild pay off, either rebuild_updates changes since the last build or
+// rebuild_draws fallback draws since the last change. Then the next sample rebuilds the table.
+//
+// Alias draws are independent, not stratified like the tree path.
+
+#ifndef ALIAS_PER_MIN_BLOCK
+#define ALIAS_PER_MIN_BLOCK ((size_t)1 << 16) // smaller blocks do not pay for a thread
+#endif
+
+typedef struct {
+    size_t threads;         // build threads and blocks, 0 picks the online CPUs
+    size_t rebuild_updates; // changes that trigger a rebuild, 0 picks capacity / 64
+    size_t rebuild_draws;   // fallback draws on an unchanged tree that trigger a rebuild, 0 picks capacity / log2(capacity)
+} AliasConfig;
+
+typedef struct {
+    PER        *per; // not owned
+    AliasConfig config;
+    double     *prob;  // per leaf: chance to keep the drawn leaf instead of its alias
+    uint32_t   *alias; // per leaf: alias, relative to the block start
+    uint32_t   *work;  // build scratch, one entry per leaf
+    size_t      block_count;
+    size_t      block_size;
+    double     *block_total;
+    double     *block_prob;
+    uint32_t   *block_alias;
+    double      total; // tree total at build time
+    bool        valid;
+    uint64_t    dirty;       // changes since the last build
+    uint64_t    stale_draws; // fallback draws since the last change
+    uint64_t    alias_draws;
+    uint64_t    tree_draws;
+    uint64_t    rebuilds;
+} AliasPER;
+
+void free_alias_per(AliasPER *ap) {
+    if (!ap)
+        return;
+    free(ap->prob);
+    free(ap->alias);
+    free(ap->work);
+    free(ap->block_total);
+    free(ap->block_prob);
+    free(ap->block_alias);
+    free(ap);
+}
+
+// Wraps an existing PER. The PER stays owned by the caller and must outlive the handle; change it only
+// through alias_per_add / alias_per_update while the handle is in use.
+AliasPER *create_alias_per(PER *per, AliasConfig config) {
+    assert(per && per->tree);
+    assert(per->tree->capacity <= (size_t)UINT32_MAX + 1);
+
+    AliasPER *ap = (AliasPER *)calloc(1, sizeof(AliasPER));
+    if (ap == NULL) {
+        return NULL;
+    }
+
+    size_t capacity = per->tree->capacity;
+    size_t log2_cap = 1;
+    while (((size_t)1 << log2_cap) < capacity)
+        log2_cap++;
+
+    if (config.threads == 0) {
+        long online    = sysconf(_SC_NPROCESSORS_ONLN);
+        config.threads = online > 0 ? (size_t)online : 1;
+    }
+    if (config.rebuild_updates == 0)
+        config.rebuild_updates = max_size_t(1, capacity / 64);
+    if (config.rebuild_draws == 0)
+        config.rebuild_draws = max_size_t(1, capacity / log2_cap);
+
+    // Power of two blocks, no smaller than ALIAS_PER_MIN_BLOCK unless the whole tree is
+    size_t blocks = 1;
+    while (blocks * 2 <= config.threads && capacity / (blocks * 2) >= ALIAS_PER_MIN_BLOCK)
+        blocks *= 2;
+
+    ap->per         = per;
+    ap->config      = config;
+    ap->block_count = blocks;
+    ap->block_size  = capacity / blocks;
+    ap->prob        = (double *)malloc(capacity * sizeof(double));
+    ap->alias       = (uint32_t *)malloc(capacity * sizeof(uint32_t));
+    ap->work        = (uint32_t *)malloc(capacity * sizeof(uint32_t));
+    ap->block_total = (double *)malloc(blocks * sizeof(double));
+    ap->block_prob  = (double *)malloc(blocks * sizeof(double));
+    ap->block_alias = (uint32_t *)malloc(blocks * sizeof(uint32_t));
+    if (!ap->prob || !ap->alias || !ap->work || !ap->block_total || !ap->block_prob || !ap->block_alias) {
+        free_alias_per(ap);
+        return NULL;
+    }
+    return ap;
+}
+
+// Vose's method over count weights: small entries are pushed from the front of work, large ones from the
+// back, and every small entry is topped up by a large one. Returns the sum of the weights.
+static double alias_per_build_table(const double *weights, size_t count, double *prob, uint32_t *alias, uint32_t *work) {
+    double total = 0.0;
+    for (size_t i = 0; i < count; ++i) {
+        total += weights[i];
+    }
+    if (total <= 0.0) {
+        for (size_t i = 0; i < count; ++i) {
+            prob[i]  = 1.0;
+            alias[i] = (uint32_t)i;
+        }
+        return 0.0;
+    }
+
+    double scale = (double)count / total;
+    size_t small = 0;
+    size_t large = count;
+    for (size_t i = 0; i < count; ++i) {
+        prob[i] = weights[i] * scale;
+        if (prob[i] < 1.0)
+            work[small++] = (uint32_t)i;
+        else
+            work[--large] = (uint32_t)i;
+    }
+
+    // The small stack grows up from 0 and the large one down from count, they meet but never overlap
+    size_t small_top = small;
+    size_t large_top = large;
+    while (small_top > 0 && large_top < count) {
+        uint32_t less = work[--small_top];
+        uint32_t more = work[large_top];
+        alias[less]   = more;
+        prob[more] -= 1.0 - prob[less];
+        if (prob[more] < 1.0) {
+            large_top++;
+            work[small_top++] = more;
+        }
+    }
+
+    // What is left is 1 up to rounding
+    while (large_top < count) {
+        prob[work[large_top++]] = 1.0;
+    }
+    while (small_top > 0) {
+        prob[work[--small_top]] = 1.0;
+    }
+    return total;
+}
+
+typedef struct {
+    AliasPER *ap;
+    size_t    block;
+} AliasBuildTask;
+
+static void *alias_per_build_block(void *arg) {
+    AliasBuildTask *task  = (AliasBuildTask *)arg;
+    AliasPER       *ap    = task->ap;
+    SumTree        *tree  = ap->per->tree;
+    size_t          start = task->block * ap->block_size;
+
+    // Fenwick trees keep no leaf array, gather the leaves into prob first and build in place
+    const double *weights = tree->priority_tree + sumtree_leaf_base(tree) + start;
+    if (tree->layout == SUM_TREE_FENWICK) {
+        for (size_t i = 0; i < ap->block_size; ++i) {
+            ap->prob[start + i] = sum_tree_priority(tree, start + i);
+        }
+        weights = ap->prob + start;
+    }
+
+    ap->block_total[task->block] = alias_per_build_table(weights, ap->block_size, ap->prob + start, ap->alias + start, ap->work + start);
+    return NULL;
+}
+
+// Rebuilds every block table, one thread per block, then the table over the blocks
+void alias_per_rebuild(AliasPER *ap) {
+    AliasBuildTask tasks[64];
+    pthread_t      threads[64];
+    bool           started[64] = {0};
+    size_t         blocks      = ap->block_count;
+
+    for (size_t b = 0; b < blocks; b += 64) {
+        size_t wave = min_size_t(64, blocks - b);
+        for (size_t i = 0; i < wave; ++i) {
+            tasks[i] = (AliasBuildTask){.ap = ap, .block = b + i};
+            // The calling thread builds the first block of each wave itself
+            started[i] = i > 0 && pthread_create(&threads[i], NULL, alias_per_build_block, &tasks[i]) == 0;
+        }
+        for (size_t i = 0; i < wave; ++i) {
+            if (!started[i])
+                alias_per_build_block(&tasks[i]);
+        }
+        for (size_t i = 0; i < wave; ++i) {
+            if (started[i])
+                pthread_join(threads[i], NULL);
+        }
+    }
+
+    ap->total       = alias_per_build_table(ap->block_total, blocks, ap->block_prob, ap->block_alias, ap->work);
+    ap->valid       = ap->total > 0.0;
+    ap->dirty       = 0;
+    ap->stale_draws = 0;
+    ap->rebuilds++;
+}
+
+static inline void alias_per_touch(AliasPER *ap, size_t changes) {
+    ap->dirty += changes;
+    ap->stale_draws = 0;
+}
+
+void alias_per_add(AliasPER *ap, const void *item) {
+    add_to_per(ap->per, item);
+    alias_per_touch(ap, 1);
+}
+
+void alias_per_update(AliasPER *ap, size_t *priority_indices, const double *td_errors, size_t count) {
+    TD_ERRORS td = {.items = (double *)td_errors, .count = count, .capacity = count};
+    update_per_priorities(ap->per, &td, priority_indices);
+    alias_per_touch(ap, count);
+}
+
+// Whether the next sample can use the alias table as it is
+static inline bool alias_per_is_fresh(const AliasPER *ap) {
+    return ap->valid && ap->dirty == 0;
+}
+
+static inline size_t alias_per_draw(AliasPER *ap, Rng *rng) {
+    size_t block = 0;
+    if (ap->block_count > 1) {
+        block = rng_next_below(rng, ap->block_count);
+        if (rng_next_double(rng) >= ap->block_prob[block])
+            block = ap->block_alias[block];
+    }
+
+    size_t start = block * ap->block_size;
+    size_t slot  = rng_next_below(rng, ap->block_size);
+    if (rng_next_double(rng) >= ap->prob[start + slot])
+        slot = ap->alias[start + slot];
+    return start + slot;
+}
+
+// Samples like sample_from_per_into: O(1) per sample from a fresh table, otherwise the tree descent. The
+// first call builds the table, later ones rebuild it once it has fallen far enough behind.
+void alias_per_sample(AliasPER *ap, Batch *batch, size_t batch_size, void *out_items) {
+    PER     *per  = ap->per;
+    SumTree *tree = per->tree;
+    assert(batch->capacity >= batch_size);
+    assert(tree->num_entries >= batch_size);
+
+    bool behind = ap->rebuilds == 0 || ap->dirty >= ap->config.rebuild_updates || ap->stale_draws >= ap->config.rebuild_draws;
+    if (!alias_per_is_fresh(ap) && behind)
+        alias_per_rebuild(ap);
+
+    if (!alias_per_is_fresh(ap)) {
+        sample_from_per_into(per, batch, batch_size, out_items);
+        ap->tree_draws += batch_size;
+        ap->stale_draws += batch_size;
+        return;
+    }
+
+    per->beta = fmin(1.0, per->beta + BETA_INC);
+
+    size_t leaf_base = sumtree_leaf_base(tree);
+    for (size_t i = 0; i < batch_size; ++i) {
+        size_t slot     = alias_per_draw(ap, &tree->rng);
+        batch->items[i] = (SumTreeSample){.p_idx = leaf_base + slot, .d_idx = slot, .priority = sum_tree_priority(tree, leaf_base + slot)};
+        if (out_items != NULL)
+            sumtree_prefetch_item(tree, slot);
+    }
+    batch->count = batch_size;
+    ap->alias_draws += batch_size;
+
+    if (out_items != NULL) {
+        for (size_t i = 0; i < batch_size; ++i) {
+            memcpy((char *)out_items + i * tree->elem_size, sumtree_data_ptr(tree, batch->items[i].d_idx), tree->elem_size);
+        }
+    }
+
+    // Same weights as the tree fallback
+    per_normalize_weights(tree, batch->items, batch_size, per->beta, batch->importance_weights);
+}
+
+#endif // HEADER_PER_ALIAS_H
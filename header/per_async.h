@@ -0,0 +1,302 @@
+#ifndef HEADER_PER_ASYNC_H
+#define HEADER_PER_ASYNC_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <sched.h>
+
+#include "per.h"
+
+// Asynchronous priority updates: the learner pushes (p_idx, td_error) pairs into a bounded lock-free queue
+// and returns at once. A background applier thread drains the queue, coalesces duplicate indices (the
+// newest TD error wins) and applies the survivors with update_per_priorities.
+//
+// Staleness is bounded two ways:
+// - at most max_pending pushed updates are ever waiting; a push into a full queue waits for the applier
+// - the applier wakes up at least every max_delay_ms, so no update waits longer than that plus one batch
+//
+// async_per_flush is the barrier for when the learner needs exact priorities: it returns once everything
+// pushed before the call is in the tree. Adds and samples go through async_per_add and
+// async_per_sample_into, which share the tree lock with the applier.
+
+#ifndef ASYNC_PER_DEFAULT_MAX_PENDING
+#define ASYNC_PER_DEFAULT_MAX_PENDING 4096
+#endif
+
+#ifndef ASYNC_PER_DEFAULT_MIN_BATCH
+#define ASYNC_PER_DEFAULT_MIN_BATCH 256
+#endif
+
+#ifndef ASYNC_PER_DEFAULT_MAX_DELAY_MS
+#define ASYNC_PER_DEFAULT_MAX_DELAY_MS 1.0
+#endif
+
+typedef struct {
+    size_t max_pending;  // queue capacity, rounded up to a power of two
+    size_t min_batch;    // the applier waits for this many updates unless max_delay_ms passes first
+    double max_delay_ms;
+} AsyncUpdateConfig;
+
+typedef struct {
+    uint64_t seq; // Vyukov sequence number, tells producers and the applier who owns the cell
+    size_t   p_idx;
+    double   td_error;
+} AsyncUpdateCell;
+
+typedef struct {
+    size_t   p_idx;
+    uint64_t order;
+    double   td_error;
+} AsyncUpdateEntry;
+
+typedef struct {
+    PER              *per; // not owned
+    pthread_mutex_t   tree_lock;
+    AsyncUpdateCell  *cells;
+    size_t            mask;
+    uint64_t          enqueue_pos; // atomic, shared by producers
+    uint64_t          dequeue_pos; // applier only
+    uint64_t          applied;     // atomic, updates that reached the tree
+    uint64_t          flush_target;
+    int               stop;
+    AsyncUpdateConfig config;
+    AsyncUpdateEntry *scratch;
+    size_t           *scratch_indices;
+    double           *scratch_errors;
+    pthread_mutex_t   wake_lock;
+    pthread_cond_t    wake;
+    pthread_cond_t    applied_cond;
+    pthread_t         thread;
+    bool              running;
+} AsyncPER;
+
+static bool async_per_pop(AsyncPER *ap, size_t *p_idx, double *td_error) {
+    AsyncUpdateCell *cell = &ap->cells[ap->dequeue_pos & ap->mask];
+    uint64_t         seq  = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+
+    if (seq != ap->dequeue_pos + 1)
+        return false;
+
+    *p_idx    = cell->p_idx;
+    *td_error = cell->td_error;
+    __atomic_store_n(&cell->seq, ap->dequeue_pos + ap->mask + 1, __ATOMIC_RELEASE);
+    ap->dequeue_pos++;
+    return true;
+}
+
+static bool async_per_try_push(AsyncPER *ap, size_t p_idx, double td_error) {
+    uint64_t pos = __atomic_load_n(&ap->enqueue_pos, __ATOMIC_RELAXED);
+
+    for (;;) {
+        AsyncUpdateCell *cell = &ap->cells[pos & ap->mask];
+        uint64_t         seq  = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        int64_t          dif  = (int64_t)(seq - pos);
+
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&ap->enqueue_pos, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                cell->p_idx    = p_idx;
+                cell->td_error = td_error;
+                __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+                return true;
+            }
+        } else if (dif < 0) {
+            return false; // full
+        } else {
+            pos = __atomic_load_n(&ap->enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+static void async_per_wake(AsyncPER *ap) {
+    pthread_mutex_lock(&ap->wake_lock);
+    pthread_cond_signal(&ap->wake);
+    pthread_mutex_unlock(&ap->wake_lock);
+}
+
+static int async_per_compare_entries(const void *a, const void *b) {
+    const AsyncUpdateEntry *x = (const AsyncUpdateEntry *)a;
+    const AsyncUpdateEntry *y = (const AsyncUpdateEntry *)b;
+    if (x->p_idx != y->p_idx)
+        return x->p_idx < y->p_idx ? -1 : 1;
+    return x->order < y->order ? -1 : (x->order > y->order);
+}
+
+// Drains what is queued, keeps the newest TD error per index and applies it. Returns the number of
+// queue entries consumed.
+static size_t async_per_apply(AsyncPER *ap) {
+    size_t drained = 0;
+    while (drained <= ap->mask && async_per_pop(ap, &ap->scratch[drained].p_idx, &ap->scratch[drained].td_error)) {
+        ap->scratch[drained].order = drained;
+        drained++;
+    }
+    if (drained == 0)
+        return 0;
+
+    qsort(ap->scratch, drained, sizeof(AsyncUpdateEntry), async_per_compare_entries);
+
+    size_t unique = 0;
+    for (size_t i = 0; i < drained; ++i) {
+        if (i + 1 < drained && ap->scratch[i + 1].p_idx == ap->scratch[i].p_idx)
+            continue;
+        ap->scratch_indices[unique] = ap->scratch[i].p_idx;
+        ap->scratch_errors[unique]  = ap->scratch[i].td_error;
+        unique++;
+    }
+
+    TD_ERRORS td = {.items = ap->scratch_errors, .count = unique, .capacity = unique};
+    pthread_mutex_lock(&ap->tree_lock);
+    update_per_priorities(ap->per, &td, ap->scratch_indices);
+    pthread_mutex_unlock(&ap->tree_lock);
+
+    pthread_mutex_lock(&ap->wake_lock);
+    __atomic_store_n(&ap->applied, ap->dequeue_pos, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&ap->applied_cond);
+    pthread_mutex_unlock(&ap->wake_lock);
+    return drained;
+}
+
+static void *async_per_applier(void *arg) {
+    AsyncPER *ap = (AsyncPER *)arg;
+
+    for (;;) {
+        pthread_mutex_lock(&ap->wake_lock);
+        uint64_t pending = __atomic_load_n(&ap->enqueue_pos, __ATOMIC_RELAXED) - ap->dequeue_pos;
+        if (!ap->stop && ap->flush_target <= ap->applied && pending < ap->config.min_batch) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            long nanos = deadline.tv_nsec + (long)(ap->config.max_delay_ms * 1e6);
+            deadline.tv_sec += nanos / 1000000000L;
+            deadline.tv_nsec = nanos % 1000000000L;
+            pthread_cond_timedwait(&ap->wake, &ap->wake_lock, &deadline);
+        }
+        int stop = ap->stop;
+        pthread_mutex_unlock(&ap->wake_lock);
+
+        while (async_per_apply(ap) > 0) {
+        }
+        if (stop)
+            return NULL;
+    }
+}
+
+void free_async_per(AsyncPER *ap) {
+    if (!ap)
+        return;
+    if (ap->running) {
+        pthread_mutex_lock(&ap->wake_lock);
+        ap->stop = 1;
+        pthread_cond_signal(&ap->wake);
+        pthread_mutex_unlock(&ap->wake_lock);
+        pthread_join(ap->thread, NULL);
+    }
+    pthread_mutex_destroy(&ap->tree_lock);
+    pthread_mutex_destroy(&ap->wake_lock);
+    pthread_cond_destroy(&ap->wake);
+    pthread_cond_destroy(&ap->applied_cond);
+    free(ap->cells);
+    free(ap->scratch);
+    free(ap->scratch_indices);
+    free(ap->scratch_errors);
+    free(ap);
+}
+
+// Starts the applier thread for an existing PER. The PER stays owned by the caller and must outlive the
+// returned handle; while it is alive, touch the PER only through the async_per_* calls.
+AsyncPER *create_async_per(PER *per, AsyncUpdateConfig config) {
+    assert(per && per->tree);
+
+    AsyncPER *ap = (AsyncPER *)calloc(1, sizeof(AsyncPER));
+    if (ap == NULL) {
+        return NULL;
+    }
+    pthread_mutex_init(&ap->tree_lock, NULL);
+    pthread_mutex_init(&ap->wake_lock, NULL);
+    pthread_cond_init(&ap->wake, NULL);
+    pthread_cond_init(&ap->applied_cond, NULL);
+
+    if (config.max_pending == 0)
+        config.max_pending = ASYNC_PER_DEFAULT_MAX_PENDING;
+    if (config.min_batch == 0)
+        config.min_batch = ASYNC_PER_DEFAULT_MIN_BATCH;
+    if (config.max_delay_ms <= 0.0)
+        config.max_delay_ms = ASYNC_PER_DEFAULT_MAX_DELAY_MS;
+
+    size_t capacity = 2;
+    while (capacity < config.max_pending)
+        capacity <<= 1;
+    config.max_pending = capacity;
+    config.min_batch   = min_size_t(config.min_batch, capacity);
+
+    ap->per             = per;
+    ap->config          = config;
+    ap->mask            = capacity - 1;
+    ap->cells           = (AsyncUpdateCell *)calloc(capacity, sizeof(AsyncUpdateCell));
+    ap->scratch         = (AsyncUpdateEntry *)calloc(capacity, sizeof(AsyncUpdateEntry));
+    ap->scratch_indices = (size_t *)calloc(capacity, sizeof(size_t));
+    ap->scratch_errors  = (double *)calloc(capacity, sizeof(double));
+    if (!ap->cells || !ap->scratch || !ap->scratch_indices || !ap->scratch_errors) {
+        free_async_per(ap);
+        return NULL;
+    }
+    for (size_t i = 0; i < capacity; ++i) {
+        ap->cells[i].seq = i;
+    }
+
+    if (pthread_create(&ap->thread, NULL, async_per_applier, ap) != 0) {
+        free_async_per(ap);
+        return NULL;
+    }
+    ap->running = true;
+    return ap;
+}
+
+// Queues new TD errors for already sampled entries and returns without touching the tree, unless the
+// queue is full, in which case it waits for the applier to make room.
+void async_per_push(AsyncPER *ap, const size_t *priority_indices, const double *td_errors, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        while (!async_per_try_push(ap, priority_indices[i], td_errors[i])) {
+            async_per_wake(ap);
+            sched_yield();
+        }
+    }
+
+    // Only the push that crosses min_batch signals; the applier drains everything queued once it runs
+    uint64_t applied = __atomic_load_n(&ap->applied, __ATOMIC_RELAXED);
+    uint64_t after   = __atomic_load_n(&ap->enqueue_pos, __ATOMIC_RELAXED) - applied;
+    uint64_t before  = after > count ? after - count : 0;
+    if (before < ap->config.min_batch && after >= ap->config.min_batch)
+        async_per_wake(ap);
+}
+
+size_t async_per_pending(const AsyncPER *ap) {
+    return (size_t)(__atomic_load_n(&ap->enqueue_pos, __ATOMIC_ACQUIRE) - __atomic_load_n(&ap->applied, __ATOMIC_ACQUIRE));
+}
+
+// Barrier: returns once every update pushed before the call is applied to the tree
+void async_per_flush(AsyncPER *ap) {
+    uint64_t target = __atomic_load_n(&ap->enqueue_pos, __ATOMIC_ACQUIRE);
+
+    pthread_mutex_lock(&ap->wake_lock);
+    if (ap->flush_target < target)
+        ap->flush_target = target;
+    pthread_cond_signal(&ap->wake);
+    while (__atomic_load_n(&ap->applied, __ATOMIC_ACQUIRE) < target) {
+        pthread_cond_wait(&ap->applied_cond, &ap->wake_lock);
+    }
+    pthread_mutex_unlock(&ap->wake_lock);
+}
+
+void async_per_add(AsyncPER *ap, const void *item) {
+    pthread_mutex_lock(&ap->tree_lock);
+    add_to_per(ap->per, item);
+    pthread_mutex_unlock(&ap->tree_lock);
+}
+
+// Samples against the priorities applied so far; call async_per_flush first for exact ones
+void async_per_sample_into(AsyncPER *ap, Batch *batch, size_t batch_size, void *out_items) {
+    pthread_mutex_lock(&ap->tree_lock);
+    sample_from_per_into(ap->per, batch, batch_size, out_items);
+    pthread_mutex_unlock(&ap->tree_lock);
+}
+
+#endif // HEADER_PER_ASYNC_H
@@ -0,0 +1,381 @@
+#ifndef HEADER_PER_BUCKET_H
+#define HEADER_PER_BUCKET_H
+
+#include <stdbool.h>
+
+#include "per.h"
+
+// Log-bucketed sampler, a drop-in for the sum tree when buffers are large enough that the descent
+// dominates. Slot priorities are grouped by their binary exponent: bucket b holds the priorities in
+// [2^(e-1), 2^e) for e = b + BUCKET_SAMPLER_MAX_EXPONENT - BUCKET_SAMPLER_BUCKETS + 1. Every bucket keeps
+// its total and a member list, so moving a slot between buckets is O(1).
+//
+// A draw picks a bucket in proportion to its total, then rejection-samples inside it: a uniform member
+// is kept with probability priority / bound. Inside the exponent range the bound is at most twice any
+// member, so the expected number of tries is below two and sampling is expected O(1).
+//
+// What makes it approximate:
+// - the two end buckets also hold priorities outside the range. The top bucket bound grows with its
+//   largest member and only shrinks back when the buckets are summed again, so an outlier that left
+//   raises the rejection rate until then. A bottom bucket member far below its bound gets accepted after
+//   BUCKET_SAMPLER_MAX_TRIES tries anyway.
+// - bucket totals are kept by adding and subtracting, and they are only summed again, together with the
+//   bounds, every capacity changes.
+// - stratification is over buckets, not over the whole priority mass like the tree.
+// bench micro prints how far this drifts from exact sampling.
+
+#ifndef BUCKET_SAMPLER_BUCKETS
+#define BUCKET_SAMPLER_BUCKETS 64
+#endif
+
+#ifndef BUCKET_SAMPLER_MAX_EXPONENT
+#define BUCKET_SAMPLER_MAX_EXPONENT 16 // the top regular bucket is [2^15, 2^16)
+#endif
+
+#ifndef BUCKET_SAMPLER_MAX_TRIES
+#define BUCKET_SAMPLER_MAX_TRIES 64
+#endif
+
+#if BUCKET_SAMPLER_BUCKETS > 64
+#error "BUCKET_SAMPLER_BUCKETS must fit the 64 bit occupancy mask"
+#endif
+
+#define BUCKET_SAMPLER_NONE 0xFF // slot holds no priority
+
+// Members keep a copy of their priority, so a rejection test touches one cache line
+typedef struct {
+    double priority;
+    size_t slot;
+} BucketMember;
+
+typedef struct {
+    BucketMember *members;
+    size_t        count;
+    size_t        capacity;
+    double        total;
+    double        bound; // no member is above it
+} SampleBucket;
+
+typedef struct {
+    double   priority;
+    uint32_t index;  // in the member list of its bucket
+    uint8_t  bucket; // BUCKET_SAMPLER_NONE when the priority is 0
+} BucketSlot;
+
+typedef struct {
+    size_t       capacity;
+    size_t       elem_size;
+    char        *data;
+    size_t       num_entries;
+    size_t       cursor;
+    BucketSlot  *slots;
+    SampleBucket buckets[BUCKET_SAMPLER_BUCKETS];
+    uint64_t     occupied; // bit b set when bucket b has members
+    size_t       changes;  // since the bucket totals were last summed
+    uint64_t     draws;
+    uint64_t     rejections;
+    Rng          rng;
+} BucketSampler;
+
+// 2^e of bucket b, above every priority of its exponent range
+static inline double bucket_sampler_range_bound(size_t b) {
+    return ldexp(1.0, (int)b + BUCKET_SAMPLER_MAX_EXPONENT - BUCKET_SAMPLER_BUCKETS + 1);
+}
+
+void free_bucket_sampler(BucketSampler *bs) {
+    if (!bs)
+        return;
+    for (size_t b = 0; b < BUCKET_SAMPLER_BUCKETS; ++b) {
+        free(bs->buckets[b].members);
+    }
+    sumtree_aligned_free(bs->data);
+    free(bs->slots);
+    free(bs);
+}
+
+BucketSampler *create_bucket_sampler(size_t capacity, size_t elem_size) {
+    assert(capacity > 0 && capacity <= (size_t)UINT32_MAX + 1);
+
+    BucketSampler *bs = (BucketSampler *)calloc(1, sizeof(BucketSampler));
+    if (bs == NULL) {
+        return NULL;
+    }
+
+    bs->capacity  = capacity;
+    bs->elem_size = elem_size;
+    bs->slots     = (BucketSlot *)malloc(capacity * sizeof(BucketSlot));
+    if (elem_size > 0)
+        bs->data = (char *)sumtree_aligned_alloc(capacity * elem_size, SUM_TREE_CACHE_LINE);
+    if (!bs->slots || (elem_size > 0 && !bs->data)) {
+        free_bucket_sampler(bs);
+        return NULL;
+    }
+    for (size_t i = 0; i < capacity; ++i) {
+        bs->slots[i] = (BucketSlot){.priority = 0.0, .bucket = BUCKET_SAMPLER_NONE};
+    }
+
+    for (size_t b = 0; b < BUCKET_SAMPLER_BUCKETS; ++b) {
+        bs->buckets[b].bound = bucket_sampler_range_bound(b);
+    }
+
+    rng_seed(&bs->rng, (uint64_t)time(NULL) ^ (uint64_t)(uintptr_t)bs);
+    return bs;
+}
+
+void bucket_sampler_seed(BucketSampler *bs, uint64_t seed) {
+    rng_seed(&bs->rng, seed);
+}
+
+static inline double bucket_sampler_priority(const BucketSampler *bs, size_t slot) {
+    return bs->slots[slot].priority;
+}
+
+static inline size_t bucket_sampler_index(double priority) {
+    int exponent;
+    frexp(priority, &exponent);
+
+    int b = exponent - (BUCKET_SAMPLER_MAX_EXPONENT - BUCKET_SAMPLER_BUCKETS + 1);
+    if (b < 0)
+        return 0;
+    if (b >= BUCKET_SAMPLER_BUCKETS)
+        return BUCKET_SAMPLER_BUCKETS - 1;
+    return (size_t)b;
+}
+
+static void bucket_sampler_remove(BucketSampler *bs, size_t slot) {
+    BucketSlot *entry = &bs->slots[slot];
+    if (entry->bucket == BUCKET_SAMPLER_NONE)
+        return;
+
+    SampleBucket *bucket = &bs->buckets[entry->bucket];
+    BucketMember  last   = bucket->members[--bucket->count];
+
+    bucket->members[entry->index] = last;
+    bs->slots[last.slot].index    = entry->index;
+    if (bucket->count == 0) {
+        bucket->total = 0.0;
+        bs->occupied &= ~((uint64_t)1 << entry->bucket);
+    } else {
+        bucket->total -= entry->priority;
+    }
+    entry->bucket = BUCKET_SAMPLER_NONE;
+}
+
+static bool bucket_sampler_insert(BucketSampler *bs, size_t slot, double priority) {
+    size_t        b      = bucket_sampler_index(priority);
+    SampleBucket *bucket = &bs->buckets[b];
+
+    if (bucket->count == bucket->capacity) {
+        size_t        grown   = max_size_t(16, bucket->capacity * 2);
+        BucketMember *members = (BucketMember *)realloc(bucket->members, grown * sizeof(BucketMember));
+        if (members == NULL)
+            return false;
+        bucket->members  = members;
+        bucket->capacity = grown;
+    }
+
+    bs->slots[slot].index            = (uint32_t)bucket->count;
+    bs->slots[slot].bucket           = (uint8_t)b;
+    bucket->members[bucket->count++] = (BucketMember){.priority = priority, .slot = slot};
+    bucket->total += priority;
+    bucket->bound = fmax(bucket->bound, priority);
+    bs->occupied |= (uint64_t)1 << b;
+    return true;
+}
+
+// Sums every bucket again, which drops the rounding error the running totals pick up, and lowers the
+// top bucket bound back to its largest current member
+void bucket_sampler_resum(BucketSampler *bs) {
+    for (size_t b = 0; b < BUCKET_SAMPLER_BUCKETS; ++b) {
+        SampleBucket *bucket = &bs->buckets[b];
+        double        total  = 0.0;
+        double        bound  = bucket_sampler_range_bound(b);
+        for (size_t i = 0; i < bucket->count; ++i) {
+            total += bucket->members[i].priority;
+            bound = fmax(bound, bucket->members[i].priority);
+        }
+        bucket->total = total;
+        bucket->bound = bound;
+    }
+    bs->changes = 0;
+}
+
+// Sets the priority of a slot in O(1). Returns false when a bucket could not grow, the slot keeps its old
+// priority then.
+bool bucket_sampler_update(BucketSampler *bs, size_t slot, double priority) {
+    assert(slot < bs->capacity && priority >= 0.0);
+
+    BucketSlot *entry = &bs->slots[slot];
+    double      old   = entry->priority;
+    if (entry->bucket != BUCKET_SAMPLER_NONE && priority > 0.0 && entry->bucket == bucket_sampler_index(priority)) {
+        SampleBucket *bucket = &bs->buckets[entry->bucket];
+        bucket->members[entry->index].priority = priority;
+        bucket->total += priority - old;
+        bucket->bound = fmax(bucket->bound, priority);
+    } else {
+        bucket_sampler_remove(bs, slot);
+        if (priority > 0.0 && !bucket_sampler_insert(bs, slot, priority)) {
+            if (old > 0.0)
+                bucket_sampler_insert(bs, slot, old); // it just left a bucket with room for it
+            return false;
+        }
+    }
+    entry->priority = priority;
+
+    if (++bs->changes >= bs->capacity)
+        bucket_sampler_resum(bs);
+    return true;
+}
+
+bool bucket_sampler_add(BucketSampler *bs, const void *item, double priority) {
+    if (!bucket_sampler_update(bs, bs->cursor, priority))
+        return false;
+    if (bs->elem_size > 0)
+        memcpy(bs->data + bs->cursor * bs->elem_size, item, bs->elem_size);
+
+    bs->cursor = (bs->cursor + 1) % bs->capacity;
+    if (bs->num_entries < bs->capacity)
+        bs->num_entries++;
+    return true;
+}
+
+double bucket_sampler_total(const BucketSampler *bs) {
+    double total = 0.0;
+    for (size_t b = 0; b < BUCKET_SAMPLER_BUCKETS; ++b) {
+        total += bs->buckets[b].total;
+    }
+    return total;
+}
+
+// Stratified like sum_tree_get_batch: target i falls in [i, i + 1) * total / batch_size. Targets ascend,
+// so one walk over the occupied buckets finds them all. The first candidate of every sample is prefetched
+// before any is tested, like the interleaved tree descent. p_idx and d_idx are both the slot.
+void bucket_sampler_get_batch(BucketSampler *bs, size_t batch_size, SumTreeSample *out) {
+    size_t bucket_ids[BUCKET_SAMPLER_BUCKETS];
+    double ends[BUCKET_SAMPLER_BUCKETS];
+    size_t used = 0;
+    double sum  = 0.0;
+
+    for (uint64_t mask = bs->occupied; mask != 0; mask &= mask - 1) {
+        size_t b = (size_t)sumtree_ctz64(mask);
+        sum += bs->buckets[b].total;
+        bucket_ids[used] = b;
+        ends[used++]     = sum;
+    }
+    assert(used > 0);
+
+    SampleBucket *lane_bucket[SUM_TREE_BATCH_LANES];
+    size_t        lane_member[SUM_TREE_BATCH_LANES];
+    size_t        current = 0;
+    for (size_t start = 0; start < batch_size; start += SUM_TREE_BATCH_LANES) {
+        size_t lanes = min_size_t(SUM_TREE_BATCH_LANES, batch_size - start);
+
+        for (size_t l = 0; l < lanes; ++l) {
+            double target = ((double)(start + l) + rng_next_double(&bs->rng)) * sum / (double)batch_size;
+            while (current + 1 < used && target >= ends[current])
+                current++;
+
+            lane_bucket[l] = &bs->buckets[bucket_ids[current]];
+            lane_member[l] = rng_next_below(&bs->rng, lane_bucket[l]->count);
+            SUM_TREE_PREFETCH(&lane_bucket[l]->members[lane_member[l]]);
+        }
+
+        // Uniform member, kept with probability priority / bound
+        for (size_t l = 0; l < lanes; ++l) {
+            SampleBucket *bucket = lane_bucket[l];
+            BucketMember  member = bucket->members[lane_member[l]];
+            for (size_t tries = 1; tries < BUCKET_SAMPLER_MAX_TRIES; ++tries) {
+                if (rng_next_double(&bs->rng) * bucket->bound < member.priority)
+                    break;
+                bs->rejections++;
+                member = bucket->members[rng_next_below(&bs->rng, bucket->count)];
+            }
+            out[start + l] = (SumTreeSample){.p_idx = member.slot, .d_idx = member.slot, .priority = member.priority};
+        }
+    }
+    bs->draws += batch_size;
+}
+
+// PER on top of the bucket sampler, with the same priorities and weights as per.h
+typedef struct {
+    BucketSampler *sampler;
+    double         alpha;
+    double         beta;
+    double         max_priority;
+} BucketPER;
+
+void free_bucket_per(BucketPER *bp) {
+    if (!bp)
+        return;
+    free_bucket_sampler(bp->sampler);
+    free(bp);
+}
+
+BucketPER *create_bucket_per(size_t capacity, size_t elem_size, double alpha, double beta) {
+    BucketPER *bp = (BucketPER *)malloc(sizeof(BucketPER));
+    if (bp == NULL) {
+        return NULL;
+    }
+
+    bp->sampler = create_bucket_sampler(capacity, elem_size);
+    if (!bp->sampler) {
+        free(bp);
+        return NULL;
+    }
+
+    bp->alpha        = alpha;
+    bp->beta         = beta;
+    bp->max_priority = 1.0;
+    return bp;
+}
+
+bool bucket_per_add(BucketPER *bp, const void *item) {
+    return bucket_sampler_add(bp->sampler, item, bp->max_priority);
+}
+
+bool bucket_per_update(BucketPER *bp, const size_t *slots, const double *td_errors, size_t count) {
+    double priorities[SUM_TREE_BATCH_LANES];
+
+    for (size_t start = 0; start < count; start += SUM_TREE_BATCH_LANES) {
+        size_t chunk = min_size_t(SUM_TREE_BATCH_LANES, count - start);
+        for (size_t i = 0; i < chunk; ++i) {
+            priorities[i] = fabs(td_errors[start + i]) + EPS;
+        }
+        per_pow_batch(priorities, bp->alpha, priorities, chunk);
+
+        for (size_t i = 0; i < chunk; ++i) {
+            SUM_TREE_PREFETCH(&bp->sampler->slots[slots[start + i]]);
+        }
+        for (size_t i = 0; i < chunk; ++i) {
+            bp->max_priority = fmax(bp->max_priority, priorities[i]);
+            if (!bucket_sampler_update(bp->sampler, slots[start + i], priorities[i]))
+                return false;
+        }
+    }
+    return true;
+}
+
+// Samples like sample_from_per_into, weights normalized by the smallest sampled priority
+void bucket_per_sample(BucketPER *bp, Batch *batch, size_t batch_size, void *out_items) {
+    BucketSampler *bs = bp->sampler;
+    assert(batch->capacity >= batch_size);
+    assert(bs->num_entries >= batch_size);
+
+    double total = bucket_sampler_total(bs);
+    bp->beta     = fmin(1.0, bp->beta + BETA_INC);
+    bucket_sampler_get_batch(bs, batch_size, batch->items);
+    batch->count = batch_size;
+
+    if (out_items != NULL) {
+        for (size_t i = 0; i < batch_size; ++i) {
+            memcpy((char *)out_items + i * bs->elem_size, bs->data + batch->items[i].d_idx * bs->elem_size, bs->elem_size);
+        }
+    }
+
+    for (size_t i = 0; i < batch_size; ++i) {
+        batch->importance_weights[i] = batch->items[i].priority;
+    }
+    per_normalize_priorities(batch->importance_weights, batch_size, total, 0.0, bp->beta, batch->importance_weights);
+}
+
+#endif // HEADER_PER_BUCKET_H
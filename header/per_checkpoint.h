@@ -0,0 +1,312 @@
+#ifndef HEADER_PER_CHECKPOINT_H
+#define HEADER_PER_CHECKPOINT_H
+
+#include "per_snapshot.h"
+
+// Incremental checkpoints on top of per_save. The SumTree tracks which data chunks and which
+// priority_tree pages changed (sum_tree_track_dirty), and every checkpoint appends only those to a log
+// next to the base snapshot, followed by a commit record holding the ring position, hyperparameters and
+// RNG state:
+//
+//   base_path       full snapshot, see per_snapshot.h
+//   base_path.log   [ log header ][ DATA | TREE records ... COMMIT ][ DATA | TREE records ... COMMIT ] ...
+//
+// Restoring loads the base and replays the log up to its last complete commit, so a crash halfway through
+// a checkpoint falls back to the previous one. Once the log outgrows compact_ratio times the base, the
+// next checkpoint writes a fresh base instead and starts an empty log. per_checkpoint_compact does the
+// same offline.
+//
+// The log header carries a tag hashed from the base's ring position, beta, max_priority and RNG state, so a
+// log left behind by a crash during compaction is never replayed onto the newer base.
+
+#define PER_LOG_MAGIC 0x4C524550u // "PERL"
+#define PER_LOG_VERSION 1
+
+#ifndef PER_CHECKPOINT_DEFAULT_CHUNK_BYTES
+#define PER_CHECKPOINT_DEFAULT_CHUNK_BYTES ((size_t)64 << 10)
+#endif
+
+typedef enum {
+    PER_LOG_DATA = 1,
+    PER_LOG_TREE,
+    PER_LOG_COMMIT,
+} PerLogKind;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t base_tag;
+} PerLogHeader;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t kind;
+    uint64_t offset; // byte offset into data or priority_tree
+    uint64_t bytes;  // payload bytes following the record
+} PerLogRecord;
+
+typedef struct {
+    uint64_t current_index;
+    uint64_t num_entries;
+    double   alpha;
+    double   beta;
+    double   max_priority;
+    uint64_t rng[4];
+} PerLogCommit;
+
+typedef struct {
+    char     base_path[4096];
+    char     log_path[4096];
+    int      fd;
+    uint64_t log_bytes;
+    uint64_t base_bytes;
+    double   compact_ratio;
+    uint64_t checkpoints; // since the last base
+} PerCheckpoint;
+
+static uint64_t per_checkpoint_tag(const PER *per) {
+    const SumTree *tree = per->tree;
+    uint64_t       beta_bits, max_bits;
+    memcpy(&beta_bits, &per->beta, sizeof(beta_bits));
+    memcpy(&max_bits, &per->max_priority, sizeof(max_bits));
+
+    uint64_t state   = 0;
+    uint64_t words[] = {tree->current_index, tree->num_entries, beta_bits, max_bits, tree->rng.s[0], tree->rng.s[1], tree->rng.s[2], tree->rng.s[3]};
+    for (size_t i = 0; i < sizeof(words) / sizeof(words[0]); ++i) {
+        state ^= words[i];
+        state = rng_splitmix64(&state);
+    }
+    return state;
+}
+
+static size_t per_checkpoint_data_chunks(const SumTree *tree) {
+    return (tree->capacity + tree->dirty_chunk_items - 1) / tree->dirty_chunk_items;
+}
+
+static size_t per_checkpoint_tree_pages(const SumTree *tree) {
+    return (tree->tree_size * sizeof(double) + SUM_TREE_DIRTY_PAGE - 1) / SUM_TREE_DIRTY_PAGE;
+}
+
+static void per_checkpoint_clear_dirty(SumTree *tree) {
+    memset(tree->dirty_data, 0, (per_checkpoint_data_chunks(tree) + 63) / 64 * sizeof(uint64_t));
+    memset(tree->dirty_tree, 0, (per_checkpoint_tree_pages(tree) + 63) / 64 * sizeof(uint64_t));
+}
+
+// Writes a fresh base snapshot and an empty log bound to it
+static bool per_checkpoint_rebase(PerCheckpoint *ckpt, PER *per) {
+    if (ckpt->fd >= 0) {
+        close(ckpt->fd);
+        ckpt->fd = -1;
+    }
+    if (!per_save(per, ckpt->base_path))
+        return false;
+
+    PerSnapshotHeader base = per_snapshot_header(per);
+    ckpt->base_bytes       = base.tree_offset + base.tree_bytes;
+
+    ckpt->fd = open(ckpt->log_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (ckpt->fd < 0) {
+        perror(ckpt->log_path);
+        return false;
+    }
+    PerLogHeader header = {.magic = PER_LOG_MAGIC, .version = PER_LOG_VERSION, .base_tag = per_checkpoint_tag(per)};
+    if (!per_snapshot_write_all(ckpt->fd, &header, sizeof(header), 0) || fsync(ckpt->fd) != 0) {
+        perror(ckpt->log_path);
+        return false;
+    }
+
+    ckpt->log_bytes   = sizeof(header);
+    ckpt->checkpoints = 0;
+    per_checkpoint_clear_dirty(per->tree);
+    return true;
+}
+
+void free_per_checkpoint(PerCheckpoint *ckpt) {
+    if (!ckpt)
+        return;
+    if (ckpt->fd >= 0)
+        close(ckpt->fd);
+    free(ckpt);
+}
+
+// Starts incremental checkpointing of per into base_path: turns on dirty tracking, writes the base
+// snapshot and an empty log. data_chunk_bytes 0 picks PER_CHECKPOINT_DEFAULT_CHUNK_BYTES, compact_ratio
+// 0 compacts once the log is as large as the base.
+PerCheckpoint *create_per_checkpoint(PER *per, const char *base_path, size_t data_chunk_bytes, double compact_ratio) {
+    PerCheckpoint *ckpt = (PerCheckpoint *)calloc(1, sizeof(PerCheckpoint));
+    if (ckpt == NULL) {
+        return NULL;
+    }
+    ckpt->fd            = -1;
+    ckpt->compact_ratio = compact_ratio > 0.0 ? compact_ratio : 1.0;
+
+    if (snprintf(ckpt->base_path, sizeof(ckpt->base_path), "%s", base_path) >= (int)sizeof(ckpt->base_path) ||
+        snprintf(ckpt->log_path, sizeof(ckpt->log_path), "%s.log", base_path) >= (int)sizeof(ckpt->log_path)) {
+        free_per_checkpoint(ckpt);
+        return NULL;
+    }
+
+    if (!sum_tree_track_dirty(per->tree, data_chunk_bytes > 0 ? data_chunk_bytes : PER_CHECKPOINT_DEFAULT_CHUNK_BYTES) ||
+        !per_checkpoint_rebase(ckpt, per)) {
+        free_per_checkpoint(ckpt);
+        return NULL;
+    }
+    return ckpt;
+}
+
+static bool per_checkpoint_append(PerCheckpoint *ckpt, PerLogKind kind, uint64_t offset, const void *payload, uint64_t bytes) {
+    PerLogRecord record = {.magic = PER_LOG_MAGIC, .kind = (uint32_t)kind, .offset = offset, .bytes = bytes};
+    if (!per_snapshot_write_all(ckpt->fd, &record, sizeof(record), ckpt->log_bytes) ||
+        !per_snapshot_write_all(ckpt->fd, payload, bytes, ckpt->log_bytes + sizeof(record)))
+        return false;
+    ckpt->log_bytes += sizeof(record) + bytes;
+    return true;
+}
+
+// Appends every run of set bits as one record, unit_bytes per bit, clamped to total_bytes
+static bool per_checkpoint_append_runs(PerCheckpoint *ckpt, PerLogKind kind, const uint64_t *bits, size_t count, size_t unit_bytes, const char *base, size_t total_bytes) {
+    for (size_t i = 0; i < count;) {
+        if (!(bits[i >> 6] & ((uint64_t)1 << (i & 63)))) {
+            // Skip clean words whole
+            if ((i & 63) == 0 && bits[i >> 6] == 0)
+                i += 64;
+            else
+                i++;
+            continue;
+        }
+        size_t end = i + 1;
+        while (end < count && (bits[end >> 6] & ((uint64_t)1 << (end & 63))))
+            end++;
+
+        size_t offset = i * unit_bytes;
+        size_t bytes  = min_size_t(end * unit_bytes, total_bytes) - offset;
+        if (!per_checkpoint_append(ckpt, kind, offset, base + offset, bytes))
+            return false;
+        i = end;
+    }
+    return true;
+}
+
+// Appends what changed since the previous checkpoint, or writes a new base when the log got too large.
+// Returns false on I/O errors; the previous checkpoint stays restorable either way.
+bool per_checkpoint_write(PerCheckpoint *ckpt, PER *per) {
+    if ((double)ckpt->log_bytes > ckpt->compact_ratio * (double)ckpt->base_bytes)
+        return per_checkpoint_rebase(ckpt, per);
+
+    SumTree *tree = per->tree;
+    bool     ok   = per_checkpoint_append_runs(ckpt, PER_LOG_DATA, tree->dirty_data, per_checkpoint_data_chunks(tree), tree->dirty_chunk_items * tree->elem_size,
+                                               (const char *)tree->data, tree->capacity * tree->elem_size) &&
+              per_checkpoint_append_runs(ckpt, PER_LOG_TREE, tree->dirty_tree, per_checkpoint_tree_pages(tree), SUM_TREE_DIRTY_PAGE,
+                                         (const char *)tree->priority_tree, tree->tree_size * sizeof(double));
+
+    PerLogCommit commit = {
+        .current_index = tree->current_index,
+        .num_entries   = tree->num_entries,
+        .alpha         = per->alpha,
+        .beta          = per->beta,
+        .max_priority  = per->max_priority,
+    };
+    memcpy(commit.rng, tree->rng.s, sizeof(commit.rng));
+
+    ok = ok && per_checkpoint_append(ckpt, PER_LOG_COMMIT, 0, &commit, sizeof(commit)) && fdatasync(ckpt->fd) == 0;
+    if (!ok) {
+        perror(ckpt->log_path);
+        return false;
+    }
+
+    ckpt->checkpoints++;
+    per_checkpoint_clear_dirty(tree);
+    return true;
+}
+
+// Loads base_path and replays base_path.log up to its last complete commit
+PER *per_checkpoint_restore(const char *base_path) {
+    PER *per = per_load(base_path);
+    if (per == NULL)
+        return NULL;
+
+    char log_path[4096];
+    if (snprintf(log_path, sizeof(log_path), "%s.log", base_path) >= (int)sizeof(log_path))
+        return per;
+
+    int fd = open(log_path, O_RDONLY);
+    if (fd < 0)
+        return per; // no increments since the base
+
+    PerLogHeader header;
+    if (!per_snapshot_read_all(fd, &header, sizeof(header), 0) || header.magic != PER_LOG_MAGIC || header.version != PER_LOG_VERSION ||
+        header.base_tag != per_checkpoint_tag(per)) {
+        fprintf(stderr, "%s: log does not belong to this base, ignoring it\n", log_path);
+        close(fd);
+        return per;
+    }
+
+    // First pass finds the end of the last complete checkpoint
+    SumTree     *tree       = per->tree;
+    size_t       data_bytes = tree->capacity * tree->elem_size;
+    size_t       tree_bytes = tree->tree_size * sizeof(double);
+    uint64_t     position   = sizeof(header);
+    uint64_t     committed  = position;
+    PerLogRecord record;
+    while (per_snapshot_read_all(fd, &record, sizeof(record), position) && record.magic == PER_LOG_MAGIC) {
+        uint64_t limit = record.kind == PER_LOG_DATA ? data_bytes : record.kind == PER_LOG_TREE ? tree_bytes : sizeof(PerLogCommit);
+        if (record.kind < PER_LOG_DATA || record.kind > PER_LOG_COMMIT || record.offset > limit || record.bytes > limit - record.offset)
+            break;
+        position += sizeof(record) + record.bytes;
+        if (record.kind == PER_LOG_COMMIT)
+            committed = position;
+    }
+
+    // Second pass applies it
+    bool ok  = true;
+    position = sizeof(header);
+    while (ok && position < committed) {
+        ok = per_snapshot_read_all(fd, &record, sizeof(record), position);
+        if (!ok)
+            break;
+        uint64_t payload = position + sizeof(record);
+
+        if (record.kind == PER_LOG_DATA) {
+            ok = per_snapshot_read_all(fd, (char *)tree->data + record.offset, record.bytes, payload);
+        } else if (record.kind == PER_LOG_TREE) {
+            ok = per_snapshot_read_all(fd, (char *)tree->priority_tree + record.offset, record.bytes, payload);
+        } else {
+            PerLogCommit commit;
+            ok = per_snapshot_read_all(fd, &commit, sizeof(commit), payload) && commit.current_index < tree->capacity &&
+                 commit.num_entries <= tree->capacity;
+            if (ok) {
+                tree->current_index = commit.current_index;
+                tree->num_entries   = commit.num_entries;
+                per->alpha          = commit.alpha;
+                per->beta           = commit.beta;
+                per->max_priority   = commit.max_priority;
+                memcpy(tree->rng.s, commit.rng, sizeof(commit.rng));
+            }
+        }
+        position = payload + record.bytes;
+    }
+    close(fd);
+
+    if (!ok) {
+        fprintf(stderr, "%s: cannot replay the log\n", log_path);
+        free_per(per);
+        return NULL;
+    }
+    return per;
+}
+
+// Folds base_path.log into a new base_path snapshot and removes the log
+bool per_checkpoint_compact(const char *base_path) {
+    PER *per = per_checkpoint_restore(base_path);
+    if (per == NULL)
+        return false;
+
+    char log_path[4096];
+    bool ok = per_save(per, base_path) && snprintf(log_path, sizeof(log_path), "%s.log", base_path) < (int)sizeof(log_path);
+    if (ok)
+        unlink(log_path);
+    free_per(per);
+    return ok;
+}
+
+#endif // HEADER_PER_CHECKPOINT_H
@@ -0,0 +1,299 @@
+#ifndef HEADER_PER_CONCURRENT_H
+#define HEADER_PER_CONCURRENT_H
+
+#include <pthread.h>
+#include <stdbool.h>
+
+#include "per.h"
+
+// Concurrent PER: many actor threads call concurrent_per_add while one or more learner threads sample and
+// update at the same time. There is no global lock:
+//
+// - Producers reserve slots with one atomic ticket increment per run of CONCURRENT_PER_PRODUCER_RUN
+//   slots. A thread that stops halfway through a run leaves the rest of it to the previous lap.
+// - The leaves are split into stripes, each guarded by its own mutex. A stripe owns its leaves, their
+//   payloads and every tree node of its subtree up to the stripe root.
+// - The few nodes above the stripe roots are shared by everyone and only ever changed with atomic adds.
+// - Samplers descend without taking any lock and only lock the stripe of the leaf they land on while
+//   copying its payload, so they never see a half written item.
+//
+// Every consumer brings its own Rng, so samplers never contend on a generator either.
+
+#ifndef CONCURRENT_PER_DEFAULT_STRIPES
+#define CONCURRENT_PER_DEFAULT_STRIPES 64
+#endif
+
+// Producers claim this many neighbouring slots of one stripe at a time, so consecutive adds of a thread
+// stay on the same cache lines of data and tree while different threads work in different stripes
+#ifndef CONCURRENT_PER_PRODUCER_RUN
+#define CONCURRENT_PER_PRODUCER_RUN 16
+#endif
+
+// How often a sampler redraws when a racing update let it land on an empty leaf
+#define CONCURRENT_PER_MAX_RETRIES 8
+
+typedef struct {
+    PER             *per;
+    pthread_mutex_t *stripe_locks;
+    size_t           stripe_count;
+    size_t           stripe_count_log2;
+    size_t           stripe_shift; // log2 of the leaves per stripe
+    size_t           run;          // slots per producer claim
+    uint64_t         next_ticket;  // atomic, counts slots handed out
+    uint64_t         sample_calls; // atomic, drives the beta annealing
+    uint64_t         generation;   // unique per instance, keys the producer claims
+    double           base_beta;
+} ConcurrentPER;
+
+// Source of ConcurrentPER.generation. A new instance can reuse the address of a freed one, so claims are
+// matched by generation rather than by address.
+uint64_t cper_generations;
+
+static inline double cper_load(const double *ptr) {
+    double value;
+    __atomic_load(ptr, &value, __ATOMIC_RELAXED);
+    return value;
+}
+
+static inline void cper_store(double *ptr, double value) {
+    __atomic_store(ptr, &value, __ATOMIC_RELAXED);
+}
+
+static inline void cper_atomic_add(double *ptr, double delta) {
+    double expected = cper_load(ptr);
+    double desired;
+    do {
+        desired = expected + delta;
+    } while (!__atomic_compare_exchange(ptr, &expected, &desired, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+static inline void cper_atomic_max(double *ptr, double value) {
+    double expected = cper_load(ptr);
+    while (value > expected && !__atomic_compare_exchange(ptr, &expected, &value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+static inline size_t cper_log2(size_t value) {
+    size_t log = 0;
+    while (((size_t)1 << log) < value)
+        log++;
+    return log;
+}
+
+void free_concurrent_per(ConcurrentPER *cper) {
+    if (!cper)
+        return;
+    if (cper->stripe_locks) {
+        for (size_t i = 0; i < cper->stripe_count; ++i)
+            pthread_mutex_destroy(&cper->stripe_locks[i]);
+        free(cper->stripe_locks);
+    }
+    free_per(cper->per);
+    free(cper);
+}
+
+// stripes must be a power of two, 0 picks CONCURRENT_PER_DEFAULT_STRIPES. It is capped at capacity.
+ConcurrentPER *create_concurrent_per(size_t capacity, size_t elem_size, double alpha, double beta, size_t stripes) {
+    if (stripes == 0)
+        stripes = CONCURRENT_PER_DEFAULT_STRIPES;
+    stripes = min_size_t(stripes, capacity);
+    assert((stripes & (stripes - 1)) == 0);
+
+    ConcurrentPER *cper = (ConcurrentPER *)calloc(1, sizeof(ConcurrentPER));
+    if (cper == NULL) {
+        return NULL;
+    }
+
+    // The striping relies on the implicit binary heap layout
+    cper->per = create_prioritized_replay(capacity, elem_size, alpha, beta);
+    if (cper->per == NULL) {
+        free(cper);
+        return NULL;
+    }
+
+    cper->stripe_locks = (pthread_mutex_t *)malloc(stripes * sizeof(pthread_mutex_t));
+    if (cper->stripe_locks == NULL) {
+        free_concurrent_per(cper);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < stripes; ++i) {
+        pthread_mutex_init(&cper->stripe_locks[i], NULL);
+    }
+
+    cper->stripe_count      = stripes;
+    cper->stripe_count_log2 = cper_log2(stripes);
+    cper->stripe_shift      = cper_log2(capacity) - cper->stripe_count_log2;
+    cper->run               = min_size_t(CONCURRENT_PER_PRODUCER_RUN, (size_t)1 << cper->stripe_shift);
+    cper->base_beta         = beta;
+    cper->generation        = __atomic_add_fetch(&cper_generations, 1, __ATOMIC_RELAXED);
+    return cper;
+}
+
+// Run r of a lap goes to stripe r % stripes, so consecutive claims land in different stripes and
+// concurrent producers rarely meet on a lock. Within a lap of capacity tickets every slot is still hit
+// exactly once, so the oldest entries go first as before.
+static inline size_t cper_ticket_slot(const ConcurrentPER *cper, uint64_t ticket) {
+    uint64_t run_index   = ticket / cper->run;
+    size_t   stripe      = (size_t)(run_index & (cper->stripe_count - 1));
+    size_t   stripe_runs = ((size_t)1 << cper->stripe_shift) / cper->run;
+    size_t   run_offset  = (size_t)(run_index >> cper->stripe_count_log2) % stripe_runs;
+    return (stripe << cper->stripe_shift) + run_offset * cper->run + (size_t)(ticket % cper->run);
+}
+
+// Each producer thread keeps the rest of its last claim here. Generation 0 is never handed out, so the
+// zeroed claim of a new thread matches no instance.
+typedef struct {
+    uint64_t generation;
+    uint64_t next;
+    uint64_t end;
+} ConcurrentPERClaim;
+
+static _Thread_local ConcurrentPERClaim cper_claim;
+
+static inline uint64_t cper_next_ticket(ConcurrentPER *cper) {
+    if (cper_claim.generation != cper->generation || cper_claim.next == cper_claim.end) {
+        uint64_t start = __atomic_fetch_add(&cper->next_ticket, cper->run, __ATOMIC_RELAXED);
+        cper_claim     = (ConcurrentPERClaim){.generation = cper->generation, .next = start, .end = start + cper->run};
+    }
+    return cper_claim.next++;
+}
+
+static inline size_t cper_slot_stripe(const ConcurrentPER *cper, size_t data_index) {
+    return data_index >> cper->stripe_shift;
+}
+
+// Caller holds the stripe lock of the leaf. Nodes at or below the stripe roots belong to that stripe,
+// the shared nodes above them are changed atomically.
+static void cper_set_leaf_locked(ConcurrentPER *cper, size_t tree_idx, double priority) {
+    double *tree        = cper->per->tree->priority_tree;
+    size_t  stripe_base = cper->stripe_count - 1;
+    double  delta       = priority - cper_load(&tree[tree_idx]);
+
+    cper_store(&tree[tree_idx], priority);
+
+    while (tree_idx > 0) {
+        tree_idx = (tree_idx - 1) / 2;
+        if (tree_idx >= stripe_base)
+            cper_store(&tree[tree_idx], cper_load(&tree[tree_idx]) + delta);
+        else
+            cper_atomic_add(&tree[tree_idx], delta);
+    }
+}
+
+void concurrent_per_add(ConcurrentPER *cper, const void *item) {
+    SumTree *tree   = cper->per->tree;
+    uint64_t ticket = cper_next_ticket(cper);
+    size_t   slot   = cper_ticket_slot(cper, ticket);
+    size_t   stripe = cper_slot_stripe(cper, slot);
+
+    pthread_mutex_lock(&cper->stripe_locks[stripe]);
+    memcpy(sumtree_data_ptr(tree, slot), item, tree->elem_size);
+    cper_set_leaf_locked(cper, sumtree_leaf_index(tree, slot), cper_load(&cper->per->max_priority));
+    pthread_mutex_unlock(&cper->stripe_locks[stripe]);
+
+    size_t filled = min_size_t((size_t)ticket + 1, tree->capacity);
+    size_t seen   = __atomic_load_n(&tree->num_entries, __ATOMIC_RELAXED);
+    while (filled > seen && !__atomic_compare_exchange_n(&tree->num_entries, &seen, filled, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+size_t concurrent_per_size(const ConcurrentPER *cper) {
+    return __atomic_load_n(&cper->per->tree->num_entries, __ATOMIC_RELAXED);
+}
+
+// Lock free descent over a tree that may be changing underneath. A sum can be briefly out of date with its
+// children, which at worst lands on an empty leaf; concurrent_per_sample redraws in that case.
+static size_t cper_descend(const ConcurrentPER *cper, double segment) {
+    const double *tree      = cper->per->tree->priority_tree;
+    size_t        leaf_base = sumtree_leaf_base(cper->per->tree);
+    size_t        idx       = 0;
+
+    while (idx < leaf_base) {
+        size_t left     = (idx << 1) + 1;
+        double left_sum = cper_load(&tree[left]);
+
+        if (segment <= left_sum)
+            idx = left;
+        else {
+            segment -= left_sum;
+            idx = left + 1;
+        }
+    }
+    return idx;
+}
+
+// Stratified sample of batch_size entries with the caller's generator. Writes the samples, their
+// normalized importance weights and, when out_items is not NULL, the payloads back to back. Returns false
+// when the buffer holds no priority mass yet, or when racing updates kept one of the draws on empty leaves
+// for CONCURRENT_PER_MAX_RETRIES attempts; the outputs are then incomplete and must not be used.
+bool concurrent_per_sample(ConcurrentPER *cper, Rng *rng, size_t batch_size, SumTreeSample *out_samples, double *out_weights, void *out_items) {
+    SumTree *tree  = cper->per->tree;
+    double   total = cper_load(&tree->priority_tree[0]);
+    if (total <= 0.0 || batch_size == 0) {
+        return false;
+    }
+
+    uint64_t calls = __atomic_fetch_add(&cper->sample_calls, 1, __ATOMIC_RELAXED);
+    double   beta  = fmin(1.0, cper->base_beta + BETA_INC * (double)(calls + 1));
+
+    rng_fill_stratified(rng, out_weights, batch_size, total);
+
+    size_t leaf_base = sumtree_leaf_base(tree);
+    for (size_t i = 0; i < batch_size; ++i) {
+        double target = out_weights[i];
+        bool found = false;
+        for (size_t attempt = 0; attempt < CONCURRENT_PER_MAX_RETRIES && !found; ++attempt) {
+            size_t leaf   = cper_descend(cper, target);
+            size_t slot   = leaf - leaf_base;
+            size_t stripe = cper_slot_stripe(cper, slot);
+
+            pthread_mutex_lock(&cper->stripe_locks[stripe]);
+            double priority = cper_load(&tree->priority_tree[leaf]);
+            if (priority > 0.0 && out_items != NULL)
+                memcpy((char *)out_items + i * tree->elem_size, sumtree_data_ptr(tree, slot), tree->elem_size);
+            pthread_mutex_unlock(&cper->stripe_locks[stripe]);
+
+            if (priority > 0.0) {
+                out_samples[i] = (SumTreeSample){.p_idx = leaf, .d_idx = slot, .priority = priority};
+                found          = true;
+            } else {
+                target = rng_double_range(rng, 0.0, total);
+            }
+        }
+        if (!found)
+            return false;
+    }
+
+    // The tree keeps no min tree, so the weights are normalized by the smallest sampled priority
+    for (size_t i = 0; i < batch_size; ++i) {
+        out_weights[i] = out_samples[i].priority;
+    }
+    per_normalize_priorities(out_weights, batch_size, total, 0.0, beta, out_weights);
+    return true;
+}
+
+void concurrent_per_update(ConcurrentPER *cper, const size_t *priority_indices, const double *td_errors, size_t count) {
+    SumTree *tree      = cper->per->tree;
+    size_t   leaf_base = sumtree_leaf_base(tree);
+    double   priorities[SUM_TREE_BATCH_LANES];
+
+    for (size_t start = 0; start < count; start += SUM_TREE_BATCH_LANES) {
+        size_t chunk = min_size_t(SUM_TREE_BATCH_LANES, count - start);
+        calculate_priorities(cper->per, td_errors + start, priorities, chunk);
+
+        for (size_t i = 0; i < chunk; ++i) {
+            size_t tree_idx = priority_indices[start + i];
+            assert(tree_idx >= leaf_base && tree_idx < leaf_base + tree->capacity);
+
+            size_t stripe = cper_slot_stripe(cper, tree_idx - leaf_base);
+            pthread_mutex_lock(&cper->stripe_locks[stripe]);
+            cper_set_leaf_locked(cper, tree_idx, priorities[i]);
+            pthread_mutex_unlock(&cper->stripe_locks[stripe]);
+
+            cper_atomic_max(&cper->per->max_priority, priorities[i]);
+        }
+    }
+}
+
+#endif // HEADER_PER_CONCURRENT_H
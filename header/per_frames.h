@@ -0,0 +1,180 @@
+#ifndef HEADER_PER_FRAMES_H
+#define HEADER_PER_FRAMES_H
+
+#include <stdbool.h>
+
+#include "per.h"
+
+// Frame deduplicated storage for stacked observations (Atari style). A transition with a stack of S frames
+// shares S - 1 frames with its predecessor and its next_obs shares S - 1 frames with its obs, so storing
+// stacks per slot keeps every frame about 2 * S times. Here every frame is stored once in a ring and a
+// transition only records the sequence number of the newest frame of its obs stack plus the first frame
+// of its episode. Stacks are rebuilt at gather time: frames from before the episode start are zero, like
+// the frames a fresh environment would have shown.
+//
+// Every step pushes one frame and every episode one extra reset frame, so the frame ring can be a bit
+// larger than the transition capacity. When short episodes use it up faster, the transitions whose frames
+// were overwritten get priority 0 and are never sampled again.
+
+typedef struct {
+    uint64_t obs_frame;     // sequence number of the newest frame of the obs stack
+    uint64_t episode_start; // sequence number of the episode's first frame
+} FrameRecord;
+
+typedef struct {
+    PER     *per;          // payload per slot: FrameRecord followed by extra_bytes
+    char    *frames;
+    size_t   frame_bytes;
+    size_t   frame_capacity;
+    size_t   stack;
+    size_t   extra_bytes;  // action, reward, done, ... opaque to this module
+    uint64_t next_frame;   // sequence number of the next pushed frame
+    uint64_t current;      // newest frame of the running episode
+    uint64_t episode_start;
+    uint64_t adds;         // transitions added so far
+    uint64_t first_valid;  // oldest transition whose frames are all still in the ring
+    char    *record;       // staging for one slot payload
+} FramePER;
+
+void free_frame_per(FramePER *fp) {
+    if (!fp)
+        return;
+    free_per(fp->per);
+    sumtree_aligned_free(fp->frames);
+    free(fp->record);
+    free(fp);
+}
+
+// frame_capacity 0 picks capacity + 2 * stack, enough when episodes are much longer than the stack
+FramePER *create_frame_per(size_t capacity, size_t frame_bytes, size_t stack, size_t frame_capacity, size_t extra_bytes, double alpha, double beta, SumTreeConfig config) {
+    assert(frame_bytes > 0 && stack > 0);
+
+    FramePER *fp = (FramePER *)calloc(1, sizeof(FramePER));
+    if (fp == NULL) {
+        return NULL;
+    }
+
+    if (frame_capacity == 0)
+        frame_capacity = capacity + 2 * stack;
+    assert(frame_capacity > stack);
+
+    fp->frame_bytes    = frame_bytes;
+    fp->frame_capacity = frame_capacity;
+    fp->stack          = stack;
+    fp->extra_bytes    = extra_bytes;
+    fp->per            = create_prioritized_replay_ex(capacity, sizeof(FrameRecord) + extra_bytes, alpha, beta, config);
+    fp->frames         = (char *)sumtree_aligned_calloc(frame_capacity, frame_bytes, SUM_TREE_CACHE_LINE);
+    fp->record         = (char *)calloc(1, sizeof(FrameRecord) + extra_bytes);
+    if (!fp->per || !fp->frames || !fp->record) {
+        free_frame_per(fp);
+        return NULL;
+    }
+    return fp;
+}
+
+static inline bool frame_per_frame_alive(const FramePER *fp, uint64_t seq) {
+    return seq < fp->next_frame && fp->next_frame - seq <= fp->frame_capacity;
+}
+
+static inline const FrameRecord *frame_per_record(const FramePER *fp, size_t data_index) {
+    return (const FrameRecord *)sumtree_data_ptr(fp->per->tree, data_index);
+}
+
+// Oldest frame a transition reads: the start of its obs stack, or its episode start if that is later
+static inline uint64_t frame_per_oldest_frame(const FramePER *fp, const FrameRecord *record) {
+    uint64_t stack_start = record->obs_frame + 1 >= fp->stack ? record->obs_frame + 1 - fp->stack : 0;
+    return stack_start > record->episode_start ? stack_start : record->episode_start;
+}
+
+// Drops the priority of transitions that lost a frame to the ring wrapping around. Transitions and
+// frames are both written in order, so only the oldest live transitions can be affected.
+static void frame_per_retire(FramePER *fp) {
+    SumTree *tree   = fp->per->tree;
+    uint64_t oldest = fp->adds > tree->capacity ? fp->adds - tree->capacity : 0;
+    if (fp->first_valid < oldest)
+        fp->first_valid = oldest;
+
+    while (fp->first_valid < fp->adds) {
+        size_t             slot   = (size_t)(fp->first_valid % tree->capacity);
+        const FrameRecord *record = frame_per_record(fp, slot);
+        if (frame_per_frame_alive(fp, frame_per_oldest_frame(fp, record)))
+            break;
+        sum_tree_update(tree, sumtree_leaf_index(tree, slot), 0.0);
+        fp->first_valid++;
+    }
+}
+
+static uint64_t frame_per_push_frame(FramePER *fp, const void *frame) {
+    uint64_t seq = fp->next_frame++;
+    memcpy(fp->frames + (size_t)(seq % fp->frame_capacity) * fp->frame_bytes, frame, fp->frame_bytes);
+    frame_per_retire(fp);
+    return seq;
+}
+
+// Starts an episode with the observation returned by the environment reset
+void frame_per_begin_episode(FramePER *fp, const void *first_frame) {
+    fp->episode_start = frame_per_push_frame(fp, first_frame);
+    fp->current       = fp->episode_start;
+}
+
+// Stores the transition from the current stack to the stack ending in next_frame. extra holds
+// extra_bytes of action, reward, done, ... After a terminal step call frame_per_begin_episode again.
+void frame_per_add(FramePER *fp, const void *next_frame, const void *extra) {
+    assert(fp->next_frame > 0 && "frame_per_begin_episode must come first");
+
+    FrameRecord record = {.obs_frame = fp->current, .episode_start = fp->episode_start};
+    memcpy(fp->record, &record, sizeof(FrameRecord));
+    if (fp->extra_bytes > 0)
+        memcpy(fp->record + sizeof(FrameRecord), extra, fp->extra_bytes);
+
+    // The record has to be in place before the frame push may retire it
+    add_to_per(fp->per, fp->record);
+    fp->adds++;
+    fp->current = frame_per_push_frame(fp, next_frame);
+}
+
+// Writes the stack of `stack` frames ending at newest, oldest first, zero before the episode start
+static void frame_per_build_stack(const FramePER *fp, uint64_t newest, uint64_t episode_start, char *out) {
+    for (size_t k = 0; k < fp->stack; ++k) {
+        size_t back = fp->stack - 1 - k;
+        char  *dst  = out + k * fp->frame_bytes;
+        if (newest < episode_start + back || !frame_per_frame_alive(fp, newest - back)) {
+            memset(dst, 0, fp->frame_bytes);
+            continue;
+        }
+        uint64_t seq = newest - back;
+        memcpy(dst, fp->frames + (size_t)(seq % fp->frame_capacity) * fp->frame_bytes, fp->frame_bytes);
+    }
+}
+
+// Bytes of one rebuilt observation stack
+static inline size_t frame_per_stack_bytes(const FramePER *fp) {
+    return fp->stack * fp->frame_bytes;
+}
+
+// Rebuilds obs and, when out_next_obs is not NULL, next_obs of every sample, frame_per_stack_bytes each,
+// back to back in sample order
+void frame_per_gather(const FramePER *fp, const Batch *batch, void *out_obs, void *out_next_obs) {
+    size_t stack_bytes = frame_per_stack_bytes(fp);
+
+    for (size_t i = 0; i < batch->count; ++i) {
+        const FrameRecord *record = frame_per_record(fp, batch->items[i].d_idx);
+        frame_per_build_stack(fp, record->obs_frame, record->episode_start, (char *)out_obs + i * stack_bytes);
+        if (out_next_obs != NULL)
+            frame_per_build_stack(fp, record->obs_frame + 1, record->episode_start, (char *)out_next_obs + i * stack_bytes);
+    }
+}
+
+// Copies the extra bytes of every sample, back to back in sample order
+void frame_per_gather_extra(const FramePER *fp, const Batch *batch, void *out) {
+    for (size_t i = 0; i < batch->count; ++i) {
+        const char *record = (const char *)frame_per_record(fp, batch->items[i].d_idx);
+        memcpy((char *)out + i * fp->extra_bytes, record + sizeof(FrameRecord), fp->extra_bytes);
+    }
+}
+
+void frame_per_sample(FramePER *fp, Batch *batch, size_t batch_size) {
+    sample_from_per_into(fp->per, batch, batch_size, NULL);
+}
+
+#endif // HEADER_PER_FRAMES_H
@@ -0,0 +1,277 @@
+#ifndef HEADER_PER_PREFETCH_H
+#define HEADER_PER_PREFETCH_H
+
+#include <pthread.h>
+#include <stdbool.h>
+
+#include "per.h"
+
+// Batch prefetcher: a worker thread keeps up to `depth` finished batches (samples, importance weights and
+// gathered payloads) in a ring, so the learner pops a ready batch in O(1) instead of waiting for the
+// descent and the copies. Adds and priority updates go through prefetch_per_add / prefetch_per_update,
+// which share the tree lock with the worker and count every mutation.
+//
+// A prefetched batch was drawn from the tree as it was at that moment. What pop does about later changes
+// is the PrefetchPolicy:
+// - PREFETCH_ALLOW_STALE: hand the batch out as is, the cheapest option
+// - PREFETCH_DISCARD_STALE: drop batches with an overwritten slot or more than max_age_updates priority
+//   updates behind, and take the next one
+// - PREFETCH_REFRESH: keep the indices, but re-read current priorities, recopy overwritten payloads and
+//   recompute the weights under the tree lock, O(batch)
+
+#ifndef PREFETCH_PER_DEFAULT_DEPTH
+#define PREFETCH_PER_DEFAULT_DEPTH 4
+#endif
+
+typedef enum {
+    PREFETCH_ALLOW_STALE = 0,
+    PREFETCH_DISCARD_STALE,
+    PREFETCH_REFRESH,
+} PrefetchPolicy;
+
+typedef struct {
+    size_t         depth; // ready batches kept ahead
+    size_t         batch_size;
+    PrefetchPolicy policy;
+    size_t         max_age_updates; // PREFETCH_DISCARD_STALE only, 0 ignores priority updates
+} PrefetchConfig;
+
+typedef struct {
+    SumTreeSample *samples;
+    double        *weights;
+    void          *items;
+    size_t         count;
+    uint64_t       adds_at_sample;
+    uint64_t       updates_at_sample;
+    size_t         cursor_at_sample; // tree->current_index when the batch was drawn
+} PrefetchBatch;
+
+typedef struct {
+    PER            *per; // not owned
+    PrefetchConfig  config;
+    pthread_mutex_t tree_lock;
+    uint64_t        adds;    // guarded by tree_lock
+    uint64_t        updates; // priorities changed, guarded by tree_lock
+    PrefetchBatch  *slots;   // depth + 1: the extra one is the batch the learner holds
+    size_t          slot_count;
+    size_t          read_pos;
+    size_t          ready;
+    uint64_t        dropped;
+    int             stop;
+    pthread_mutex_t ring_lock;
+    pthread_cond_t  not_full;
+    pthread_cond_t  not_empty;
+    pthread_t       thread;
+    bool            running;
+} PrefetchPER;
+
+static bool prefetch_per_fill(PrefetchPER *pp, PrefetchBatch *slot) {
+    bool filled = false;
+
+    pthread_mutex_lock(&pp->tree_lock);
+    if (pp->per->tree->num_entries >= pp->config.batch_size && sum_tree_total(pp->per->tree) > 0.0) {
+        sample_from_per_fused(pp->per, pp->config.batch_size, slot->samples, slot->weights, slot->items);
+        slot->count             = pp->config.batch_size;
+        slot->adds_at_sample    = pp->adds;
+        slot->updates_at_sample = pp->updates;
+        slot->cursor_at_sample  = pp->per->tree->current_index;
+        filled                  = true;
+    }
+    pthread_mutex_unlock(&pp->tree_lock);
+    return filled;
+}
+
+static void *prefetch_per_worker(void *arg) {
+    PrefetchPER *pp = (PrefetchPER *)arg;
+
+    pthread_mutex_lock(&pp->ring_lock);
+    while (!pp->stop) {
+        if (pp->ready == pp->config.depth) {
+            pthread_cond_wait(&pp->not_full, &pp->ring_lock);
+            continue;
+        }
+        // With depth + 1 slots the write position never reaches the slot the learner holds
+        PrefetchBatch *slot = &pp->slots[(pp->read_pos + pp->ready) % pp->slot_count];
+        pthread_mutex_unlock(&pp->ring_lock);
+
+        bool filled = prefetch_per_fill(pp, slot);
+
+        pthread_mutex_lock(&pp->ring_lock);
+        if (filled) {
+            pp->ready++;
+            pthread_cond_signal(&pp->not_empty);
+        } else if (!pp->stop) {
+            // Not enough entries yet, look again shortly
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += 1000000L;
+            deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+            deadline.tv_nsec %= 1000000000L;
+            pthread_cond_timedwait(&pp->not_full, &pp->ring_lock, &deadline);
+        }
+    }
+    pthread_mutex_unlock(&pp->ring_lock);
+    return NULL;
+}
+
+void free_prefetch_per(PrefetchPER *pp) {
+    if (!pp)
+        return;
+    if (pp->running) {
+        pthread_mutex_lock(&pp->ring_lock);
+        pp->stop = 1;
+        pthread_cond_broadcast(&pp->not_full);
+        pthread_mutex_unlock(&pp->ring_lock);
+        pthread_join(pp->thread, NULL);
+    }
+    if (pp->slots) {
+        for (size_t i = 0; i < pp->slot_count; ++i) {
+            free(pp->slots[i].samples);
+            free(pp->slots[i].weights);
+            free(pp->slots[i].items);
+        }
+    }
+    free(pp->slots);
+    pthread_mutex_destroy(&pp->tree_lock);
+    pthread_mutex_destroy(&pp->ring_lock);
+    pthread_cond_destroy(&pp->not_full);
+    pthread_cond_destroy(&pp->not_empty);
+    free(pp);
+}
+
+// Starts the worker for an existing PER. The PER stays owned by the caller and must outlive the returned
+// handle; while it is alive, touch the PER only through the prefetch_per_* calls.
+PrefetchPER *create_prefetch_per(PER *per, PrefetchConfig config) {
+    assert(per && per->tree && config.batch_size > 0);
+
+    PrefetchPER *pp = (PrefetchPER *)calloc(1, sizeof(PrefetchPER));
+    if (pp == NULL) {
+        return NULL;
+    }
+    pthread_mutex_init(&pp->tree_lock, NULL);
+    pthread_mutex_init(&pp->ring_lock, NULL);
+    pthread_cond_init(&pp->not_full, NULL);
+    pthread_cond_init(&pp->not_empty, NULL);
+
+    if (config.depth == 0)
+        config.depth = PREFETCH_PER_DEFAULT_DEPTH;
+
+    pp->per        = per;
+    pp->config     = config;
+    pp->slot_count = config.depth + 1;
+    pp->slots      = (PrefetchBatch *)calloc(pp->slot_count, sizeof(PrefetchBatch));
+    if (pp->slots == NULL) {
+        free_prefetch_per(pp);
+        return NULL;
+    }
+    for (size_t i = 0; i < pp->slot_count; ++i) {
+        PrefetchBatch *slot = &pp->slots[i];
+        slot->samples       = (SumTreeSample *)malloc(config.batch_size * sizeof(SumTreeSample));
+        slot->weights       = (double *)malloc(config.batch_size * sizeof(double));
+        slot->items         = malloc(config.batch_size * per->tree->elem_size);
+        if (!slot->samples || !slot->weights || !slot->items) {
+            free_prefetch_per(pp);
+            return NULL;
+        }
+    }
+
+    if (pthread_create(&pp->thread, NULL, prefetch_per_worker, pp) != 0) {
+        free_prefetch_per(pp);
+        return NULL;
+    }
+    pp->running = true;
+    return pp;
+}
+
+void prefetch_per_add(PrefetchPER *pp, const void *item) {
+    pthread_mutex_lock(&pp->tree_lock);
+    add_to_per(pp->per, item);
+    pp->adds++;
+    pthread_mutex_unlock(&pp->tree_lock);
+}
+
+void prefetch_per_update(PrefetchPER *pp, size_t *priority_indices, const double *td_errors, size_t count) {
+    TD_ERRORS td = {.items = (double *)td_errors, .count = count, .capacity = count};
+
+    pthread_mutex_lock(&pp->tree_lock);
+    update_per_priorities(pp->per, &td, priority_indices);
+    pp->updates += count;
+    pthread_mutex_unlock(&pp->tree_lock);
+}
+
+// Whether slot d_idx was rewritten by an add made after the batch was drawn. Adds write the ring from
+// cursor_at_sample onwards, so the overwritten slots are the first (adds since) positions after it.
+static inline bool prefetch_per_overwritten(const PrefetchPER *pp, const PrefetchBatch *batch, size_t d_idx) {
+    uint64_t since    = pp->adds - batch->adds_at_sample;
+    size_t   capacity = pp->per->tree->capacity;
+    if (since >= capacity)
+        return true;
+    size_t distance = (d_idx + capacity - batch->cursor_at_sample) % capacity;
+    return distance < since;
+}
+
+// Caller holds tree_lock
+static bool prefetch_per_is_stale(const PrefetchPER *pp, const PrefetchBatch *batch) {
+    if (pp->config.max_age_updates > 0 && pp->updates - batch->updates_at_sample > pp->config.max_age_updates)
+        return true;
+    if (pp->adds == batch->adds_at_sample)
+        return false;
+    for (size_t i = 0; i < batch->count; ++i) {
+        if (prefetch_per_overwritten(pp, batch, batch->samples[i].d_idx))
+            return true;
+    }
+    return false;
+}
+
+// Caller holds tree_lock
+static void prefetch_per_refresh(PrefetchPER *pp, PrefetchBatch *batch) {
+    SumTree *tree      = pp->per->tree;
+    size_t   elem_size = tree->elem_size;
+    bool     recopy    = pp->adds != batch->adds_at_sample;
+
+    for (size_t i = 0; i < batch->count; ++i) {
+        SumTreeSample *sample = &batch->samples[i];
+        sample->priority      = sum_tree_priority(tree, sample->p_idx);
+        if (recopy && prefetch_per_overwritten(pp, batch, sample->d_idx))
+            memcpy((char *)batch->items + i * elem_size, sumtree_data_ptr(tree, sample->d_idx), elem_size);
+    }
+
+    per_normalize_weights(tree, batch->samples, batch->count, pp->per->beta, batch->weights);
+
+    batch->adds_at_sample    = pp->adds;
+    batch->updates_at_sample = pp->updates;
+    batch->cursor_at_sample  = tree->current_index;
+}
+
+// Hands out the oldest ready batch, waiting for the worker when none is ready. The returned batch stays
+// valid until the next pop.
+const PrefetchBatch *prefetch_per_pop(PrefetchPER *pp) {
+    for (;;) {
+        pthread_mutex_lock(&pp->ring_lock);
+        while (pp->ready == 0) {
+            pthread_cond_wait(&pp->not_empty, &pp->ring_lock);
+        }
+        PrefetchBatch *batch = &pp->slots[pp->read_pos];
+        pp->read_pos         = (pp->read_pos + 1) % pp->slot_count;
+        pp->ready--;
+        pthread_cond_signal(&pp->not_full);
+        pthread_mutex_unlock(&pp->ring_lock);
+
+        if (pp->config.policy == PREFETCH_ALLOW_STALE)
+            return batch;
+
+        pthread_mutex_lock(&pp->tree_lock);
+        bool keep = true;
+        if (pp->config.policy == PREFETCH_REFRESH)
+            prefetch_per_refresh(pp, batch);
+        else
+            keep = !prefetch_per_is_stale(pp, batch);
+        pthread_mutex_unlock(&pp->tree_lock);
+
+        if (keep)
+            return batch;
+        __atomic_fetch_add(&pp->dropped, 1, __ATOMIC_RELAXED);
+    }
+}
+
+#endif // HEADER_PER_PREFETCH_H
@@ -0,0 +1,205 @@
+#ifndef HEADER_PER_PROTOCOL_H
+#define HEADER_PER_PROTOCOL_H
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Wire format of per_server (src/per_server.c), a process that owns PER tables and serves them over a
+// Unix domain socket. All integers and doubles are little endian, all structs are packed by explicit
+// padding so any language can read them with fixed offsets.
+//
+// Every request is a PerWireRequest followed by `length` body bytes, every response a PerWireResponse
+// followed by `length` body bytes. Requests may be pipelined: a client can send many before reading any
+// response. Responses come back in request order and carry the request's tag; the server answers all
+// requests it has received with as few writes as possible.
+//
+// Large payloads can skip the socket: after PER_OP_ATTACH with the name of a POSIX shared memory
+// segment, PER_WIRE_SHM inserts read their items from that segment at shm_offset and PER_WIRE_SHM samples
+// write their items into it, so only indices and weights travel through the socket.
+//
+//   op                 request body                                      response body
+//   PER_OP_CREATE      PerWireCreate                                     PerWireCreated
+//   PER_OP_INSERT      PerWireInsert + count * elem_size item bytes      empty
+//   PER_OP_SAMPLE      PerWireSample                                     batch_size PerWireSampleItem + items
+//   PER_OP_UPDATE      PerWireUpdate + count uint64 p_idx + count double empty
+//   PER_OP_STATS       empty                                             PerWireStats
+//   PER_OP_ATTACH      segment name, without the terminating zero        empty
+
+// Bodies larger than this close the connection, the stream cannot be trusted past them
+#define PER_WIRE_MAX_MESSAGE ((uint32_t)64 << 20)
+#define PER_WIRE_MAX_SHM_NAME 255
+
+typedef enum {
+    PER_OP_CREATE = 1,
+    PER_OP_INSERT,
+    PER_OP_SAMPLE,
+    PER_OP_UPDATE,
+    PER_OP_STATS,
+    PER_OP_ATTACH,
+} PerWireOp;
+
+typedef enum {
+    PER_WIRE_OK         = 0,
+    PER_WIRE_EBADOP     = -1, // unknown op
+    PER_WIRE_ETABLE     = -2, // no such table, or no room for another one
+    PER_WIRE_EMALFORMED = -3, // body size or contents do not match the op
+    PER_WIRE_EEMPTY     = -4, // fewer entries than the batch size
+    PER_WIRE_ESHM       = -5, // no segment attached, it cannot be opened or the range is outside it
+    PER_WIRE_ENOMEM     = -6,
+} PerWireStatus;
+
+// Flags of PerWireInsert and PerWireSample
+#define PER_WIRE_SHM 1u
+
+typedef struct {
+    uint16_t op;
+    uint16_t table;
+    uint32_t length;
+    uint64_t tag; // echoed in the response
+} PerWireRequest;
+
+typedef struct {
+    uint16_t op;
+    int16_t  status; // PerWireStatus, the body is empty unless PER_WIRE_OK
+    uint32_t length;
+    uint64_t tag;
+} PerWireResponse;
+
+typedef struct {
+    uint64_t capacity; // power of two
+    uint64_t elem_size;
+    double   alpha;
+    double   beta;
+    uint32_t layout; // SumTreeLayout
+    uint32_t reserved;
+} PerWireCreate;
+
+typedef struct {
+    uint32_t table;
+    uint32_t reserved;
+} PerWireCreated;
+
+typedef struct {
+    uint32_t count;
+    uint32_t flags;
+    uint64_t shm_offset;
+} PerWireInsert;
+
+typedef struct {
+    uint32_t batch_size;
+    uint32_t flags;
+    uint64_t shm_offset;
+} PerWireSample;
+
+typedef struct {
+    uint64_t p_idx; // what PER_OP_UPDATE takes back
+    uint64_t d_idx;
+    double   weight;
+} PerWireSampleItem;
+
+typedef struct {
+    uint32_t count;
+    uint32_t reserved;
+} PerWireUpdate;
+
+typedef struct {
+    uint64_t size;
+    uint64_t capacity;
+    uint64_t elem_size;
+    double   total;
+    double   max_priority;
+    double   beta;
+} PerWireStats;
+
+_Static_assert(sizeof(PerWireRequest) == 16, "PerWireRequest must stay 16 bytes");
+_Static_assert(sizeof(PerWireResponse) == 16, "PerWireResponse must stay 16 bytes");
+_Static_assert(sizeof(PerWireSampleItem) == 24, "PerWireSampleItem must stay 24 bytes");
+
+// Minimal blocking client, enough for C callers and tests. Returns the socket or -1.
+int per_client_connect(const char *socket_path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "%s: socket path too long\n", socket_path);
+        return -1;
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        perror(socket_path);
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Sends one request whose body is the concatenation of parts
+bool per_client_send(int fd, uint16_t op, uint16_t table, uint64_t tag, const struct iovec *parts, size_t part_count) {
+    struct iovec iov[8];
+    if (part_count + 1 > sizeof(iov) / sizeof(iov[0]))
+        return false;
+
+    PerWireRequest request = {.op = op, .table = table, .tag = tag};
+    size_t         total   = sizeof(request);
+    for (size_t i = 0; i < part_count; ++i) {
+        request.length += (uint32_t)parts[i].iov_len;
+        iov[i + 1] = parts[i];
+    }
+    iov[0] = (struct iovec){.iov_base = &request, .iov_len = sizeof(request)};
+    total += request.length;
+
+    struct msghdr msg = {.msg_iov = iov, .msg_iovlen = part_count + 1};
+    while (total > 0) {
+        ssize_t sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR)
+            continue;
+        if (sent <= 0)
+            return false;
+        total -= (size_t)sent;
+        // Skip what went out and retry the rest
+        while (sent > 0 && msg.msg_iovlen > 0) {
+            size_t step = (size_t)sent < msg.msg_iov->iov_len ? (size_t)sent : msg.msg_iov->iov_len;
+            msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + step;
+            msg.msg_iov->iov_len -= step;
+            sent -= (ssize_t)step;
+            if (msg.msg_iov->iov_len == 0) {
+                msg.msg_iov++;
+                msg.msg_iovlen--;
+            }
+        }
+    }
+    return true;
+}
+
+static inline bool per_client_read_all(int fd, void *buffer, size_t bytes) {
+    char *dst = (char *)buffer;
+    while (bytes > 0) {
+        ssize_t got = recv(fd, dst, bytes, 0);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            return false;
+        dst += got;
+        bytes -= (size_t)got;
+    }
+    return true;
+}
+
+// Reads the next response; its body goes to body, which must hold at least response->length bytes
+bool per_client_recv(int fd, PerWireResponse *response, void *body, size_t capacity) {
+    if (!per_client_read_all(fd, response, sizeof(*response)))
+        return false;
+    if (response->length > capacity)
+        return false;
+    return per_client_read_all(fd, body, response->length);
+}
+
+#endif // HEADER_PER_PROTOCOL_H
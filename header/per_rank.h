@@ -0,0 +1,403 @@
+#ifndef HEADER_PER_RANK_H
+#define HEADER_PER_RANK_H
+
+#include <stdbool.h>
+
+#include "per.h"
+
+// Rank-based prioritization: P(i) is proportional to rank(i)^-alpha, where rank 1 is the largest
+// |td error|. Ranks come from an array of (priority, slot) entries that is kept approximately sorted:
+//
+// - the array is a binary max-heap, so adds and updates are O(log n) sifts and the top entry is always
+//   exact. A descending sorted array is a valid heap, and a heap stays roughly sorted.
+// - a merge sort of a snapshot of the priorities runs in slices on every sample call, its last pass also
+//   writes the new positions. After sort_interval calls the sorted snapshot replaces the heap. Slots whose
+//   priority changed during the cycle are sifted again over the next calls, then the next cycle starts.
+//
+// Batches are stratified over ranks: the rank distribution is cut into batch_size segments of equal mass
+// once per buffer size, and each sample draws a rank uniformly inside its segment. A draw is O(batch),
+// with no tree descent.
+
+#ifndef RANK_PER_DEFAULT_SORT_INTERVAL
+#define RANK_PER_DEFAULT_SORT_INTERVAL 1024
+#endif
+
+typedef struct {
+    double priority; // |td error| + EPS, alpha applies to the rank instead
+    size_t slot;
+} RankEntry;
+
+typedef struct {
+    size_t batch_size;
+    size_t sort_interval; // sample calls per full sort cycle, 0 picks RANK_PER_DEFAULT_SORT_INTERVAL
+} RankConfig;
+
+typedef struct {
+    size_t     capacity;
+    size_t     elem_size;
+    char      *data;
+    size_t     count;
+    size_t     cursor;
+    double     alpha;
+    double     beta;
+    RankConfig config;
+    RankEntry *heap;     // heap order, roughly rank order
+    size_t    *pos;      // slot -> heap position
+    double    *priority; // slot -> priority, same as its heap entry
+    // Segment boundaries: segment k holds the ranks [bounds[k], bounds[k + 1]), 1 based
+    size_t *bounds;
+    size_t  bounds_count; // buffer size the boundaries were computed for
+    // Incremental merge sort of a snapshot of the heap
+    RankEntry *sorted;
+    RankEntry *scratch;
+    size_t    *sort_pos;     // slot -> position in the sorted snapshot
+    uint8_t   *touched;      // slot changed since the snapshot
+    size_t    *touched_list;
+    size_t     touched_count;
+    size_t     replayed; // touched slots sifted again after the install
+    size_t     sort_count;
+    size_t     sort_width;
+    size_t     sort_lo;
+    size_t     sort_i;
+    size_t     sort_j;
+    size_t     sort_k;
+    size_t     sort_passes;
+    size_t     sort_budget; // entries merged per sample call
+    bool       sorting;
+    uint64_t   sorts; // completed cycles
+    Rng        rng;
+} RankPER;
+
+void free_rank_per(RankPER *rp) {
+    if (!rp)
+        return;
+    sumtree_aligned_free(rp->data);
+    free(rp->heap);
+    free(rp->pos);
+    free(rp->priority);
+    free(rp->bounds);
+    free(rp->sorted);
+    free(rp->scratch);
+    free(rp->sort_pos);
+    free(rp->touched);
+    free(rp->touched_list);
+    free(rp);
+}
+
+RankPER *create_rank_per(size_t capacity, size_t elem_size, double alpha, double beta, RankConfig config) {
+    assert(capacity > 0 && config.batch_size > 0);
+
+    RankPER *rp = (RankPER *)calloc(1, sizeof(RankPER));
+    if (rp == NULL) {
+        return NULL;
+    }
+
+    if (config.sort_interval == 0)
+        config.sort_interval = RANK_PER_DEFAULT_SORT_INTERVAL;
+
+    rp->capacity     = capacity;
+    rp->elem_size    = elem_size;
+    rp->alpha        = alpha;
+    rp->beta         = beta;
+    rp->config       = config;
+    rp->heap         = (RankEntry *)malloc(capacity * sizeof(RankEntry));
+    rp->pos          = (size_t *)malloc(capacity * sizeof(size_t));
+    rp->priority     = (double *)malloc(capacity * sizeof(double));
+    rp->bounds       = (size_t *)malloc((config.batch_size + 1) * sizeof(size_t));
+    rp->sorted       = (RankEntry *)malloc(capacity * sizeof(RankEntry));
+    rp->scratch      = (RankEntry *)malloc(capacity * sizeof(RankEntry));
+    rp->sort_pos     = (size_t *)malloc(capacity * sizeof(size_t));
+    rp->touched      = (uint8_t *)calloc(capacity, sizeof(uint8_t));
+    rp->touched_list = (size_t *)malloc(capacity * sizeof(size_t));
+    if (elem_size > 0)
+        rp->data = (char *)sumtree_aligned_alloc(capacity * elem_size, SUM_TREE_CACHE_LINE);
+    if (!rp->heap || !rp->pos || !rp->priority || !rp->bounds || !rp->sorted || !rp->scratch || !rp->sort_pos || !rp->touched ||
+        !rp->touched_list || (elem_size > 0 && !rp->data)) {
+        free_rank_per(rp);
+        return NULL;
+    }
+
+    rng_seed(&rp->rng, (uint64_t)time(NULL) ^ (uint64_t)(uintptr_t)rp);
+    return rp;
+}
+
+void rank_per_seed(RankPER *rp, uint64_t seed) {
+    rng_seed(&rp->rng, seed);
+}
+
+static inline void rank_per_place(RankPER *rp, size_t position, RankEntry entry) {
+    rp->heap[position]  = entry;
+    rp->pos[entry.slot] = position;
+}
+
+static void rank_per_sift_up(RankPER *rp, size_t position) {
+    RankEntry entry = rp->heap[position];
+    while (position > 0) {
+        size_t parent = (position - 1) / 2;
+        if (rp->heap[parent].priority >= entry.priority)
+            break;
+        rank_per_place(rp, position, rp->heap[parent]);
+        position = parent;
+    }
+    rank_per_place(rp, position, entry);
+}
+
+static void rank_per_sift_down(RankPER *rp, size_t position) {
+    RankEntry entry = rp->heap[position];
+    for (;;) {
+        size_t child = 2 * position + 1;
+        if (child >= rp->count)
+            break;
+        if (child + 1 < rp->count && rp->heap[child + 1].priority > rp->heap[child].priority)
+            child++;
+        if (rp->heap[child].priority <= entry.priority)
+            break;
+        rank_per_place(rp, position, rp->heap[child]);
+        position = child;
+    }
+    rank_per_place(rp, position, entry);
+}
+
+static void rank_per_set_priority(RankPER *rp, size_t slot, double priority) {
+    size_t position = rp->pos[slot];
+    double old      = rp->heap[position].priority;
+
+    rp->heap[position].priority = priority;
+    rp->priority[slot]          = priority;
+    if (priority > old)
+        rank_per_sift_up(rp, position);
+    else
+        rank_per_sift_down(rp, position);
+}
+
+// Remembers slots of the running snapshot whose priority changes, the install sifts them again
+static inline void rank_per_touch(RankPER *rp, size_t slot) {
+    if (rp->sorting && slot < rp->sort_count && !rp->touched[slot]) {
+        rp->touched[slot]                     = 1;
+        rp->touched_list[rp->touched_count++] = slot;
+    }
+}
+
+// Largest priority in the buffer, what new transitions start with
+static inline double rank_per_max_priority(const RankPER *rp) {
+    return rp->count > 0 ? rp->heap[0].priority : 1.0;
+}
+
+void rank_per_add(RankPER *rp, const void *item) {
+    size_t slot = rp->cursor;
+    if (rp->elem_size > 0)
+        memcpy(rp->data + slot * rp->elem_size, item, rp->elem_size);
+
+    double priority = rank_per_max_priority(rp);
+    if (rp->count < rp->capacity) {
+        rp->priority[slot] = priority;
+        rank_per_place(rp, rp->count++, (RankEntry){.priority = priority, .slot = slot});
+        rank_per_sift_up(rp, rp->count - 1);
+    } else {
+        rank_per_touch(rp, slot);
+        rank_per_set_priority(rp, slot, priority);
+    }
+
+    rp->cursor = (rp->cursor + 1) % rp->capacity;
+}
+
+void rank_per_update(RankPER *rp, const size_t *slots, const double *td_errors, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        assert(slots[i] < rp->count);
+        rank_per_touch(rp, slots[i]);
+        rank_per_set_priority(rp, slots[i], fabs(td_errors[i]) + EPS);
+    }
+}
+
+// Cuts ranks 1..n into batch_size segments of equal rank^-alpha mass, each holding at least one rank
+static void rank_per_compute_bounds(RankPER *rp, size_t n) {
+    size_t batch = rp->config.batch_size;
+    double ranks[SUM_TREE_BATCH_LANES];
+    double mass[SUM_TREE_BATCH_LANES];
+
+    // Two passes over the ranks: the total, then the boundaries
+    double total = 0.0;
+    for (size_t pass = 0; pass < 2; ++pass) {
+        double cumulative = 0.0;
+        size_t segment    = 1;
+        for (size_t start = 0; start < n; start += SUM_TREE_BATCH_LANES) {
+            size_t chunk = min_size_t(SUM_TREE_BATCH_LANES, n - start);
+            for (size_t i = 0; i < chunk; ++i) {
+                ranks[i] = 1.0 / (double)(start + i + 1);
+            }
+            per_pow_batch(ranks, rp->alpha, mass, chunk);
+
+            for (size_t i = 0; i < chunk; ++i) {
+                cumulative += mass[i];
+                while (pass == 1 && segment < batch && cumulative >= total * (double)segment / (double)batch) {
+                    rp->bounds[segment++] = start + i + 2; // the next segment starts after this rank
+                }
+            }
+        }
+        total = cumulative;
+    }
+
+    rp->bounds[0]     = 1;
+    rp->bounds[batch] = n + 1;
+    // Keep every segment non empty, pushing boundaries up from the top and down from the bottom
+    for (size_t k = 1; k < batch; ++k) {
+        rp->bounds[k] = max_size_t(rp->bounds[k], rp->bounds[k - 1] + 1);
+    }
+    for (size_t k = batch; k-- > 1;) {
+        rp->bounds[k] = min_size_t(rp->bounds[k], rp->bounds[k + 1] - 1);
+    }
+    rp->bounds_count = n;
+}
+
+// The snapshot is taken lazily: the first pass reads entries by slot from the per slot priorities, a slot
+// changed before it is read is already marked touched
+static void rank_per_start_sort(RankPER *rp) {
+    rp->sort_count = rp->count;
+    rp->sort_width = 1;
+    rp->sort_lo    = 0;
+    rp->sort_i     = 0;
+    rp->sort_j     = min_size_t(1, rp->count);
+    rp->sort_k     = 0;
+    rp->sorting    = true;
+
+    // A merge sort moves every entry once per pass
+    rp->sort_passes = 1;
+    while (((size_t)1 << rp->sort_passes) < rp->count)
+        rp->sort_passes++;
+    rp->sort_budget = max_size_t(1, (rp->count * rp->sort_passes + rp->config.sort_interval - 1) / rp->config.sort_interval);
+}
+
+// Replaces the heap with the sorted snapshot, which is a valid heap with the snapshot priorities. The
+// last merge pass already wrote the positions, so this is O(1) swaps and pushes for slots first written
+// after the snapshot (the buffer was filling). Touched slots keep their snapshot priority in the heap
+// until rank_per_replay sifts them, rp->priority has the current one meanwhile.
+static void rank_per_install_sort(RankPER *rp) {
+    size_t count = rp->count;
+
+    RankEntry *heap = rp->heap;
+    size_t    *pos  = rp->pos;
+    rp->heap        = rp->sorted;
+    rp->sorted      = heap;
+    rp->pos         = rp->sort_pos;
+    rp->sort_pos    = pos;
+    rp->count       = rp->sort_count;
+    rp->sorting     = false;
+    rp->replayed    = 0;
+
+    while (rp->count < count) {
+        size_t slot = rp->count;
+        rank_per_place(rp, rp->count++, (RankEntry){.priority = rp->priority[slot], .slot = slot});
+        rank_per_sift_up(rp, rp->count - 1);
+    }
+    rp->sorts++;
+}
+
+// Sifts up to budget touched slots to their current priority
+static void rank_per_replay(RankPER *rp, size_t budget) {
+    size_t end = min_size_t(rp->touched_count, rp->replayed + budget);
+    for (; rp->replayed < end; ++rp->replayed) {
+        size_t slot       = rp->touched_list[rp->replayed];
+        rp->touched[slot] = 0;
+        rank_per_set_priority(rp, slot, rp->priority[slot]);
+    }
+    if (rp->replayed == rp->touched_count) {
+        rp->touched_count = 0;
+        rp->replayed      = 0;
+    }
+}
+
+static inline RankEntry rank_per_sort_read(const RankPER *rp, size_t index) {
+    if (rp->sort_width == 1)
+        return (RankEntry){.priority = rp->priority[index], .slot = index};
+    return rp->sorted[index];
+}
+
+// Does up to budget entries of merge work, descending by priority
+static void rank_per_sort_work(RankPER *rp, size_t budget) {
+    size_t n = rp->sort_count;
+
+    while (budget > 0) {
+        if (rp->sort_width >= n) {
+            rank_per_install_sort(rp);
+            return;
+        }
+
+        size_t mid  = min_size_t(rp->sort_lo + rp->sort_width, n);
+        size_t hi   = min_size_t(rp->sort_lo + 2 * rp->sort_width, n);
+        bool   last = 2 * rp->sort_width >= n; // the pass that writes the final positions
+        while (budget > 0 && (rp->sort_i < mid || rp->sort_j < hi)) {
+            bool left = rp->sort_j >= hi ||
+                        (rp->sort_i < mid && rank_per_sort_read(rp, rp->sort_i).priority >= rank_per_sort_read(rp, rp->sort_j).priority);
+            RankEntry entry = left ? rank_per_sort_read(rp, rp->sort_i++) : rank_per_sort_read(rp, rp->sort_j++);
+            if (last)
+                rp->sort_pos[entry.slot] = rp->sort_k;
+            rp->scratch[rp->sort_k++] = entry;
+            budget--;
+        }
+        if (rp->sort_i < mid || rp->sort_j < hi)
+            return;
+
+        // Next pair of runs, or the next pass with twice the width
+        rp->sort_lo = hi;
+        if (rp->sort_lo >= n) {
+            RankEntry *swap = rp->sorted;
+            rp->sorted      = rp->scratch;
+            rp->scratch     = swap;
+            rp->sort_width *= 2;
+            rp->sort_lo     = 0;
+        }
+        rp->sort_i = rp->sort_lo;
+        rp->sort_j = min_size_t(rp->sort_lo + rp->sort_width, n);
+        rp->sort_k = rp->sort_lo;
+    }
+}
+
+// One learner step of the amortized sort, called by every sample
+void rank_per_step(RankPER *rp) {
+    // A sift costs about as much as sort_passes merged entries
+    if (rp->touched_count > 0 && !rp->sorting) {
+        rank_per_replay(rp, rp->sort_budget / rp->sort_passes + 1);
+        return;
+    }
+    if (!rp->sorting) {
+        if (rp->count < 2)
+            return;
+        rank_per_start_sort(rp);
+    }
+    rank_per_sort_work(rp, rp->sort_budget);
+}
+
+// Draws config.batch_size samples, one per rank segment. p_idx and d_idx are both the slot, pass d_idx
+// back to rank_per_update. When out_items is not NULL the payloads are copied into it back to back.
+void rank_per_sample(RankPER *rp, Batch *batch, void *out_items) {
+    size_t batch_size = rp->config.batch_size;
+    assert(batch->capacity >= batch_size);
+    assert(rp->count >= batch_size);
+
+    // Boundaries are recomputed as the buffer grows by a sixteenth, so filling stays O(n) overall
+    if (rp->bounds_count == 0 || (rp->count != rp->bounds_count && (rp->count == rp->capacity || rp->count >= rp->bounds_count + rp->bounds_count / 16)))
+        rank_per_compute_bounds(rp, rp->count);
+
+    rp->beta = fmin(1.0, rp->beta + BETA_INC);
+
+    size_t n = rp->bounds_count;
+    for (size_t k = 0; k < batch_size; ++k) {
+        size_t    rank  = rp->bounds[k] + rng_next_below(&rp->rng, rp->bounds[k + 1] - rp->bounds[k]);
+        RankEntry entry = rp->heap[rank - 1];
+        batch->items[k] = (SumTreeSample){.p_idx = entry.slot, .d_idx = entry.slot, .priority = rp->priority[entry.slot]};
+        // Weight normalized by the largest one, at rank n: (N P(rank))^-beta / (N P(n))^-beta
+        batch->importance_weights[k] = (double)rank / (double)n;
+    }
+    batch->count = batch_size;
+    per_pow_batch(batch->importance_weights, rp->alpha * rp->beta, batch->importance_weights, batch_size);
+
+    if (out_items != NULL) {
+        for (size_t k = 0; k < batch_size; ++k) {
+            memcpy((char *)out_items + k * rp->elem_size, rp->data + batch->items[k].d_idx * rp->elem_size, rp->elem_size);
+        }
+    }
+
+    rank_per_step(rp);
+}
+
+#endif // HEADER_PER_RANK_H
@@ -0,0 +1,173 @@
+#ifndef HEADER_PER_SCHEMA_H
+#define HEADER_PER_SCHEMA_H
+
+#include "per.h"
+
+// Structure-of-arrays transition storage. Instead of one opaque elem_size blob per slot, a schema declares
+// named fields (obs, action, reward, next_obs, done, ...) with a dtype and a shape, and every field lives
+// in its own contiguous column. The sum tree keeps only priorities (elem_size 0). A batch is sampled once
+// and then gathered field by field, so a learner that only needs some fields only pulls those through
+// the cache.
+
+#define PER_SCHEMA_MAX_RANK 4
+
+// Rows at least this large are gathered with non-temporal stores, they would only evict the tree
+#ifndef PER_SCHEMA_STREAM_MIN_BYTES
+#define PER_SCHEMA_STREAM_MIN_BYTES 4096
+#endif
+
+// How many rows ahead the gather prefetches its sources
+#define PER_SCHEMA_PREFETCH_ROWS 4
+
+typedef enum {
+    PER_DTYPE_U8 = 0,
+    PER_DTYPE_I32,
+    PER_DTYPE_I64,
+    PER_DTYPE_F32,
+    PER_DTYPE_F64,
+} PerDtype;
+
+static const size_t per_dtype_size[] = {1, 4, 8, 4, 8};
+
+typedef struct {
+    const char *name; // not copied, string literals are the usual case
+    PerDtype    dtype;
+    size_t      rank; // 0 for scalars
+    size_t      shape[PER_SCHEMA_MAX_RANK];
+} PerField;
+
+typedef struct {
+    PER      *per;
+    size_t    field_count;
+    PerField *fields;
+    size_t   *field_bytes; // bytes of one row of each field
+    char    **columns;
+} SchemaPER;
+
+static inline size_t per_field_bytes(const PerField *field) {
+    assert(field->rank <= PER_SCHEMA_MAX_RANK);
+
+    size_t bytes = per_dtype_size[field->dtype];
+    for (size_t d = 0; d < field->rank; ++d) {
+        bytes *= field->shape[d];
+    }
+    return bytes;
+}
+
+void free_schema_per(SchemaPER *sp) {
+    if (!sp)
+        return;
+    if (sp->columns) {
+        for (size_t f = 0; f < sp->field_count; ++f) {
+            sumtree_aligned_free(sp->columns[f]);
+        }
+    }
+    free(sp->columns);
+    free(sp->field_bytes);
+    free(sp->fields);
+    free_per(sp->per);
+    free(sp);
+}
+
+SchemaPER *create_schema_per(size_t capacity, const PerField *fields, size_t field_count, double alpha, double beta, SumTreeConfig config) {
+    assert(fields && field_count > 0);
+
+    SchemaPER *sp = (SchemaPER *)calloc(1, sizeof(SchemaPER));
+    if (sp == NULL) {
+        return NULL;
+    }
+
+    sp->field_count = field_count;
+    sp->per         = create_prioritized_replay_ex(capacity, 0, alpha, beta, config);
+    sp->fields      = (PerField *)malloc(field_count * sizeof(PerField));
+    sp->field_bytes = (size_t *)malloc(field_count * sizeof(size_t));
+    sp->columns     = (char **)calloc(field_count, sizeof(char *));
+    if (!sp->per || !sp->fields || !sp->field_bytes || !sp->columns) {
+        free_schema_per(sp);
+        return NULL;
+    }
+
+    memcpy(sp->fields, fields, field_count * sizeof(PerField));
+    for (size_t f = 0; f < field_count; ++f) {
+        sp->field_bytes[f] = per_field_bytes(&fields[f]);
+        assert(sp->field_bytes[f] > 0);
+
+        sp->columns[f] = (char *)sumtree_aligned_calloc(capacity, sp->field_bytes[f], SUM_TREE_CACHE_LINE);
+        if (sp->columns[f] == NULL) {
+            free_schema_per(sp);
+            return NULL;
+        }
+    }
+    return sp;
+}
+
+// Index of the field called name, -1 when the schema has none
+int schema_per_field(const SchemaPER *sp, const char *name) {
+    for (size_t f = 0; f < sp->field_count; ++f) {
+        if (strcmp(sp->fields[f].name, name) == 0)
+            return (int)f;
+    }
+    return -1;
+}
+
+static inline void *schema_per_row(const SchemaPER *sp, size_t field, size_t data_index) {
+    return sp->columns[field] + data_index * sp->field_bytes[field];
+}
+
+// Stores one transition, values[f] points at one row of field f
+void schema_per_add(SchemaPER *sp, const void *const *values) {
+    size_t slot = sp->per->tree->current_index;
+    for (size_t f = 0; f < sp->field_count; ++f) {
+        memcpy(schema_per_row(sp, f, slot), values[f], sp->field_bytes[f]);
+    }
+    add_to_per(sp->per, NULL);
+}
+
+// Draws the indices and importance weights only; gather the fields that are needed afterwards
+void schema_per_sample(SchemaPER *sp, Batch *batch, size_t batch_size) {
+    sample_from_per_into(sp->per, batch, batch_size, NULL);
+}
+
+static inline void schema_per_copy_row(char *dst, const char *src, size_t bytes) {
+#ifdef __AVX2__
+    if (bytes >= PER_SCHEMA_STREAM_MIN_BYTES && ((uintptr_t)dst & 31) == 0) {
+        size_t vector_bytes = bytes & ~(size_t)31;
+        for (size_t i = 0; i < vector_bytes; i += 32) {
+            _mm256_stream_si256((__m256i *)(dst + i), _mm256_loadu_si256((const __m256i *)(src + i)));
+        }
+        memcpy(dst + vector_bytes, src + vector_bytes, bytes - vector_bytes);
+        return;
+    }
+#endif
+    memcpy(dst, src, bytes);
+}
+
+// Copies field `field` of every sample in the batch into out, batch->count rows back to back
+void schema_per_gather(const SchemaPER *sp, const Batch *batch, size_t field, void *out) {
+    assert(field < sp->field_count);
+
+    size_t bytes    = sp->field_bytes[field];
+    size_t prefetch = min_size_t(bytes, SUM_TREE_PREFETCH_ITEM_BYTES);
+
+    for (size_t i = 0; i < min_size_t(PER_SCHEMA_PREFETCH_ROWS, batch->count); ++i) {
+        const char *row = (const char *)schema_per_row(sp, field, batch->items[i].d_idx);
+        for (size_t offset = 0; offset < prefetch; offset += SUM_TREE_CACHE_LINE)
+            SUM_TREE_PREFETCH(row + offset);
+    }
+
+    for (size_t i = 0; i < batch->count; ++i) {
+        if (i + PER_SCHEMA_PREFETCH_ROWS < batch->count) {
+            const char *ahead = (const char *)schema_per_row(sp, field, batch->items[i + PER_SCHEMA_PREFETCH_ROWS].d_idx);
+            for (size_t offset = 0; offset < prefetch; offset += SUM_TREE_CACHE_LINE)
+                SUM_TREE_PREFETCH(ahead + offset);
+        }
+        schema_per_copy_row((char *)out + i * bytes, (const char *)schema_per_row(sp, field, batch->items[i].d_idx), bytes);
+    }
+
+#ifdef __AVX2__
+    if (bytes >= PER_SCHEMA_STREAM_MIN_BYTES)
+        _mm_sfence();
+#endif
+}
+
+#endif // HEADER_PER_SCHEMA_H
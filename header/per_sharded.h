@@ -0,0 +1,265 @@
+#ifndef HEADER_PER_SHARDED_H
+#define HEADER_PER_SHARDED_H
+
+#include <pthread.h>
+#include <stdbool.h>
+
+#include "per.h"
+
+// Sharded PER: N independent PERs, each with its own lock. Inserts go round robin over the shards, so N
+// actors mostly hold N different locks. Samplers bring their own generator, like concurrent_per_sample.
+//
+// Writers publish the root sum and the smallest priority of their shard with atomic stores into a cache
+// line of its own, and never take a global lock. A sample folds the published values into a tiny
+// top-level sum tree under the top lock, walks it to pick shards in proportion to their mass and then
+// descends inside those shards only. The top lock is only taken by samplers, never together with a shard
+// lock.
+
+typedef struct {
+    size_t shard;
+    size_t p_idx; // priority index inside the shard's tree
+    size_t d_idx; // data index inside the shard
+    double priority;
+} ShardedSample;
+
+// What a shard publishes for the samplers, one cache line per shard
+typedef struct {
+    double total;        // atomic, root sum of the shard
+    double min_priority; // atomic, per_global_min_priority of the shard, 0 when unknown or empty
+    char   pad[SUM_TREE_CACHE_LINE - 2 * sizeof(double)];
+} ShardedPublished;
+
+typedef struct {
+    PER              **shards;
+    pthread_mutex_t   *shard_locks;
+    size_t             shard_count;
+    ShardedPublished  *published;
+    SumTree           *top;          // one leaf per shard holding its last folded root sum, under top_lock
+    double             min_priority; // smallest published shard minimum as of the last fold, under top_lock
+    pthread_mutex_t    top_lock;
+    uint64_t           next_shard;   // atomic round robin counter
+    uint64_t           total_adds;   // atomic
+    uint64_t           sample_calls; // atomic, drives the beta annealing
+    double             max_priority; // atomic
+    double             base_beta;
+} ShardedPER;
+
+void free_sharded_per(ShardedPER *sp) {
+    if (!sp)
+        return;
+    if (sp->shards) {
+        for (size_t i = 0; i < sp->shard_count; ++i) {
+            free_per(sp->shards[i]);
+            pthread_mutex_destroy(&sp->shard_locks[i]);
+        }
+    }
+    free(sp->shards);
+    free(sp->shard_locks);
+    sumtree_aligned_free(sp->published);
+    free_sum_tree(sp->top);
+    pthread_mutex_destroy(&sp->top_lock);
+    free(sp);
+}
+
+ShardedPER *create_sharded_per(size_t shard_count, size_t shard_capacity, size_t elem_size, double alpha, double beta, SumTreeConfig config) {
+    assert(shard_count > 0);
+
+    ShardedPER *sp = (ShardedPER *)calloc(1, sizeof(ShardedPER));
+    if (sp == NULL) {
+        return NULL;
+    }
+    pthread_mutex_init(&sp->top_lock, NULL);
+
+    size_t top_capacity = 1;
+    while (top_capacity < shard_count)
+        top_capacity <<= 1;
+
+    sp->shards      = (PER **)calloc(shard_count, sizeof(PER *));
+    sp->shard_locks = (pthread_mutex_t *)calloc(shard_count, sizeof(pthread_mutex_t));
+    sp->published   = (ShardedPublished *)sumtree_aligned_calloc(shard_count, sizeof(ShardedPublished), SUM_TREE_CACHE_LINE);
+    sp->top         = create_sum_tree(top_capacity, 1);
+    if (!sp->shards || !sp->shard_locks || !sp->published || !sp->top) {
+        free_sharded_per(sp);
+        return NULL;
+    }
+
+    sp->shard_count = shard_count;
+    for (size_t i = 0; i < shard_count; ++i) {
+        pthread_mutex_init(&sp->shard_locks[i], NULL);
+        sp->shards[i] = create_prioritized_replay_ex(shard_capacity, elem_size, alpha, beta, config);
+        if (sp->shards[i] == NULL) {
+            free_sharded_per(sp);
+            return NULL;
+        }
+    }
+
+    sp->max_priority = 1.0;
+    sp->base_beta    = beta;
+    return sp;
+}
+
+static inline double sharded_load(const double *ptr) {
+    double value;
+    __atomic_load(ptr, &value, __ATOMIC_RELAXED);
+    return value;
+}
+
+static inline void sharded_store(double *ptr, double value) {
+    __atomic_store(ptr, &value, __ATOMIC_RELAXED);
+}
+
+static inline void sharded_atomic_max(double *ptr, double value) {
+    double expected = sharded_load(ptr);
+    while (value > expected && !__atomic_compare_exchange(ptr, &expected, &value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+// Caller holds the shard lock, so the published values of a shard never go back in time
+static void sharded_publish_total(ShardedPER *sp, size_t shard) {
+    const SumTree *tree = sp->shards[shard]->tree;
+    sharded_store(&sp->published[shard].total, sum_tree_total(tree));
+    sharded_store(&sp->published[shard].min_priority, per_global_min_priority(tree));
+}
+
+// Caller holds top_lock. Brings the top tree and the global minimum up to date with what the shards
+// published, only the shards whose total moved touch the top tree.
+static void sharded_fold_totals(ShardedPER *sp) {
+    double min_priority = 0.0;
+    for (size_t shard = 0; shard < sp->shard_count; ++shard) {
+        double total    = sharded_load(&sp->published[shard].total);
+        size_t tree_idx = sumtree_leaf_index(sp->top, shard);
+        if (total != sum_tree_priority(sp->top, tree_idx))
+            sum_tree_update(sp->top, tree_idx, total);
+
+        double shard_min = sharded_load(&sp->published[shard].min_priority);
+        if (shard_min > 0.0 && (min_priority == 0.0 || shard_min < min_priority))
+            min_priority = shard_min;
+    }
+    sp->min_priority = min_priority;
+}
+
+void sharded_per_add(ShardedPER *sp, const void *item) {
+    size_t shard = (size_t)(__atomic_fetch_add(&sp->next_shard, 1, __ATOMIC_RELAXED) % sp->shard_count);
+
+    pthread_mutex_lock(&sp->shard_locks[shard]);
+    sum_tree_add(sp->shards[shard]->tree, item, sharded_load(&sp->max_priority));
+    sharded_publish_total(sp, shard);
+    pthread_mutex_unlock(&sp->shard_locks[shard]);
+
+    __atomic_fetch_add(&sp->total_adds, 1, __ATOMIC_RELAXED);
+}
+
+size_t sharded_per_size(const ShardedPER *sp) {
+    uint64_t adds     = __atomic_load_n(&sp->total_adds, __ATOMIC_RELAXED);
+    size_t   capacity = sp->shard_count * sp->shards[0]->tree->capacity;
+    return adds < capacity ? (size_t)adds : capacity;
+}
+
+// Picks the shard for a global target and rebases the target into that shard
+static size_t sharded_top_descend(const SumTree *top, double *segment) {
+    size_t idx       = 0;
+    size_t leaf_base = sumtree_leaf_base(top);
+
+    while (idx < leaf_base) {
+        size_t left     = (idx << 1) + 1;
+        double left_sum = top->priority_tree[left];
+
+        if (*segment <= left_sum)
+            idx = left;
+        else {
+            *segment -= left_sum;
+            idx = left + 1;
+        }
+    }
+    return idx - leaf_base;
+}
+
+// Stratified sample over all shards with the caller's generator. Targets are drawn in ascending order, so
+// the samples of one shard form a single run and each shard is locked at most once per call. Writes the
+// samples, their normalized importance weights and, when out_items is not NULL, the payloads back to
+// back. Returns false when no shard holds any priority mass yet.
+bool sharded_per_sample(ShardedPER *sp, Rng *rng, size_t batch_size, ShardedSample *out, double *out_weights, void *out_items) {
+    double total;
+    double min_priority;
+
+    pthread_mutex_lock(&sp->top_lock);
+    sharded_fold_totals(sp);
+    total        = sum_tree_total(sp->top);
+    min_priority = sp->min_priority;
+    if (total > 0.0 && batch_size > 0) {
+        rng_fill_stratified(rng, out_weights, batch_size, total);
+        for (size_t i = 0; i < batch_size; ++i) {
+            size_t shard = sharded_top_descend(sp->top, &out_weights[i]);
+            // Rounding can walk into the zero padding leaves past the last shard
+            out[i].shard = shard < sp->shard_count ? shard : sp->shard_count - 1;
+        }
+    }
+    pthread_mutex_unlock(&sp->top_lock);
+
+    if (total <= 0.0 || batch_size == 0) {
+        return false;
+    }
+
+    uint64_t calls     = __atomic_fetch_add(&sp->sample_calls, 1, __ATOMIC_RELAXED);
+    double   beta      = fmin(1.0, sp->base_beta + BETA_INC * (double)(calls + 1));
+    size_t   elem_size = sp->shards[0]->tree->elem_size;
+
+    SumTreeSample local[SUM_TREE_BATCH_LANES];
+    for (size_t start = 0; start < batch_size;) {
+        size_t shard = out[start].shard;
+        size_t end   = start + 1;
+        while (end < batch_size && end - start < SUM_TREE_BATCH_LANES && out[end].shard == shard)
+            end++;
+
+        SumTree *tree = sp->shards[shard]->tree;
+        pthread_mutex_lock(&sp->shard_locks[shard]);
+        // sum_tree_get_batch clamps the rebased targets in case the shard changed since the top walk
+        sum_tree_get_batch(tree, out_weights + start, end - start, local);
+        for (size_t i = start; i < end; ++i) {
+            out[i].p_idx    = local[i - start].p_idx;
+            out[i].d_idx    = local[i - start].d_idx;
+            out[i].priority = local[i - start].priority;
+            if (out_items != NULL)
+                memcpy((char *)out_items + i * elem_size, sumtree_data_ptr(tree, out[i].d_idx), elem_size);
+        }
+        pthread_mutex_unlock(&sp->shard_locks[shard]);
+
+        start = end;
+    }
+
+    for (size_t i = 0; i < batch_size; ++i) {
+        out_weights[i] = out[i].priority;
+    }
+    per_normalize_priorities(out_weights, batch_size, total, min_priority, beta, out_weights);
+    return true;
+}
+
+// Applies new TD errors to sampled entries. Neighbouring samples of the same shard share one lock and one
+// batched tree update.
+void sharded_per_update(ShardedPER *sp, const ShardedSample *samples, const double *td_errors, size_t count) {
+    size_t indices[SUM_TREE_BATCH_LANES];
+    double priorities[SUM_TREE_BATCH_LANES];
+
+    for (size_t start = 0; start < count;) {
+        size_t shard = samples[start].shard;
+        size_t end   = start + 1;
+        while (end < count && end - start < SUM_TREE_BATCH_LANES && samples[end].shard == shard)
+            end++;
+
+        PER *per = sp->shards[shard];
+        calculate_priorities(per, td_errors + start, priorities, end - start);
+        for (size_t i = start; i < end; ++i) {
+            indices[i - start] = samples[i].p_idx;
+            sharded_atomic_max(&sp->max_priority, priorities[i - start]);
+        }
+
+        pthread_mutex_lock(&sp->shard_locks[shard]);
+        sum_tree_update_batch(per->tree, indices, priorities, end - start);
+        sharded_publish_total(sp, shard);
+        pthread_mutex_unlock(&sp->shard_locks[shard]);
+
+        start = end;
+    }
+}
+
+#endif // HEADER_PER_SHARDED_H
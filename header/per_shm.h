@@ -0,0 +1,380 @@
+#ifndef HEADER_PER_SHM_H
+#define HEADER_PER_SHM_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "per.h"
+
+// A PER that lives in a named POSIX shared memory segment, so actor processes insert straight into the
+// buffer and the learner samples it in place, without sockets or copies in between:
+//
+//   [ header, one page ][ data, page aligned ][ priority_tree, page aligned ]
+//
+// The header holds the geometry, a process shared robust mutex and the mutable scalars (ring position,
+// alpha / beta / max_priority, RNG state). Every process maps the segment and keeps a private PER and
+// SumTree whose data and priority_tree point into its own mapping. Each call takes the mutex, loads the
+// scalars into the private view, runs the ordinary per.h code and stores them back.
+//
+// When a process dies while holding the mutex, the next locker rebuilds the inner tree nodes from the
+// leaves, so a torn update can never leave the sums inconsistent. Fenwick trees keep no separate leaves
+// and cannot be repaired that way, so segments never use SUM_TREE_FENWICK.
+
+#define PER_SHM_MAGIC "PERSHM1"
+#define PER_SHM_VERSION 1
+#define PER_SHM_PAGE 4096
+
+// How long open_shm_per waits for the creator to finish initializing the segment
+#ifndef PER_SHM_OPEN_TIMEOUT_MS
+#define PER_SHM_OPEN_TIMEOUT_MS 1000
+#endif
+
+typedef struct {
+    char            magic[8];
+    uint32_t        version;
+    uint32_t        layout;
+    uint32_t        fanout;
+    uint32_t        ready; // published last by the creator
+    uint64_t        capacity;
+    uint64_t        elem_size;
+    uint64_t        tree_size;
+    uint64_t        data_offset;
+    uint64_t        data_bytes;
+    uint64_t        tree_offset;
+    uint64_t        tree_bytes;
+    uint64_t        segment_bytes;
+    pthread_mutex_t lock;
+    // Guarded by lock
+    uint64_t current_index;
+    uint64_t num_entries;
+    double   alpha;
+    double   beta;
+    double   max_priority;
+    uint64_t rng[4];
+    uint64_t recoveries; // times a dead owner's tree was rebuilt
+} ShmPerHeader;
+
+typedef struct {
+    ShmPerHeader *header;  // start of the mapping
+    size_t        segment_bytes;
+    SumTree       tree;    // private view into the mapping
+    PER           per;
+} ShmPER;
+
+static inline bool per_shm_ready(const ShmPerHeader *header) {
+    return __atomic_load_n(&header->ready, __ATOMIC_ACQUIRE) != 0;
+}
+
+// Points the private PER at the mapping and lays out the tree levels like create_sum_tree_ex would
+static void per_shm_attach(ShmPER *sp) {
+    ShmPerHeader *header = sp->header;
+    SumTree      *tree   = &sp->tree;
+
+    memset(tree, 0, sizeof(*tree));
+    tree->capacity      = header->capacity;
+    tree->elem_size     = header->elem_size;
+    tree->layout        = (SumTreeLayout)header->layout;
+    tree->tree_size     = sumtree_layout_tree_size(tree);
+    tree->data          = header->data_bytes > 0 ? (char *)header + header->data_offset : NULL;
+    tree->priority_tree = (double *)((char *)header + header->tree_offset);
+
+    sp->per.tree = tree;
+}
+
+// Caller holds the lock
+static inline void per_shm_load(ShmPER *sp) {
+    const ShmPerHeader *header = sp->header;
+    sp->tree.current_index     = header->current_index;
+    sp->tree.num_entries       = header->num_entries;
+    sp->per.alpha              = header->alpha;
+    sp->per.beta               = header->beta;
+    sp->per.max_priority       = header->max_priority;
+    memcpy(sp->tree.rng.s, header->rng, sizeof(header->rng));
+}
+
+// Caller holds the lock
+static inline void per_shm_store(ShmPER *sp) {
+    ShmPerHeader *header  = sp->header;
+    header->current_index = sp->tree.current_index;
+    header->num_entries   = sp->tree.num_entries;
+    header->alpha         = sp->per.alpha;
+    header->beta          = sp->per.beta;
+    header->max_priority  = sp->per.max_priority;
+    memcpy(header->rng, sp->tree.rng.s, sizeof(header->rng));
+}
+
+// Returns false, without the lock, when the mutex cannot be taken: ENOTRECOVERABLE after a recovery that
+// never finished, EDEADLK, ... The segment must not be touched then.
+static bool per_shm_lock(ShmPER *sp) {
+    int rc = pthread_mutex_lock(&sp->header->lock);
+    if (rc == EOWNERDEAD) {
+        // The previous owner died mid call: its scalars were never stored, but leaves or inner nodes may
+        // be half written. The leaves are the truth, recompute everything above them.
+        assert(sp->tree.layout != SUM_TREE_FENWICK);
+        per_shm_load(sp);
+        sum_tree_rebuild(&sp->tree);
+        sp->header->recoveries++;
+        rc = pthread_mutex_consistent(&sp->header->lock);
+        if (rc != 0)
+            pthread_mutex_unlock(&sp->header->lock);
+    }
+    if (rc != 0) {
+        fprintf(stderr, "shared memory PER: cannot take the lock: %s\n", strerror(rc));
+        return false;
+    }
+    per_shm_load(sp);
+    return true;
+}
+
+static inline void per_shm_unlock(ShmPER *sp) {
+    per_shm_store(sp);
+    pthread_mutex_unlock(&sp->header->lock);
+}
+
+void free_shm_per(ShmPER *sp) {
+    if (!sp)
+        return;
+    if (sp->header)
+        munmap(sp->header, sp->segment_bytes);
+    free(sp);
+}
+
+// Removes the name; mappings that are still open stay valid until they are freed
+bool shm_per_unlink(const char *name) {
+    if (shm_unlink(name) != 0) {
+        perror(name);
+        return false;
+    }
+    return true;
+}
+
+// Creates the segment `name` (e.g. "/per-replay") and initializes an empty PER in it. Fails when the name
+// already exists; unlink stale segments first. Only config.layout is used, the segment is always tmpfs.
+// SUM_TREE_FENWICK is rejected, a dead lock owner could leave it beyond repair.
+ShmPER *create_shm_per(const char *name, size_t capacity, size_t elem_size, double alpha, double beta, SumTreeConfig config) {
+    assert(capacity > 0 && (capacity & (capacity - 1)) == 0 && "Capacity must be a power of 2");
+    assert(config.backing_path == NULL && "shared memory PERs cannot be file backed");
+
+    if (config.layout == SUM_TREE_FENWICK) {
+        fprintf(stderr, "%s: the Fenwick layout cannot be recovered after a crash, use SUM_TREE_BINARY or SUM_TREE_BARY\n", name);
+        return NULL;
+    }
+
+    ShmPER *sp = (ShmPER *)calloc(1, sizeof(ShmPER));
+    if (sp == NULL) {
+        return NULL;
+    }
+
+    SumTree shape     = {.capacity = capacity, .layout = config.layout};
+    size_t  tree_size = sumtree_layout_tree_size(&shape);
+
+    size_t data_offset = PER_SHM_PAGE;
+    size_t data_bytes  = capacity * elem_size;
+    size_t tree_offset = data_offset + round_up_size_t(data_bytes, PER_SHM_PAGE);
+    size_t tree_bytes  = tree_size * sizeof(double);
+    sp->segment_bytes  = round_up_size_t(tree_offset + tree_bytes, PER_SHM_PAGE);
+
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) {
+        perror(name);
+        free(sp);
+        return NULL;
+    }
+
+    // ftruncate zero fills, so every priority starts at 0
+    void *mapping = MAP_FAILED;
+    if (ftruncate(fd, (off_t)sp->segment_bytes) == 0)
+        mapping = mmap(NULL, sp->segment_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        perror(name);
+        shm_unlink(name);
+        free(sp);
+        return NULL;
+    }
+
+    ShmPerHeader *header = (ShmPerHeader *)mapping;
+    memcpy(header->magic, PER_SHM_MAGIC, sizeof(PER_SHM_MAGIC));
+    header->version       = PER_SHM_VERSION;
+    header->layout        = (uint32_t)config.layout;
+    header->fanout        = SUM_TREE_BARY_FANOUT;
+    header->capacity      = capacity;
+    header->elem_size     = elem_size;
+    header->tree_size     = tree_size;
+    header->data_offset   = data_offset;
+    header->data_bytes    = data_bytes;
+    header->tree_offset   = tree_offset;
+    header->tree_bytes    = tree_bytes;
+    header->segment_bytes = sp->segment_bytes;
+    header->alpha         = alpha;
+    header->beta          = beta;
+    header->max_priority  = 1.0;
+
+    Rng rng;
+    rng_seed(&rng, (uint64_t)time(NULL) ^ ((uint64_t)getpid() << 32));
+    memcpy(header->rng, rng.s, sizeof(header->rng));
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    int rc = pthread_mutex_init(&header->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    if (rc != 0) {
+        fprintf(stderr, "%s: cannot create a process shared mutex: %s\n", name, strerror(rc));
+        munmap(mapping, sp->segment_bytes);
+        shm_unlink(name);
+        free(sp);
+        return NULL;
+    }
+
+    sp->header = header;
+    per_shm_attach(sp);
+    __atomic_store_n(&header->ready, 1, __ATOMIC_RELEASE);
+    return sp;
+}
+
+static bool per_shm_check(const ShmPerHeader *header, size_t file_bytes, const char *name) {
+    const char *problem = NULL;
+
+    if (memcmp(header->magic, PER_SHM_MAGIC, sizeof(PER_SHM_MAGIC)) != 0)
+        problem = "not a shared memory PER";
+    else if (header->version != PER_SHM_VERSION)
+        problem = "unsupported segment version";
+    else if (header->layout > SUM_TREE_FENWICK)
+        problem = "unknown tree layout";
+    else if (header->layout == SUM_TREE_FENWICK)
+        problem = "Fenwick trees are not supported in shared memory";
+    else if (header->layout == SUM_TREE_BARY && header->fanout != SUM_TREE_BARY_FANOUT)
+        problem = "segment was created with a different SUM_TREE_BARY_FANOUT";
+    else if (header->segment_bytes > file_bytes || header->tree_offset + header->tree_bytes > header->segment_bytes ||
+             header->data_offset + header->data_bytes > header->tree_offset)
+        problem = "truncated or inconsistent segment";
+
+    if (problem != NULL) {
+        fprintf(stderr, "%s: %s\n", name, problem);
+        return false;
+    }
+    return true;
+}
+
+// Attaches to a segment made by create_shm_per, in this or any other process
+ShmPER *open_shm_per(const char *name) {
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0) {
+        perror(name);
+        return NULL;
+    }
+
+    // The creator sizes the segment right after creating it, wait for it instead of failing
+    struct stat st;
+    for (int waited = 0;; ++waited) {
+        if (fstat(fd, &st) != 0 || waited == PER_SHM_OPEN_TIMEOUT_MS) {
+            fprintf(stderr, "%s: segment was never initialized\n", name);
+            close(fd);
+            return NULL;
+        }
+        if ((size_t)st.st_size >= PER_SHM_PAGE)
+            break;
+        nanosleep(&(struct timespec){.tv_nsec = 1000000L}, NULL);
+    }
+
+    void *mapping = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        perror(name);
+        return NULL;
+    }
+
+    ShmPerHeader *header = (ShmPerHeader *)mapping;
+    for (int waited = 0; !per_shm_ready(header); ++waited) {
+        if (waited == PER_SHM_OPEN_TIMEOUT_MS) {
+            fprintf(stderr, "%s: segment was never initialized\n", name);
+            munmap(mapping, (size_t)st.st_size);
+            return NULL;
+        }
+        nanosleep(&(struct timespec){.tv_nsec = 1000000L}, NULL);
+    }
+
+    ShmPER *sp = (ShmPER *)calloc(1, sizeof(ShmPER));
+    if (sp == NULL || !per_shm_check(header, (size_t)st.st_size, name)) {
+        munmap(mapping, (size_t)st.st_size);
+        free(sp);
+        return NULL;
+    }
+
+    sp->header        = header;
+    sp->segment_bytes = (size_t)st.st_size;
+    per_shm_attach(sp);
+    if (sp->tree.tree_size != header->tree_size) {
+        fprintf(stderr, "%s: tree size does not match its layout\n", name);
+        free_shm_per(sp);
+        return NULL;
+    }
+    return sp;
+}
+
+// Gives this process its own sampling stream, segments start from one shared generator
+bool shm_per_seed(ShmPER *sp, uint64_t seed) {
+    if (!per_shm_lock(sp))
+        return false;
+    per_seed(&sp->per, seed);
+    per_shm_unlock(sp);
+    return true;
+}
+
+bool shm_per_add(ShmPER *sp, const void *item) {
+    if (!per_shm_lock(sp))
+        return false;
+    add_to_per(&sp->per, item);
+    per_shm_unlock(sp);
+    return true;
+}
+
+// Adds count items of elem_size bytes under a single lock, what actors should use for their rollouts
+bool shm_per_add_batch(ShmPER *sp, const void *items, size_t count) {
+    if (!per_shm_lock(sp))
+        return false;
+    for (size_t i = 0; i < count; ++i) {
+        add_to_per(&sp->per, (const char *)items + i * sp->tree.elem_size);
+    }
+    per_shm_unlock(sp);
+    return true;
+}
+
+size_t shm_per_size(ShmPER *sp) {
+    return __atomic_load_n(&sp->header->num_entries, __ATOMIC_RELAXED);
+}
+
+// Samples like sample_from_per_into. With out_items NULL only indices and weights are produced and the
+// payloads can be read in place through shm_per_item, as long as no add overwrites them meanwhile.
+// Every shm_per_* call that takes the lock returns false, having changed nothing, when the lock cannot
+// be taken.
+bool shm_per_sample_into(ShmPER *sp, Batch *batch, size_t batch_size, void *out_items) {
+    if (!per_shm_lock(sp))
+        return false;
+    sample_from_per_into(&sp->per, batch, batch_size, out_items);
+    per_shm_unlock(sp);
+    return true;
+}
+
+bool shm_per_update(ShmPER *sp, size_t *priority_indices, const double *td_errors, size_t count) {
+    TD_ERRORS td = {.items = (double *)td_errors, .count = count, .capacity = count};
+
+    if (!per_shm_lock(sp))
+        return false;
+    update_per_priorities(&sp->per, &td, priority_indices);
+    per_shm_unlock(sp);
+    return true;
+}
+
+static inline const void *shm_per_item(ShmPER *sp, size_t data_index) {
+    return sumtree_data_ptr(&sp->tree, data_index);
+}
+
+#endif // HEADER_PER_SHM_H
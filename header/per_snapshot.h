@@ -0,0 +1,286 @@
+#ifndef HEADER_PER_SNAPSHOT_H
+#define HEADER_PER_SNAPSHOT_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "per.h"
+
+// Binary snapshots of a whole PER. The file is laid out so it can be mapped instead of parsed:
+//
+//   [ header, one page ][ data, page aligned ][ priority_tree, page aligned ]
+//
+// The header records the version, the geometry of the tree (layout, fan-out, capacity, elem_size,
+// tree_size), the ring position, alpha / beta / max_priority and the RNG state, so a restored buffer
+// continues exactly where the saved one stopped. per_load reads everything into fresh heap buffers;
+// per_load_mmap maps the file copy-on-write and points data and priority_tree straight into it.
+
+#define PER_SNAPSHOT_MAGIC "PERSNAP"
+#define PER_SNAPSHOT_VERSION 1
+#define PER_SNAPSHOT_PAGE 4096
+
+typedef struct {
+    char     magic[8];
+    uint32_t version;
+    uint32_t layout;
+    uint32_t fanout;
+    uint32_t reserved;
+    uint64_t capacity;
+    uint64_t elem_size;
+    uint64_t tree_size;
+    uint64_t current_index;
+    uint64_t num_entries;
+    double   alpha;
+    double   beta;
+    double   max_priority;
+    uint64_t rng[4];
+    uint64_t data_offset;
+    uint64_t data_bytes;
+    uint64_t tree_offset;
+    uint64_t tree_bytes;
+} PerSnapshotHeader;
+
+static bool per_snapshot_write_all(int fd, const void *buffer, size_t bytes, uint64_t offset) {
+    const char *src = (const char *)buffer;
+    while (bytes > 0) {
+        ssize_t written = pwrite(fd, src, bytes, (off_t)offset);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        src += written;
+        offset += (uint64_t)written;
+        bytes -= (size_t)written;
+    }
+    return true;
+}
+
+static bool per_snapshot_read_all(int fd, void *buffer, size_t bytes, uint64_t offset) {
+    char *dst = (char *)buffer;
+    while (bytes > 0) {
+        ssize_t got = pread(fd, dst, bytes, (off_t)offset);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            return false;
+        dst += got;
+        offset += (uint64_t)got;
+        bytes -= (size_t)got;
+    }
+    return true;
+}
+
+static PerSnapshotHeader per_snapshot_header(const PER *per) {
+    const SumTree    *tree   = per->tree;
+    PerSnapshotHeader header = {0};
+
+    memcpy(header.magic, PER_SNAPSHOT_MAGIC, sizeof(PER_SNAPSHOT_MAGIC));
+    header.version       = PER_SNAPSHOT_VERSION;
+    header.layout        = (uint32_t)tree->layout;
+    header.fanout        = SUM_TREE_BARY_FANOUT;
+    header.capacity      = tree->capacity;
+    header.elem_size     = tree->elem_size;
+    header.tree_size     = tree->tree_size;
+    header.current_index = tree->current_index;
+    header.num_entries   = tree->num_entries;
+    header.alpha         = per->alpha;
+    header.beta          = per->beta;
+    header.max_priority  = per->max_priority;
+    memcpy(header.rng, tree->rng.s, sizeof(header.rng));
+
+    header.data_offset = PER_SNAPSHOT_PAGE;
+    header.data_bytes  = (uint64_t)tree->capacity * tree->elem_size;
+    header.tree_offset = header.data_offset + round_up_size_t(header.data_bytes, PER_SNAPSHOT_PAGE);
+    header.tree_bytes  = (uint64_t)tree->tree_size * sizeof(double);
+    return header;
+}
+
+// Writes the snapshot to path + ".tmp" and renames it over path, so a crash never leaves a torn file
+bool per_save(const PER *per, const char *path) {
+    PerSnapshotHeader header = per_snapshot_header(per);
+
+    char tmp_path[4096];
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >= (int)sizeof(tmp_path))
+        return false;
+
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror(tmp_path);
+        return false;
+    }
+
+    char page[PER_SNAPSHOT_PAGE] = {0};
+    memcpy(page, &header, sizeof(header));
+
+    bool ok = per_snapshot_write_all(fd, page, sizeof(page), 0) &&
+              per_snapshot_write_all(fd, per->tree->data, header.data_bytes, header.data_offset) &&
+              per_snapshot_write_all(fd, per->tree->priority_tree, header.tree_bytes, header.tree_offset) &&
+              ftruncate(fd, (off_t)round_up_size_t(header.tree_offset + header.tree_bytes, PER_SNAPSHOT_PAGE)) == 0 &&
+              fsync(fd) == 0;
+    ok = close(fd) == 0 && ok;
+
+    if (ok && rename(tmp_path, path) != 0)
+        ok = false;
+    if (!ok) {
+        perror(path);
+        unlink(tmp_path);
+    }
+    return ok;
+}
+
+static bool per_snapshot_check(const PerSnapshotHeader *header, uint64_t file_bytes, const char *path) {
+    const char *problem = NULL;
+
+    if (memcmp(header->magic, PER_SNAPSHOT_MAGIC, sizeof(PER_SNAPSHOT_MAGIC)) != 0)
+        problem = "not a PER snapshot";
+    else if (header->version != PER_SNAPSHOT_VERSION)
+        problem = "unsupported snapshot version";
+    else if (header->layout > SUM_TREE_FENWICK)
+        problem = "unknown tree layout";
+    else if (header->layout == SUM_TREE_BARY && header->fanout != SUM_TREE_BARY_FANOUT)
+        problem = "snapshot was written with a different SUM_TREE_BARY_FANOUT";
+    else if (header->capacity == 0 || (header->capacity & (header->capacity - 1)) != 0)
+        problem = "capacity is not a power of two";
+    else if (header->current_index >= header->capacity || header->num_entries > header->capacity)
+        problem = "ring position out of range";
+    else if (header->data_offset % PER_SNAPSHOT_PAGE != 0 || header->tree_offset % PER_SNAPSHOT_PAGE != 0 ||
+             header->data_bytes != header->capacity * header->elem_size || header->tree_bytes != header->tree_size * sizeof(double) ||
+             header->data_offset + header->data_bytes > header->tree_offset || header->tree_offset + header->tree_bytes > file_bytes)
+        problem = "truncated or inconsistent snapshot";
+
+    if (problem != NULL) {
+        fprintf(stderr, "%s: %s\n", path, problem);
+        return false;
+    }
+    return true;
+}
+
+// Builds an empty PER shell around the saved geometry, without allocating data or tree
+static PER *per_snapshot_shell(const PerSnapshotHeader *header, const char *path) {
+    PER     *per  = (PER *)calloc(1, sizeof(PER));
+    SumTree *tree = (SumTree *)calloc(1, sizeof(SumTree));
+    if (per == NULL || tree == NULL) {
+        free(per);
+        free(tree);
+        return NULL;
+    }
+
+    tree->capacity      = header->capacity;
+    tree->elem_size     = header->elem_size;
+    tree->layout        = (SumTreeLayout)header->layout;
+    tree->current_index = header->current_index;
+    tree->num_entries   = header->num_entries;
+    tree->tree_size     = sumtree_layout_tree_size(tree);
+    memcpy(tree->rng.s, header->rng, sizeof(header->rng));
+
+    if (tree->tree_size != header->tree_size) {
+        fprintf(stderr, "%s: tree size does not match its layout\n", path);
+        free(per);
+        free(tree);
+        return NULL;
+    }
+
+    per->tree         = tree;
+    per->alpha        = header->alpha;
+    per->beta         = header->beta;
+    per->max_priority = header->max_priority;
+    return per;
+}
+
+static int per_snapshot_open(const char *path, PerSnapshotHeader *header, uint64_t *file_bytes) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !per_snapshot_read_all(fd, header, sizeof(*header), 0)) {
+        fprintf(stderr, "%s: cannot read the snapshot header\n", path);
+        close(fd);
+        return -1;
+    }
+    *file_bytes = (uint64_t)st.st_size;
+    if (!per_snapshot_check(header, *file_bytes, path)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Restores a snapshot into freshly allocated heap buffers
+PER *per_load(const char *path) {
+    PerSnapshotHeader header;
+    uint64_t          file_bytes;
+    int               fd = per_snapshot_open(path, &header, &file_bytes);
+    if (fd < 0)
+        return NULL;
+
+    PER *per = per_snapshot_shell(&header, path);
+    if (per == NULL) {
+        close(fd);
+        return NULL;
+    }
+
+    SumTree *tree      = per->tree;
+    size_t   alignment = max_size_t(SUM_TREE_CACHE_LINE, SUM_TREE_BARY_FANOUT * sizeof(double));
+
+    tree->priority_tree = (double *)sumtree_aligned_calloc(tree->tree_size, sizeof(double), alignment);
+    if (header.data_bytes > 0)
+        tree->data = sumtree_aligned_alloc(header.data_bytes, SUM_TREE_CACHE_LINE);
+
+    bool ok = tree->priority_tree != NULL && (header.data_bytes == 0 || tree->data != NULL) &&
+              per_snapshot_read_all(fd, tree->data, header.data_bytes, header.data_offset) &&
+              per_snapshot_read_all(fd, tree->priority_tree, header.tree_bytes, header.tree_offset);
+    close(fd);
+
+    if (!ok) {
+        fprintf(stderr, "%s: cannot read the snapshot body\n", path);
+        free_per(per);
+        return NULL;
+    }
+    return per;
+}
+
+// Restores a snapshot without copying it: data and priority_tree point into a private (copy on write)
+// mapping of the file, so pages are only read when touched and changes never reach the file. Save again
+// to persist them.
+PER *per_load_mmap(const char *path) {
+    PerSnapshotHeader header;
+    uint64_t          file_bytes;
+    int               fd = per_snapshot_open(path, &header, &file_bytes);
+    if (fd < 0)
+        return NULL;
+
+    PER *per = per_snapshot_shell(&header, path);
+    if (per == NULL) {
+        close(fd);
+        return NULL;
+    }
+
+    void *mapping = mmap(NULL, (size_t)file_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        perror(path);
+        free_per(per);
+        return NULL;
+    }
+
+    SumTree *tree       = per->tree;
+    tree->mapping       = mapping;
+    tree->mapping_bytes = (size_t)file_bytes;
+    tree->data          = header.data_bytes > 0 ? (char *)mapping + header.data_offset : NULL;
+    tree->priority_tree = (double *)((char *)mapping + header.tree_offset);
+
+    if (header.data_bytes > 0)
+        madvise(tree->data, header.data_bytes, MADV_RANDOM);
+    madvise(tree->priority_tree, header.tree_bytes, MADV_WILLNEED);
+    return per;
+}
+
+#endif // HEADER_PER_SNAPSHOT_H
@@ -10,6 +10,77 @@
 #include <string.h>
 #include <time.h>
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#include <malloc.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+// Fan-out of the B-ary layout. 8 doubles fill exactly one 64 byte cache line, 16 fill two.
+#ifndef SUM_TREE_BARY_FANOUT
+#define SUM_TREE_BARY_FANOUT 8
+#endif
+
+#if SUM_TREE_BARY_FANOUT != 8 && SUM_TREE_BARY_FANOUT != 16
+#error "SUM_TREE_BARY_FANOUT must be 8 or 16"
+#endif
+
+#define SUM_TREE_MAX_LEVELS 32
+#define SUM_TREE_CACHE_LINE 64
+
+// Granularity of priority_tree dirty tracking, see sum_tree_track_dirty
+#define SUM_TREE_DIRTY_PAGE 4096
+
+#define SUM_TREE_HUGE_PAGE ((size_t)2 << 20)
+
+// Number of descents sum_tree_get_batch keeps in flight at once
+#ifndef SUM_TREE_BATCH_LANES
+#define SUM_TREE_BATCH_LANES 64
+#endif
+
+// How much of each sampled payload the fused sampler prefetches ahead of the copy
+#ifndef SUM_TREE_PREFETCH_ITEM_BYTES
+#define SUM_TREE_PREFETCH_ITEM_BYTES 256
+#endif
+
+// sum_tree_update_batch tracks the touched top of a binary tree in a 64 bit mask
+#if SUM_TREE_BATCH_LANES > 64
+#error "SUM_TREE_BATCH_LANES must not exceed 64"
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define SUM_TREE_PREFETCH(addr) __builtin_prefetch((addr), 0, 3)
+#else
+#define SUM_TREE_PREFETCH(addr) ((void)(addr))
+#endif
+
+// Bit counting through the GCC / Clang builtins, or the MSVC intrinsics. ctz of 0 is undefined.
+#if defined(_MSC_VER)
+static inline unsigned sumtree_popcount(unsigned value) {
+    return __popcnt(value);
+}
+
+static inline unsigned sumtree_ctz64(uint64_t value) {
+    unsigned long index;
+    _BitScanForward64(&index, value);
+    return (unsigned)index;
+}
+#else
+static inline unsigned sumtree_popcount(unsigned value) {
+    return (unsigned)__builtin_popcount(value);
+}
+
+static inline unsigned sumtree_ctz64(uint64_t value) {
+    return (unsigned)__builtin_ctzll(value);
+}
+#endif
 
 static inline size_t min_size_t(size_t a, size_t b) { return a < b ? a : b; }
 static inline size_t max_size_t(size_t a, size_t b) { return a > b ? a : b; }
@@ -22,13 +93,141 @@ double rand_double_range(double min, double max) {
     return min + ((double)rand() / RAND_MAX) * (max - min);
 }
 
+// xoshiro256++ state. Every SumTree owns one so samplers on different threads never share a generator.
+typedef struct {
+    uint64_t s[4];
+} Rng;
+
+static inline uint64_t rng_rotl(uint64_t x, int k) {
+    return (x << k) | (x >> (64 - k));
+}
+
+static inline uint64_t rng_splitmix64(uint64_t *state) {
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+    z          = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z          = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+// Expands a single 64 bit seed into the full state, so nearby seeds still give unrelated streams
+void rng_seed(Rng *rng, uint64_t seed) {
+    for (size_t i = 0; i < 4; ++i) {
+        rng->s[i] = rng_splitmix64(&seed);
+    }
+}
+
+static inline uint64_t rng_next_u64(Rng *rng) {
+    uint64_t *s      = rng->s;
+    uint64_t  result = rng_rotl(s[0] + s[3], 23) + s[0];
+    uint64_t  t      = s[1] << 17;
+
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rng_rotl(s[3], 45);
+
+    return result;
+}
+
+// Uniform in [0, 1) with the full 53 bits of mantissa
+static inline double rng_next_double(Rng *rng) {
+    return (double)(rng_next_u64(rng) >> 11) * 0x1.0p-53;
+}
+
+static inline double rng_double_range(Rng *rng, double min, double max) {
+    return min + rng_next_double(rng) * (max - min);
+}
+
+// Uniform in [0, bound) without the modulo bias of rand() % n
+static inline size_t rng_next_below(Rng *rng, size_t bound) {
+    assert(bound > 0);
+    uint64_t threshold = (0 - (uint64_t)bound) % bound;
+    for (;;) {
+        uint64_t x = rng_next_u64(rng);
+        if (x >= threshold)
+            return (size_t)(x % bound);
+    }
+}
+
+// Fills out with count uniforms in [min, max). The state stays in registers for the whole loop.
+void rng_fill_uniform(Rng *rng, double *out, size_t count, double min, double max) {
+    Rng    local = *rng;
+    double scale = (max - min) * 0x1.0p-53;
+    for (size_t i = 0; i < count; ++i) {
+        out[i] = min + (double)(rng_next_u64(&local) >> 11) * scale;
+    }
+    *rng = local;
+}
+
+// One uniform from each of the count equal slices of [0, total), the targets of stratified sampling.
+// Results are kept strictly below total.
+void rng_fill_stratified(Rng *rng, double *out, size_t count, double total) {
+    Rng    local   = *rng;
+    double segment = total / (double)count;
+    for (size_t i = 0; i < count; ++i) {
+        double x = segment * ((double)i + (double)(rng_next_u64(&local) >> 11) * 0x1.0p-53);
+        out[i]   = x < total ? x : nextafter(total, 0.0);
+    }
+    *rng = local;
+}
+
+typedef enum {
+    SUM_TREE_BINARY = 0, // Classic implicit binary heap, 2 * capacity - 1 nodes
+    SUM_TREE_BARY,       // SUM_TREE_BARY_FANOUT children per node, one cache line per child group
+    SUM_TREE_FENWICK,    // Binary indexed tree, capacity nodes, leaf priorities are not stored on their own
+} SumTreeLayout;
+
+// Page size policy for data and priority_tree. At million entry capacities random descents touch a new
+// 4 KB page on almost every level, 2 MB pages keep the whole tree in a handful of TLB entries.
+typedef enum {
+    SUM_TREE_PAGES_DEFAULT = 0, // 64 byte aligned heap blocks
+    SUM_TREE_PAGES_TRANSPARENT, // 2 MB aligned blocks with madvise(MADV_HUGEPAGE)
+    SUM_TREE_PAGES_EXPLICIT,    // MAP_HUGETLB from the reserved pool, transparent when the pool is empty
+} SumTreePages;
+
+typedef struct {
+    SumTreeLayout layout;
+    SumTreePages  pages;
+    // When set, data lives in this file through a shared mmap instead of the heap, so the buffer can
+    // outgrow RAM and the page cache keeps the hot items resident. The file is truncated on create.
+    const char *backing_path;
+    int         backing_tree; // also place priority_tree in the file, after the data
+    int         min_max;      // keep min and max trees in lockstep with priority_tree
+} SumTreeConfig;
+
+// One node of the min and max trees. They are stored together and 1 based, root at 1 and slot i at
+// capacity + i, so two siblings share a 32 byte block and a walk up touches one line per level.
 typedef struct {
-    void   *data;
-    double *priority_tree;
-    size_t  capacity;
-    size_t  current_index;
-    size_t  num_entries;
-    size_t  elem_size;
+    double min;
+    double max;
+} SumTreeMinMax;
+
+typedef struct {
+    void         *data;
+    double       *priority_tree;
+    size_t        capacity;
+    size_t        current_index;
+    size_t        num_entries;
+    size_t        elem_size;
+    SumTreeLayout layout;
+    size_t        tree_size;
+    Rng           rng;
+    void         *mapping; // file backing of data (and maybe priority_tree), NULL when on the heap
+    size_t        mapping_bytes;
+    size_t        data_hugetlb_bytes; // size of the MAP_HUGETLB mapping holding data, 0 for heap blocks
+    size_t        tree_hugetlb_bytes;
+    // Dirty bitmaps for incremental checkpoints, NULL unless sum_tree_track_dirty was called
+    uint64_t *dirty_data; // one bit per chunk of dirty_chunk_items slots
+    uint64_t *dirty_tree; // one bit per SUM_TREE_DIRTY_PAGE bytes of priority_tree
+    size_t    dirty_chunk_items;
+    // Min and max trees over the written slots, whatever layout priority_tree uses. NULL unless
+    // SumTreeConfig.min_max was set or sum_tree_track_min_max was called.
+    SumTreeMinMax *min_max;
+    // B-ary layout only: levels are stored root first, level_offset[depth] is the leaf level
+    size_t depth;
+    size_t level_offset[SUM_TREE_MAX_LEVELS];
 } SumTree;
 
 typedef struct {
@@ -38,10 +237,14 @@ typedef struct {
 } SumTreeSample;
 
 static inline size_t sumtree_tree_size(const SumTree *t) {
-    return 2 * t->capacity - 1;
+    return t->tree_size;
 }
 
 static inline size_t sumtree_leaf_base(const SumTree *t) {
+    if (t->layout == SUM_TREE_BARY)
+        return t->level_offset[t->depth];
+    if (t->layout == SUM_TREE_FENWICK)
+        return 0;
     return t->capacity - 1;
 }
 
@@ -53,9 +256,277 @@ static inline void *sumtree_data_ptr(SumTree *t, size_t data_index) {
     return (char *)t->data + data_index * t->elem_size;
 }
 
-SumTree *create_sum_tree(size_t capacity, size_t elem_size) {
+static inline double sum_tree_total(const SumTree *t) {
+    return t->priority_tree[0];
+}
+
+static inline size_t round_up_size_t(size_t value, size_t multiple) {
+    return (value + multiple - 1) / multiple * multiple;
+}
+
+static inline void *sumtree_aligned_alloc(size_t bytes, size_t alignment) {
+    void *ptr = NULL;
+    bytes     = round_up_size_t(bytes, alignment);
+#if defined(_MSC_VER)
+    ptr = _aligned_malloc(bytes, alignment);
+#else
+    if (posix_memalign(&ptr, alignment, bytes) != 0)
+        ptr = NULL;
+#endif
+    return ptr;
+}
+
+static inline void *sumtree_aligned_calloc(size_t count, size_t size, size_t alignment) {
+    size_t bytes = round_up_size_t(count * size, alignment);
+    void  *ptr   = sumtree_aligned_alloc(bytes, alignment);
+    if (ptr != NULL)
+        memset(ptr, 0, bytes);
+    return ptr;
+}
+
+static void sumtree_aligned_free(void *ptr) {
+#if defined(_MSC_VER)
+    _aligned_free(ptr);
+#else
+    free(ptr);
+#endif
+}
+
+// Allocates a data or tree block under the page policy. hugetlb_bytes receives the mapping size when the
+// block came from MAP_HUGETLB, 0 otherwise; pass it back to sumtree_free_block.
+static void *sumtree_alloc_block(size_t bytes, size_t alignment, SumTreePages pages, int zero, size_t *hugetlb_bytes) {
+    *hugetlb_bytes = 0;
+
+#if defined(__linux__) && defined(MAP_HUGETLB)
+    if (pages == SUM_TREE_PAGES_EXPLICIT) {
+        size_t rounded = round_up_size_t(bytes, SUM_TREE_HUGE_PAGE);
+        void  *ptr     = mmap(NULL, rounded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (ptr != MAP_FAILED) {
+            *hugetlb_bytes = rounded; // anonymous mappings start zeroed
+            return ptr;
+        }
+    }
+#endif
+    // Small blocks would waste most of a huge page
+    if (pages != SUM_TREE_PAGES_DEFAULT && bytes >= SUM_TREE_HUGE_PAGE) {
+        alignment = max_size_t(alignment, SUM_TREE_HUGE_PAGE);
+        pages     = SUM_TREE_PAGES_TRANSPARENT;
+    } else {
+        pages = SUM_TREE_PAGES_DEFAULT;
+    }
+
+    bytes     = round_up_size_t(bytes, alignment);
+    void *ptr = sumtree_aligned_alloc(bytes, alignment);
+    if (ptr == NULL)
+        return NULL;
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+    // Before the first touch, so the faults already come in as huge pages
+    if (pages == SUM_TREE_PAGES_TRANSPARENT)
+        madvise(ptr, bytes, MADV_HUGEPAGE);
+#endif
+    if (zero)
+        memset(ptr, 0, bytes);
+    return ptr;
+}
+
+static void sumtree_free_block(void *ptr, size_t hugetlb_bytes) {
+#if !defined(_MSC_VER)
+    if (hugetlb_bytes > 0) {
+        munmap(ptr, hugetlb_bytes);
+        return;
+    }
+#endif
+    (void)hugetlb_bytes;
+    sumtree_aligned_free(ptr);
+}
+
+#if !defined(_MSC_VER)
+// Maps backing_path as [data | priority_tree], each region page aligned. Data gets MADV_RANDOM since
+// sampled slots are scattered, the tree MADV_WILLNEED since every descent walks its top levels.
+static int sumtree_map_backing(SumTree *t, SumTreeConfig config) {
+    size_t page       = (size_t)sysconf(_SC_PAGESIZE);
+    size_t data_bytes = round_up_size_t(t->capacity * t->elem_size, page);
+    size_t tree_bytes = config.backing_tree ? round_up_size_t(t->tree_size * sizeof(double), page) : 0;
+    size_t bytes      = data_bytes + tree_bytes;
+    if (bytes == 0)
+        return 1;
+
+    int fd = open(config.backing_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror(config.backing_path);
+        return 0;
+    }
+    // A fresh sparse file reads as zeros, just like calloc
+    if (ftruncate(fd, (off_t)bytes) != 0) {
+        perror(config.backing_path);
+        close(fd);
+        return 0;
+    }
+    void *mapping = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        perror(config.backing_path);
+        return 0;
+    }
+
+    t->mapping       = mapping;
+    t->mapping_bytes = bytes;
+    if (data_bytes > 0) {
+        t->data = mapping;
+        madvise(mapping, data_bytes, MADV_RANDOM);
+    }
+    if (tree_bytes > 0) {
+        t->priority_tree = (double *)((char *)mapping + data_bytes);
+        madvise(t->priority_tree, tree_bytes, MADV_WILLNEED);
+    }
+    return 1;
+}
+#endif
+
+static inline int sumtree_tree_in_mapping(const SumTree *t) {
+    return t->mapping != NULL && (const char *)t->priority_tree >= (const char *)t->mapping &&
+           (const char *)t->priority_tree < (const char *)t->mapping + t->mapping_bytes;
+}
+
+// Lays out the B-ary levels root first. Every level is padded to a multiple of the fan-out so that
+// each group of siblings starts on its own cache line.
+static size_t sumtree_bary_layout(SumTree *t) {
+    size_t depth = 0;
+    for (size_t span = 1; span < t->capacity; span *= SUM_TREE_BARY_FANOUT)
+        depth++;
+    assert(depth < SUM_TREE_MAX_LEVELS);
+
+    size_t offset = 0;
+    for (size_t level = 0; level <= depth; ++level) {
+        size_t span = 1;
+        for (size_t i = level; i < depth; ++i)
+            span *= SUM_TREE_BARY_FANOUT;
+
+        size_t nodes            = (t->capacity + span - 1) / span;
+        t->level_offset[level] = offset;
+        offset += round_up_size_t(nodes, SUM_TREE_BARY_FANOUT);
+    }
+
+    t->depth = depth;
+    return offset;
+}
+
+// Nodes of the tree for t->layout and t->capacity, also fills the B-ary level offsets
+static size_t sumtree_layout_tree_size(SumTree *t) {
+    switch (t->layout) {
+    case SUM_TREE_BARY:
+        return sumtree_bary_layout(t);
+    case SUM_TREE_FENWICK:
+        return t->capacity;
+    default:
+        return 2 * t->capacity - 1;
+    }
+}
+
+// Fenwick layout. Node k (1 based) covers the leaves (k - lowbit(k), k] and is stored at k & (capacity - 1),
+// so node capacity, the sum of everything, lands in slot 0 and sum_tree_total works unchanged. A leaf
+// priority is its node minus the nodes that cover the rest of that node's range.
+static inline double *sumtree_fenwick_node(const SumTree *t, size_t k) {
+    return t->priority_tree + (k & (t->capacity - 1));
+}
+
+static inline double sumtree_fenwick_leaf(const SumTree *t, size_t data_index) {
+    size_t k     = data_index + 1;
+    size_t start = k - (k & (0 - k));
+    double value = *sumtree_fenwick_node(t, k);
+    for (size_t j = k - 1; j > start; j -= j & (0 - j))
+        value -= *sumtree_fenwick_node(t, j);
+    return value;
+}
+
+static inline void sumtree_fenwick_add(SumTree *t, size_t data_index, double delta) {
+    for (size_t k = data_index + 1; k <= t->capacity; k += k & (0 - k))
+        *sumtree_fenwick_node(t, k) += delta;
+}
+
+// Largest prefix of leaves whose sum stays below segment, i.e. the data index whose range holds it
+static inline size_t sumtree_fenwick_descend(const SumTree *t, double segment) {
+    size_t position = 0;
+    for (size_t step = t->capacity >> 1; step > 0; step >>= 1) {
+        double node = t->priority_tree[position + step];
+        if (node < segment) {
+            position += step;
+            segment -= node;
+        }
+    }
+    return position;
+}
+
+// Priority of the leaf at tree_idx, for every layout
+static inline double sum_tree_priority(const SumTree *t, size_t tree_idx) {
+    if (t->layout == SUM_TREE_FENWICK)
+        return sumtree_fenwick_leaf(t, tree_idx);
+    return t->priority_tree[tree_idx];
+}
+
+static inline double sumtree_bary_sum_children(const double *children) {
+#if defined(__AVX2__)
+    __m256d acc = _mm256_load_pd(children);
+    for (size_t i = 4; i < SUM_TREE_BARY_FANOUT; i += 4)
+        acc = _mm256_add_pd(acc, _mm256_load_pd(children + i));
+    __m128d half = _mm_add_pd(_mm256_castpd256_pd128(acc), _mm256_extractf128_pd(acc, 1));
+    return _mm_cvtsd_f64(_mm_add_sd(half, _mm_unpackhi_pd(half, half)));
+#else
+    double sum = 0.0;
+    for (size_t i = 0; i < SUM_TREE_BARY_FANOUT; ++i)
+        sum += children[i];
+    return sum;
+#endif
+}
+
+// Picks the first child whose inclusive prefix sum reaches segment and rebases segment into it.
+static inline size_t sumtree_bary_select_child(const double *children, double *segment) {
+    double prefix[SUM_TREE_BARY_FANOUT];
+    size_t child = 0;
+
+#if defined(__AVX2__)
+    const __m256d zero  = _mm256_setzero_pd();
+    const __m256d seg   = _mm256_set1_pd(*segment);
+    __m256d       carry = zero;
+    for (size_t i = 0; i < SUM_TREE_BARY_FANOUT; i += 4) {
+        __m256d x = _mm256_load_pd(children + i);
+        // In-register inclusive scan: [a, a+b, a+b+c, a+b+c+d]
+        x = _mm256_add_pd(x, _mm256_blend_pd(_mm256_permute4x64_pd(x, _MM_SHUFFLE(2, 1, 0, 0)), zero, 0x1));
+        x = _mm256_add_pd(x, _mm256_blend_pd(_mm256_permute4x64_pd(x, _MM_SHUFFLE(1, 0, 0, 0)), zero, 0x3));
+        x = _mm256_add_pd(x, carry);
+        _mm256_storeu_pd(prefix + i, x);
+        // Prefix sums are monotonic, so the lanes below segment form a contiguous run
+        child += (size_t)sumtree_popcount((unsigned)_mm256_movemask_pd(_mm256_cmp_pd(x, seg, _CMP_LT_OQ)));
+        carry = _mm256_permute4x64_pd(x, _MM_SHUFFLE(3, 3, 3, 3));
+    }
+#else
+    double running = 0.0;
+    for (size_t i = 0; i < SUM_TREE_BARY_FANOUT; ++i) {
+        running += children[i];
+        prefix[i] = running;
+        child += prefix[i] < *segment;
+    }
+#endif
+
+    // Rounding can leave segment a hair above the children's total, step back to the last non-empty one
+    if (child == SUM_TREE_BARY_FANOUT) {
+        child = SUM_TREE_BARY_FANOUT - 1;
+        while (child > 0 && children[child] <= 0.0)
+            child--;
+        *segment = children[child];
+        return child;
+    }
+
+    if (child > 0)
+        *segment -= prefix[child - 1];
+    return child;
+}
+
+void free_sum_tree(SumTree *sum_tree);
+int  sum_tree_track_min_max(SumTree *sum_tree);
+
+SumTree *create_sum_tree_ex(size_t capacity, size_t elem_size, SumTreeConfig config) {
     assert(capacity > 0);
-    assert(elem_size > 0);
 
     // Check if the capacity is power of two
     assert((capacity & (capacity - 1)) == 0);
@@ -66,31 +537,170 @@ SumTree *create_sum_tree(size_t capacity, size_t elem_size) {
         return NULL;
     }
 
+    *sum_tree               = (SumTree){0};
     sum_tree->capacity      = capacity;
     sum_tree->elem_size     = elem_size;
     sum_tree->num_entries   = 0;
     sum_tree->current_index = 0;
+    sum_tree->layout        = config.layout;
+
+    // Callers that need reproducible runs reseed through sum_tree_seed
+    rng_seed(&sum_tree->rng, (uint64_t)time(NULL) ^ (uint64_t)(uintptr_t)sum_tree);
 
-    sum_tree->data = malloc(elem_size * capacity);
-    if (sum_tree->data == NULL) {
+    sum_tree->tree_size = sumtree_layout_tree_size(sum_tree);
+
+    if (config.backing_path != NULL) {
+#if defined(_MSC_VER)
+        fprintf(stderr, "File backed sum trees need mmap, which this platform lacks\n");
         free(sum_tree);
         return NULL;
+#else
+        if (!sumtree_map_backing(sum_tree, config)) {
+            free(sum_tree);
+            return NULL;
+        }
+#endif
+    } else if (elem_size > 0) {
+        // elem_size 0 keeps only priorities, for callers that store the payloads themselves
+        sum_tree->data = sumtree_alloc_block(elem_size * capacity, SUM_TREE_CACHE_LINE, config.pages, 0, &sum_tree->data_hugetlb_bytes);
+        if (sum_tree->data == NULL) {
+            free(sum_tree);
+            return NULL;
+        }
     }
 
-    sum_tree->priority_tree = (double *)calloc((2 * capacity - 1), sizeof(double));
     if (sum_tree->priority_tree == NULL) {
-        free(sum_tree->data);
-        free(sum_tree);
+        size_t alignment        = max_size_t(SUM_TREE_CACHE_LINE, SUM_TREE_BARY_FANOUT * sizeof(double));
+        sum_tree->priority_tree = (double *)sumtree_alloc_block(sum_tree->tree_size * sizeof(double), alignment, config.pages, 1, &sum_tree->tree_hugetlb_bytes);
+        if (sum_tree->priority_tree == NULL) {
+            free_sum_tree(sum_tree);
+            return NULL;
+        }
+    }
+
+    if (config.min_max && !sum_tree_track_min_max(sum_tree)) {
+        free_sum_tree(sum_tree);
         return NULL;
     }
 
     return sum_tree;
 }
 
+SumTree *create_sum_tree(size_t capacity, size_t elem_size) {
+    return create_sum_tree_ex(capacity, elem_size, (SumTreeConfig){0});
+}
+
+void sum_tree_seed(SumTree *sum_tree, uint64_t seed) {
+    rng_seed(&sum_tree->rng, seed);
+}
+
+static void sum_tree_bary_update(SumTree *sum_tree, size_t tree_idx, double priority) {
+    double *tree = sum_tree->priority_tree;
+    size_t  node = tree_idx - sumtree_leaf_base(sum_tree);
+
+    tree[tree_idx] = priority;
+
+    // Recompute each ancestor from its (single cache line of) children so no rounding drift accumulates
+    for (size_t level = sum_tree->depth; level > 0; --level) {
+        size_t group = node - node % SUM_TREE_BARY_FANOUT;
+        double sum   = sumtree_bary_sum_children(tree + sum_tree->level_offset[level] + group);
+        node /= SUM_TREE_BARY_FANOUT;
+        tree[sum_tree->level_offset[level - 1] + node] = sum;
+    }
+}
+
+static size_t sum_tree_bary_descend(const SumTree *sum_tree, double segment) {
+    const double *tree = sum_tree->priority_tree;
+    size_t        node = 0;
+
+    for (size_t level = 1; level <= sum_tree->depth; ++level) {
+        const double *children = tree + sum_tree->level_offset[level] + node * SUM_TREE_BARY_FANOUT;
+        node                   = node * SUM_TREE_BARY_FANOUT + sumtree_bary_select_child(children, &segment);
+    }
+
+    return sum_tree->level_offset[sum_tree->depth] + node;
+}
+
+static inline void sumtree_set_bit(uint64_t *bits, size_t index) {
+    bits[index >> 6] |= (uint64_t)1 << (index & 63);
+}
+
+// Marks the priority_tree pages of a leaf and of all its ancestors
+static void sumtree_mark_dirty_path(SumTree *sum_tree, size_t tree_idx) {
+    const size_t per_page = SUM_TREE_DIRTY_PAGE / sizeof(double);
+
+    if (sum_tree->layout == SUM_TREE_FENWICK) {
+        for (size_t k = tree_idx + 1; k <= sum_tree->capacity; k += k & (0 - k))
+            sumtree_set_bit(sum_tree->dirty_tree, (k & (sum_tree->capacity - 1)) / per_page);
+        return;
+    }
+
+    if (sum_tree->layout != SUM_TREE_BARY) {
+        for (;;) {
+            sumtree_set_bit(sum_tree->dirty_tree, tree_idx / per_page);
+            if (tree_idx == 0)
+                break;
+            tree_idx = (tree_idx - 1) / 2;
+        }
+        return;
+    }
+
+    size_t position = tree_idx - sumtree_leaf_base(sum_tree);
+    for (size_t level = sum_tree->depth + 1; level-- > 0;) {
+        sumtree_set_bit(sum_tree->dirty_tree, (sum_tree->level_offset[level] + position) / per_page);
+        position /= SUM_TREE_BARY_FANOUT;
+    }
+}
+
+// Sets a leaf of the min and max trees and walks up until neither parent changes
+static void sumtree_min_max_update(SumTree *sum_tree, size_t data_index, double priority) {
+    SumTreeMinMax *nodes = sum_tree->min_max;
+    size_t         node  = sum_tree->capacity + data_index;
+
+    // A zero leaf can never be sampled, so it must not drag the minimum that weights are normalized by to 0
+    nodes[node] = (SumTreeMinMax){.min = priority > 0.0 ? priority : INFINITY, .max = priority};
+    for (node /= 2; node > 0; node /= 2) {
+        SumTreeMinMax left  = nodes[2 * node];
+        SumTreeMinMax right = nodes[2 * node + 1];
+        SumTreeMinMax next  = {.min = left.min < right.min ? left.min : right.min, .max = left.max > right.max ? left.max : right.max};
+        if (nodes[node].min == next.min && nodes[node].max == next.max)
+            break;
+        nodes[node] = next;
+    }
+}
+
+// Smallest positive priority of any slot, 0 when no slot has one. Needs the min and max trees.
+static inline double sum_tree_min_priority(const SumTree *t) {
+    assert(t->min_max);
+    return isinf(t->min_max[1].min) ? 0.0 : t->min_max[1].min;
+}
+
+// Largest priority of any slot, evictions included. Needs the min and max trees.
+static inline double sum_tree_max_priority(const SumTree *t) {
+    assert(t->min_max);
+    return t->min_max[1].max;
+}
+
 void sum_tree_update(SumTree *sum_tree, size_t tree_idx, double priority) {
     // Very unlikely but it can happen
     assert(tree_idx < sumtree_tree_size(sum_tree));
 
+    if (sum_tree->dirty_tree != NULL)
+        sumtree_mark_dirty_path(sum_tree, tree_idx);
+
+    if (sum_tree->min_max != NULL)
+        sumtree_min_max_update(sum_tree, tree_idx - sumtree_leaf_base(sum_tree), priority);
+
+    if (sum_tree->layout == SUM_TREE_BARY) {
+        sum_tree_bary_update(sum_tree, tree_idx, priority);
+        return;
+    }
+
+    if (sum_tree->layout == SUM_TREE_FENWICK) {
+        sumtree_fenwick_add(sum_tree, tree_idx, priority - sumtree_fenwick_leaf(sum_tree, tree_idx));
+        return;
+    }
+
     double old_priority               = sum_tree->priority_tree[tree_idx];
     double priority_change            = priority - old_priority;
     sum_tree->priority_tree[tree_idx] = priority;
@@ -101,12 +711,233 @@ void sum_tree_update(SumTree *sum_tree, size_t tree_idx, double priority) {
     }
 }
 
+// Sorts a small index set in place and drops duplicates, returns the number of distinct entries
+static size_t sumtree_sort_unique(size_t *values, size_t count) {
+    for (size_t i = 1; i < count; ++i) {
+        size_t value = values[i];
+        size_t j     = i;
+        while (j > 0 && values[j - 1] > value) {
+            values[j] = values[j - 1];
+            j--;
+        }
+        values[j] = value;
+    }
+
+    if (count == 0)
+        return 0;
+
+    size_t unique = 1;
+    for (size_t i = 1; i < count; ++i) {
+        values[unique] = values[i];
+        unique += values[i] != values[unique - 1];
+    }
+    return unique;
+}
+
+// Recomputes every ancestor of the given (sorted, distinct) leaf positions exactly once, one level at a time
+static void sumtree_bary_rebuild_ancestors(SumTree *sum_tree, size_t *nodes, size_t count) {
+    double *tree = sum_tree->priority_tree;
+
+    for (size_t level = sum_tree->depth; level > 0; --level) {
+        // Siblings map to the same parent and sit next to each other, keep the first of each run. The
+        // children of a parent are final once their level is done, so it is summed right away.
+        size_t parents = 0;
+        size_t last    = SIZE_MAX;
+        for (size_t i = 0; i < count; ++i) {
+            size_t parent = nodes[i] / SUM_TREE_BARY_FANOUT;
+            if (parent == last)
+                continue;
+
+            const double *children                           = tree + sum_tree->level_offset[level] + parent * SUM_TREE_BARY_FANOUT;
+            tree[sum_tree->level_offset[level - 1] + parent] = sumtree_bary_sum_children(children);
+            nodes[parents++]                                 = parent;
+            last                                             = parent;
+        }
+        count = parents;
+    }
+}
+
+// Binary layout: below the first level that is at least as wide as the batch the leaf-to-root paths
+// rarely meet, so deltas are pushed up to that split level like sum_tree_update does. From there up the
+// touched nodes fit in a 64 bit mask and each one is recomputed once from its children.
+static void sumtree_binary_update_batch(SumTree *sum_tree, const size_t *tree_indices, const double *priorities, size_t count) {
+    double *tree = sum_tree->priority_tree;
+    double  deltas[SUM_TREE_BATCH_LANES];
+
+    size_t leaf_level = 0;
+    while (((size_t)1 << leaf_level) < sum_tree->capacity)
+        leaf_level++;
+
+    size_t split = 0;
+    while (((size_t)1 << split) < count)
+        split++;
+    split = min_size_t(split, leaf_level);
+
+    size_t split_base = ((size_t)1 << split) - 1;
+
+    for (size_t i = 0; i < count; ++i) {
+        deltas[i]             = priorities[i] - tree[tree_indices[i]];
+        tree[tree_indices[i]] = priorities[i];
+    }
+
+    uint64_t touched = 0;
+    for (size_t i = 0; i < count; ++i) {
+        size_t node = tree_indices[i];
+        while (node > 2 * split_base) {
+            node = (node - 1) / 2;
+            tree[node] += deltas[i];
+        }
+        touched |= (uint64_t)1 << (node - split_base);
+    }
+
+    for (size_t level = split; level > 0; --level) {
+        size_t   parent_base = ((size_t)1 << (level - 1)) - 1;
+        uint64_t parents     = 0;
+
+        while (touched != 0) {
+            uint64_t bit = (uint64_t)1 << (sumtree_ctz64(touched) >> 1);
+            touched &= touched - 1;
+            if (parents & bit)
+                continue;
+
+            parents |= bit;
+            size_t node = parent_base + (size_t)sumtree_ctz64(bit);
+            size_t left = (node << 1) + 1;
+            tree[node]  = tree[left] + tree[left + 1];
+        }
+        touched = parents;
+    }
+}
+
+// Writes all leaves first, then refreshes each touched internal node once. When an index repeats the
+// last priority wins, same as calling sum_tree_update in order.
+void sum_tree_update_batch(SumTree *sum_tree, const size_t *tree_indices, const double *priorities, size_t count) {
+    assert(sum_tree);
+    assert((tree_indices && priorities) || count == 0);
+
+    size_t leaf_base = sumtree_leaf_base(sum_tree);
+    size_t nodes[SUM_TREE_BATCH_LANES];
+
+    for (size_t start = 0; start < count; start += SUM_TREE_BATCH_LANES) {
+        size_t chunk = min_size_t(SUM_TREE_BATCH_LANES, count - start);
+
+        // Get every leaf line in flight before the first write depends on one of them
+        for (size_t i = 0; i < chunk; ++i) {
+            assert(tree_indices[start + i] >= leaf_base && tree_indices[start + i] < leaf_base + sum_tree->capacity);
+            SUM_TREE_PREFETCH(sum_tree->priority_tree + tree_indices[start + i]);
+        }
+
+        if (sum_tree->dirty_tree != NULL) {
+            for (size_t i = 0; i < chunk; ++i)
+                sumtree_mark_dirty_path(sum_tree, tree_indices[start + i]);
+        }
+
+        // Min and max paths go one by one, they mostly stop changing a few levels up
+        if (sum_tree->min_max != NULL) {
+            for (size_t i = 0; i < chunk; ++i)
+                SUM_TREE_PREFETCH(sum_tree->min_max + sum_tree->capacity + tree_indices[start + i] - leaf_base);
+            for (size_t i = 0; i < chunk; ++i)
+                sumtree_min_max_update(sum_tree, tree_indices[start + i] - leaf_base, priorities[start + i]);
+        }
+
+        // Fenwick paths share few nodes and each delta needs the current leaf, so they go one by one
+        if (sum_tree->layout == SUM_TREE_FENWICK) {
+            for (size_t i = 0; i < chunk; ++i) {
+                size_t leaf = tree_indices[start + i];
+                sumtree_fenwick_add(sum_tree, leaf, priorities[start + i] - sumtree_fenwick_leaf(sum_tree, leaf));
+            }
+            continue;
+        }
+
+        if (sum_tree->layout != SUM_TREE_BARY) {
+            sumtree_binary_update_batch(sum_tree, tree_indices + start, priorities + start, chunk);
+            continue;
+        }
+
+        for (size_t i = 0; i < chunk; ++i) {
+            sum_tree->priority_tree[tree_indices[start + i]] = priorities[start + i];
+            nodes[i]                                         = tree_indices[start + i] - leaf_base;
+        }
+
+        size_t distinct = sumtree_sort_unique(nodes, chunk);
+        sumtree_bary_rebuild_ancestors(sum_tree, nodes, distinct);
+    }
+}
+
+// Refills the min and max trees from priority_tree in O(capacity), after priority_tree was loaded or
+// repaired behind their back. Slots past num_entries count as unwritten, they never win the minimum.
+void sum_tree_rebuild_min_max(SumTree *sum_tree) {
+    SumTreeMinMax *nodes = sum_tree->min_max;
+    if (nodes == NULL)
+        return;
+
+    size_t leaf_base = sumtree_leaf_base(sum_tree);
+    size_t capacity  = sum_tree->capacity;
+    // Fenwick leaves are differences of prefix sums, a zero leaf can come back as rounding noise. Anything
+    // under the 1e-12 probability floor the weights use anyway counts as zero.
+    double noise = sum_tree->layout == SUM_TREE_FENWICK ? 1e-12 * sum_tree_total(sum_tree) : 0.0;
+    for (size_t i = 0; i < capacity; ++i) {
+        double priority     = i < sum_tree->num_entries ? sum_tree_priority(sum_tree, leaf_base + i) : 0.0;
+        nodes[capacity + i] = (SumTreeMinMax){.min = priority > noise ? priority : INFINITY, .max = priority};
+    }
+    for (size_t i = capacity; i-- > 1;) {
+        nodes[i].min = fmin(nodes[2 * i].min, nodes[2 * i + 1].min);
+        nodes[i].max = fmax(nodes[2 * i].max, nodes[2 * i + 1].max);
+    }
+}
+
+// Starts the min and max trees, filled from the current priorities, e.g. on a PER restored from a
+// snapshot. Returns 0 when they cannot be allocated.
+int sum_tree_track_min_max(SumTree *sum_tree) {
+    if (sum_tree->min_max != NULL)
+        return 1;
+
+    sum_tree->min_max = (SumTreeMinMax *)sumtree_aligned_alloc(2 * sum_tree->capacity * sizeof(SumTreeMinMax), SUM_TREE_CACHE_LINE);
+    if (sum_tree->min_max == NULL)
+        return 0;
+    sum_tree->min_max[0] = (SumTreeMinMax){.min = INFINITY, .max = 0.0}; // unused
+    sum_tree_rebuild_min_max(sum_tree);
+    return 1;
+}
+
+// Recomputes every internal node from the leaves in O(tree_size), e.g. after a writer died halfway
+// through an update and left its path inconsistent. Fenwick trees keep no separate leaves, so there is
+// nothing to rebuild them from and they are left as they are. The min and max trees follow the leaves.
+void sum_tree_rebuild(SumTree *sum_tree) {
+    double *tree = sum_tree->priority_tree;
+
+    sum_tree_rebuild_min_max(sum_tree);
+    if (sum_tree->layout == SUM_TREE_FENWICK)
+        return;
+
+    if (sum_tree->layout == SUM_TREE_BARY) {
+        for (size_t level = sum_tree->depth; level > 0; --level) {
+            size_t level_end = level == sum_tree->depth ? sum_tree->tree_size : sum_tree->level_offset[level + 1];
+            size_t parents   = (level_end - sum_tree->level_offset[level]) / SUM_TREE_BARY_FANOUT;
+            for (size_t parent = 0; parent < parents; ++parent) {
+                const double *children                           = tree + sum_tree->level_offset[level] + parent * SUM_TREE_BARY_FANOUT;
+                tree[sum_tree->level_offset[level - 1] + parent] = sumtree_bary_sum_children(children);
+            }
+        }
+        return;
+    }
+
+    for (size_t i = sum_tree->capacity - 1; i-- > 0;) {
+        tree[i] = tree[2 * i + 1] + tree[2 * i + 2];
+    }
+}
+
 void sum_tree_add(SumTree *sum_tree, const void *item, double priority) {
     size_t elem_idx = sumtree_leaf_index(sum_tree, sum_tree->current_index);
 
-    void *dst_data = sumtree_data_ptr(sum_tree, sum_tree->current_index);
+    if (sum_tree->elem_size > 0) {
+        void *dst_data = sumtree_data_ptr(sum_tree, sum_tree->current_index);
 
-    memcpy(dst_data, item, sum_tree->elem_size);
+        memcpy(dst_data, item, sum_tree->elem_size);
+
+        if (sum_tree->dirty_data != NULL)
+            sumtree_set_bit(sum_tree->dirty_data, sum_tree->current_index / sum_tree->dirty_chunk_items);
+    }
 
     sum_tree_update(sum_tree, elem_idx, priority);
 
@@ -138,30 +969,187 @@ void sum_tree_get(SumTree *sum_tree, double segment, SumTreeSample *out, void *o
     size_t idx       = 0;
     size_t leaf_base = sumtree_leaf_base(sum_tree);
 
-    while (idx < leaf_base) {
-        size_t left     = (idx << 1) + 1;
-        double left_sum = sum_tree->priority_tree[left];
+    if (sum_tree->layout == SUM_TREE_BARY) {
+        idx = sum_tree_bary_descend(sum_tree, segment);
+    } else if (sum_tree->layout == SUM_TREE_FENWICK) {
+        idx = sumtree_fenwick_descend(sum_tree, segment);
+    } else {
+        while (idx < leaf_base) {
+            size_t left     = (idx << 1) + 1;
+            double left_sum = sum_tree->priority_tree[left];
 
-        if (segment <= left_sum)
-            idx = left;
-        else {
-            segment -= left_sum;
-            idx = left + 1;
+            if (segment <= left_sum)
+                idx = left;
+            else {
+                segment -= left_sum;
+                idx = left + 1;
+            }
         }
     }
 
     size_t data_index = idx - sumtree_leaf_base(sum_tree);
 
-    if (out_item != NULL) {
+    if (out_item != NULL && sum_tree->elem_size > 0) {
         memcpy(out_item, sumtree_data_ptr(sum_tree, data_index), sum_tree->elem_size);
     }
 
     out->p_idx    = idx;
     out->d_idx    = data_index;
-    out->priority = sum_tree->priority_tree[idx];
+    out->priority = sum_tree_priority(sum_tree, idx);
+}
+
+static inline double sumtree_clamp_segment(double segment, double total) {
+    if (segment < 0.0)
+        segment = 0.0;
+    if (segment >= total)
+        segment = nextafter(total, 0.0);
+    return segment;
+}
+
+// Starts pulling the first SUM_TREE_PREFETCH_ITEM_BYTES of a payload into the cache
+static inline void sumtree_prefetch_item(const SumTree *sum_tree, size_t data_index) {
+    const char *item  = (const char *)sum_tree->data + data_index * sum_tree->elem_size;
+    size_t      bytes = min_size_t(sum_tree->elem_size, SUM_TREE_PREFETCH_ITEM_BYTES);
+    for (size_t offset = 0; offset < bytes; offset += SUM_TREE_CACHE_LINE)
+        SUM_TREE_PREFETCH(item + offset);
+}
+
+// Runs up to SUM_TREE_BATCH_LANES descents side by side, one level at a time. Every lane issues a
+// prefetch for the node it will read on the next level, so the cache misses of the whole batch overlap
+// instead of being paid one after another.
+static void sum_tree_get_lanes(const SumTree *sum_tree, const double *segments, size_t count, SumTreeSample *out, int prefetch_items) {
+    const double *tree = sum_tree->priority_tree;
+    double        total = sum_tree_total(sum_tree);
+    size_t        idx[SUM_TREE_BATCH_LANES];
+    double        seg[SUM_TREE_BATCH_LANES];
+
+    for (size_t i = 0; i < count; ++i) {
+        idx[i] = 0;
+        seg[i] = sumtree_clamp_segment(segments[i], total);
+    }
+
+    if (sum_tree->layout == SUM_TREE_BARY) {
+        for (size_t level = 1; level <= sum_tree->depth; ++level) {
+            const double *level_base = tree + sum_tree->level_offset[level];
+            const double *next_base  = level < sum_tree->depth ? tree + sum_tree->level_offset[level + 1] : NULL;
+
+            for (size_t i = 0; i < count; ++i) {
+                const double *children = level_base + idx[i] * SUM_TREE_BARY_FANOUT;
+                idx[i]                 = idx[i] * SUM_TREE_BARY_FANOUT + sumtree_bary_select_child(children, &seg[i]);
+                if (next_base != NULL)
+                    SUM_TREE_PREFETCH(next_base + idx[i] * SUM_TREE_BARY_FANOUT);
+                else if (prefetch_items)
+                    sumtree_prefetch_item(sum_tree, idx[i]);
+            }
+        }
+
+        for (size_t i = 0; i < count; ++i)
+            idx[i] += sum_tree->level_offset[sum_tree->depth];
+    } else if (sum_tree->layout == SUM_TREE_FENWICK) {
+        // idx holds each lane's position, the next node it reads is position + step / 2 or step / 2 further
+        for (size_t step = sum_tree->capacity >> 1; step > 0; step >>= 1) {
+            for (size_t i = 0; i < count; ++i) {
+                double node = tree[idx[i] + step];
+                if (node < seg[i]) {
+                    idx[i] += step;
+                    seg[i] -= node;
+                }
+                if (step > 1)
+                    SUM_TREE_PREFETCH(tree + idx[i] + (step >> 1));
+                else if (prefetch_items)
+                    sumtree_prefetch_item(sum_tree, idx[i]);
+            }
+        }
+    } else {
+        size_t leaf_base = sumtree_leaf_base(sum_tree);
+
+        // All lanes sit on the same level, so they reach the leaves together
+        while (idx[0] < leaf_base) {
+            for (size_t i = 0; i < count; ++i) {
+                size_t left     = (idx[i] << 1) + 1;
+                double left_sum = tree[left];
+
+                if (seg[i] <= left_sum)
+                    idx[i] = left;
+                else {
+                    seg[i] -= left_sum;
+                    idx[i] = left + 1;
+                }
+
+                // Both children of the new node share a cache line
+                if (idx[i] < leaf_base)
+                    SUM_TREE_PREFETCH(tree + (idx[i] << 1) + 1);
+                else if (prefetch_items)
+                    sumtree_prefetch_item(sum_tree, idx[i] - leaf_base);
+            }
+        }
+    }
+
+    size_t leaf_base = sumtree_leaf_base(sum_tree);
+    for (size_t i = 0; i < count; ++i) {
+        out[i].p_idx    = idx[i];
+        out[i].d_idx    = idx[i] - leaf_base;
+        out[i].priority = sum_tree_priority(sum_tree, idx[i]);
+    }
+}
+
+void sum_tree_get_batch(SumTree *sum_tree, const double *segments, size_t count, SumTreeSample *out) {
+    assert(sum_tree);
+    assert(segments || count == 0);
+    assert(out || count == 0);
+
+    if (sum_tree_total(sum_tree) <= 0.0) {
+        for (size_t i = 0; i < count; ++i)
+            out[i] = (SumTreeSample){0};
+        return;
+    }
+
+    for (size_t start = 0; start < count; start += SUM_TREE_BATCH_LANES) {
+        size_t lanes = min_size_t(SUM_TREE_BATCH_LANES, count - start);
+        sum_tree_get_lanes(sum_tree, segments + start, lanes, out + start, 0);
+    }
+}
+
+// Same as sum_tree_get_batch, but every lane also prefetches its payload the moment it lands on a leaf,
+// so the item loads overlap with the descents that are still running
+void sum_tree_get_batch_prefetch_items(SumTree *sum_tree, const double *segments, size_t count, SumTreeSample *out) {
+    assert(sum_tree);
+    assert(segments || count == 0);
+    assert(out || count == 0);
+
+    if (sum_tree_total(sum_tree) <= 0.0) {
+        for (size_t i = 0; i < count; ++i)
+            out[i] = (SumTreeSample){0};
+        return;
+    }
+
+    for (size_t start = 0; start < count; start += SUM_TREE_BATCH_LANES) {
+        size_t lanes = min_size_t(SUM_TREE_BATCH_LANES, count - start);
+        sum_tree_get_lanes(sum_tree, segments + start, lanes, out + start, 1);
+    }
 }
 
 void sum_tree_show(SumTree *sum_tree) {
+    if (sum_tree->layout == SUM_TREE_FENWICK) {
+        printf("%f\n", sum_tree_total(sum_tree));
+        for (size_t i = 0; i < sum_tree->capacity; i++) {
+            printf("%f ", sumtree_fenwick_leaf(sum_tree, i));
+        }
+        printf("\n");
+        return;
+    }
+
+    if (sum_tree->layout == SUM_TREE_BARY) {
+        for (size_t level = 0; level <= sum_tree->depth; ++level) {
+            size_t end = level < sum_tree->depth ? sum_tree->level_offset[level + 1] : sumtree_tree_size(sum_tree);
+            for (size_t i = sum_tree->level_offset[level]; i < end; i++) {
+                printf("%f ", sum_tree->priority_tree[i]);
+            }
+            printf("\n");
+        }
+        return;
+    }
+
     size_t priority_tree_size = sumtree_tree_size(sum_tree);
     for (size_t level_start = 0, level_count = 1; level_start < priority_tree_size; level_start += level_count, level_count *= 2) {
         for (size_t i = 0; i < level_count && level_start + i < priority_tree_size; i++) {
@@ -181,11 +1169,45 @@ void sum_data_show(SumTree *sum_tree) {
     printf("\n");
 }
 
+// Starts dirty tracking for incremental checkpoints: sum_tree_add marks the data chunk it writes and
+// every update marks the tree pages on the path to the root. Returns 0 when the bitmaps cannot be
+// allocated.
+int sum_tree_track_dirty(SumTree *sum_tree, size_t data_chunk_bytes) {
+    if (sum_tree->dirty_tree != NULL)
+        return 1;
+
+    size_t chunk_items = sum_tree->elem_size > 0 ? max_size_t(1, data_chunk_bytes / sum_tree->elem_size) : sum_tree->capacity;
+    size_t data_chunks = (sum_tree->capacity + chunk_items - 1) / chunk_items;
+    size_t tree_pages  = (sum_tree->tree_size * sizeof(double) + SUM_TREE_DIRTY_PAGE - 1) / SUM_TREE_DIRTY_PAGE;
+
+    sum_tree->dirty_data = (uint64_t *)calloc((data_chunks + 63) / 64, sizeof(uint64_t));
+    sum_tree->dirty_tree = (uint64_t *)calloc((tree_pages + 63) / 64, sizeof(uint64_t));
+    if (sum_tree->dirty_data == NULL || sum_tree->dirty_tree == NULL) {
+        free(sum_tree->dirty_data);
+        free(sum_tree->dirty_tree);
+        sum_tree->dirty_data = NULL;
+        sum_tree->dirty_tree = NULL;
+        return 0;
+    }
+    sum_tree->dirty_chunk_items = chunk_items;
+    return 1;
+}
+
 void free_sum_tree(SumTree *sum_tree) {
     if (!sum_tree)
         return;
-    free(sum_tree->data);
-    free(sum_tree->priority_tree);
+    free(sum_tree->dirty_data);
+    free(sum_tree->dirty_tree);
+    sumtree_aligned_free(sum_tree->min_max);
+    if (!sumtree_tree_in_mapping(sum_tree))
+        sumtree_free_block(sum_tree->priority_tree, sum_tree->tree_hugetlb_bytes);
+#if !defined(_MSC_VER)
+    if (sum_tree->mapping != NULL) {
+        munmap(sum_tree->mapping, sum_tree->mapping_bytes);
+        sum_tree->data = NULL;
+    }
+#endif
+    sumtree_free_block(sum_tree->data, sum_tree->data_hugetlb_bytes);
     free(sum_tree);
 }
 
@@ -46,7 +46,8 @@ int main(int argc, char** argv) {
     // Let's append the command line arguments
 #if !defined(_MSC_VER)
     // On POSIX
-    nob_cmd_append(&cmd, "cc", "-Wall", "-Wextra", "-o", BUILD_FOLDER "main", SRC_FOLDER "main.c");
+    // -march=native lets the sum tree pick up its AVX2 paths when the host supports them
+    nob_cmd_append(&cmd, "cc", "-Wall", "-Wextra", "-O2", "-march=native", "-o", BUILD_FOLDER "main", SRC_FOLDER "main.c", "-lm");
 #else
     // On MSVC
     nob_cmd_append(&cmd, "cl", "-I.", "-o", BUILD_FOLDER "hello", SRC_FOLDER "hello.c");
@@ -64,7 +65,42 @@ int main(int argc, char** argv) {
     nob_cc_flags(&cmd);
     nob_cc_output(&cmd, BUILD_FOLDER "main");
     nob_cc_inputs(&cmd, SRC_FOLDER "main.c");
+#if !defined(_MSC_VER)
+    nob_cmd_append(&cmd, "-lm");
+#endif  // _MSC_VER
     if (!nob_cmd_run(&cmd)) return 1;
 
+    // Benchmark suite: the add / sample / update matrix, micro comparisons, threads and server runs.
+    // POSIX only, it needs pthreads, perf_event, shm_open and the __atomic builtins.
+#if !defined(_MSC_VER)
+    nob_cmd_append(&cmd, "cc", "-Wall", "-Wextra", "-O2", "-march=native", "-pthread", "-o", BUILD_FOLDER "bench", SRC_FOLDER "bench.c", "-lm");
+    if (!nob_cmd_run(&cmd)) return 1;
+#endif  // _MSC_VER
+
+    // PER tables served over a Unix domain socket, POSIX only
+#if !defined(_MSC_VER)
+    nob_cmd_append(&cmd, "cc", "-Wall", "-Wextra", "-O2", "-march=native", "-o", BUILD_FOLDER "per_server", SRC_FOLDER "per_server.c", "-lm");
+    if (!nob_cmd_run(&cmd)) return 1;
+#endif  // _MSC_VER
+
+    // `./nob bench [args...]` runs the benchmark suite right after building it, the remaining arguments
+    // go to build/bench (see `./build/bench --help`)
+    nob_shift(argv, argc);
+    if (argc > 0) {
+        const char* command = nob_shift(argv, argc);
+        if (strcmp(command, "bench") != 0) {
+            nob_log(NOB_ERROR, "Unknown command `%s`, expected `bench`", command);
+            return 1;
+        }
+#if defined(_MSC_VER)
+        nob_log(NOB_ERROR, "The benchmark suite is POSIX only");
+        return 1;
+#endif  // _MSC_VER
+
+        nob_cmd_append(&cmd, BUILD_FOLDER "bench");
+        nob_da_append_many(&cmd, argv, argc);
+        if (!nob_cmd_run(&cmd)) return 1;
+    }
+
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,1671 @@
+#include <assert.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#define NOB_IMPLEMENTATION
+#define NOB_STRIP_PREFIX
+
+#include "../header/per.h"
+#include "../header/per_concurrent.h"
+#include "../header/per_sharded.h"
+#include "../header/per_async.h"
+#include "../header/per_prefetch.h"
+#include "../header/per_schema.h"
+#include "../header/per_checkpoint.h"
+#include "../header/per_shm.h"
+#include "../header/per_protocol.h"
+#include "../header/per_alias.h"
+#include "../header/per_rank.h"
+#include "../header/per_bucket.h"
+#include "../header/per_frames.h"
+#include "../header/nob.h"
+
+#define BENCH_ROUNDS 20000
+
+static Rng bench_rng;
+
+// Indexed by SumTreeLayout, for the tables and for the csv / json files
+static const char *bench_layout_name[] = {"binary", "b-ary", "fenwick"};
+static const char *bench_layout_key[]  = {"binary", "bary", "fenwick"};
+
+static SumTree *bench_filled_tree(size_t capacity, SumTreeLayout layout) {
+    SumTree *tree = create_sum_tree_ex(capacity, sizeof(int), (SumTreeConfig){.layout = layout});
+    if (tree == NULL)
+        return NULL;
+
+    for (size_t i = 0; i < capacity; ++i) {
+        int value = (int)i;
+        sum_tree_add(tree, &value, rng_double_range(&bench_rng, 0.01, 1.0));
+    }
+    return tree;
+}
+
+static void bench_stratified_targets(const SumTree *tree, double *targets, size_t batch_size) {
+    rng_fill_stratified(&bench_rng, targets, batch_size, sum_tree_total(tree));
+}
+
+static void bench_random_updates(const SumTree *tree, size_t *indices, double *priorities, size_t batch_size) {
+    for (size_t i = 0; i < batch_size; ++i) {
+        indices[i]    = sumtree_leaf_index(tree, rng_next_below(&bench_rng, tree->capacity));
+        priorities[i] = rng_double_range(&bench_rng, 0.01, 1.0);
+    }
+}
+
+// Compares BATCH_SIZE serial sum_tree_get calls against one interleaved sum_tree_get_batch call
+static void bench_get_batch(size_t capacity, SumTreeLayout layout) {
+    SumTree *tree = bench_filled_tree(capacity, layout);
+    if (tree == NULL) {
+        fprintf(stderr, "Could not allocate a tree with capacity %zu\n", capacity);
+        return;
+    }
+
+    double        targets[BATCH_SIZE];
+    SumTreeSample samples[BATCH_SIZE];
+    uint64_t      serial_ns  = 0;
+    uint64_t      batched_ns = 0;
+    size_t        checksum   = 0;
+
+    for (size_t round = 0; round < BENCH_ROUNDS; ++round) {
+        bench_stratified_targets(tree, targets, BATCH_SIZE);
+
+        uint64_t start = nanos_since_unspecified_epoch();
+        for (size_t i = 0; i < BATCH_SIZE; ++i) {
+            sum_tree_get(tree, targets[i], &samples[i], NULL);
+        }
+        serial_ns += nanos_since_unspecified_epoch() - start;
+        checksum += samples[BATCH_SIZE - 1].d_idx;
+
+        bench_stratified_targets(tree, targets, BATCH_SIZE);
+
+        start = nanos_since_unspecified_epoch();
+        sum_tree_get_batch(tree, targets, BATCH_SIZE, samples);
+        batched_ns += nanos_since_unspecified_epoch() - start;
+        checksum += samples[BATCH_SIZE - 1].d_idx;
+    }
+
+    double serial_us  = (double)serial_ns / BENCH_ROUNDS / 1000.0;
+    double batched_us = (double)batched_ns / BENCH_ROUNDS / 1000.0;
+    printf("%-7s capacity %9zu | serial %8.3f us | batched %8.3f us | speedup %5.2fx (checksum %zu)\n",
+           bench_layout_name[layout], capacity, serial_us, batched_us, serial_us / batched_us, checksum);
+
+    free_sum_tree(tree);
+}
+
+// Bytes of priority_tree for each layout, nothing is allocated
+static void bench_tree_memory(size_t capacity) {
+    printf("capacity %9zu", capacity);
+    for (int layout = SUM_TREE_BINARY; layout <= SUM_TREE_FENWICK; ++layout) {
+        SumTree shape = {.capacity = capacity, .layout = (SumTreeLayout)layout};
+        printf(" | %-7s %8.1f MB", bench_layout_name[layout], (double)(sumtree_layout_tree_size(&shape) * sizeof(double)) / (1 << 20));
+    }
+    printf("\n");
+}
+
+// Compares BATCH_SIZE serial sum_tree_update calls against one deduplicating sum_tree_update_batch call
+static void bench_update_batch(size_t capacity, SumTreeLayout layout) {
+    SumTree *tree = bench_filled_tree(capacity, layout);
+    if (tree == NULL) {
+        fprintf(stderr, "Could not allocate a tree with capacity %zu\n", capacity);
+        return;
+    }
+
+    size_t   indices[BATCH_SIZE];
+    double   priorities[BATCH_SIZE];
+    uint64_t serial_ns  = 0;
+    uint64_t batched_ns = 0;
+
+    for (size_t round = 0; round < BENCH_ROUNDS; ++round) {
+        bench_random_updates(tree, indices, priorities, BATCH_SIZE);
+
+        uint64_t start = nanos_since_unspecified_epoch();
+        for (size_t i = 0; i < BATCH_SIZE; ++i) {
+            sum_tree_update(tree, indices[i], priorities[i]);
+        }
+        serial_ns += nanos_since_unspecified_epoch() - start;
+
+        bench_random_updates(tree, indices, priorities, BATCH_SIZE);
+
+        start = nanos_since_unspecified_epoch();
+        sum_tree_update_batch(tree, indices, priorities, BATCH_SIZE);
+        batched_ns += nanos_since_unspecified_epoch() - start;
+    }
+
+    double serial_us  = (double)serial_ns / BENCH_ROUNDS / 1000.0;
+    double batched_us = (double)batched_ns / BENCH_ROUNDS / 1000.0;
+    printf("%-7s capacity %9zu | serial %8.3f us | batched %8.3f us | speedup %5.2fx\n",
+           bench_layout_name[layout], capacity, serial_us, batched_us, serial_us / batched_us);
+
+    free_sum_tree(tree);
+}
+
+// Compares sample_from_per followed by a separate gather against the fused sample + gather + weights call
+static void bench_fused_sample(size_t capacity, size_t elem_size) {
+    PER *per = create_prioritized_replay(capacity, elem_size, 0.6, 0.4);
+    if (per == NULL) {
+        fprintf(stderr, "Could not allocate a PER with capacity %zu\n", capacity);
+        return;
+    }
+    per_seed(per, rng_next_u64(&bench_rng));
+
+    char *item  = (char *)calloc(1, elem_size);
+    char *items = (char *)malloc(BATCH_SIZE * elem_size);
+    for (size_t i = 0; i < capacity; ++i) {
+        add_to_per(per, item);
+        sum_tree_update(per->tree, sumtree_leaf_index(per->tree, i), rng_double_range(&bench_rng, 0.01, 1.0));
+    }
+
+    SumTreeSample samples[BATCH_SIZE];
+    double        weights[BATCH_SIZE];
+    uint64_t      multi_pass_ns = 0;
+    uint64_t      fused_ns      = 0;
+
+    for (size_t round = 0; round < BENCH_ROUNDS; ++round) {
+        uint64_t start = nanos_since_unspecified_epoch();
+        Batch    batch = sample_from_per(per, BATCH_SIZE);
+        for (size_t i = 0; i < BATCH_SIZE; ++i) {
+            memcpy(items + i * elem_size, sumtree_data_ptr(per->tree, batch.items[i].d_idx), elem_size);
+        }
+        free_batch(&batch);
+        multi_pass_ns += nanos_since_unspecified_epoch() - start;
+
+        start = nanos_since_unspecified_epoch();
+        sample_from_per_fused(per, BATCH_SIZE, samples, weights, items);
+        fused_ns += nanos_since_unspecified_epoch() - start;
+    }
+
+    double multi_pass_us = (double)multi_pass_ns / BENCH_ROUNDS / 1000.0;
+    double fused_us      = (double)fused_ns / BENCH_ROUNDS / 1000.0;
+    printf("capacity %9zu elem %6zu B | multi-pass %8.3f us | fused %8.3f us | speedup %5.2fx\n",
+           capacity, elem_size, multi_pass_us, fused_us, multi_pass_us / fused_us);
+
+    free(item);
+    free(items);
+    free_per(per);
+}
+
+// Compares per element pow() against the batch priority kernel for a few alphas
+static void bench_priority_math(size_t count, double alpha) {
+    PER    per        = {.alpha = alpha};
+    double *td_errors = (double *)malloc(count * sizeof(double));
+    double *out       = (double *)malloc(count * sizeof(double));
+    rng_fill_uniform(&bench_rng, td_errors, count, -2.0, 2.0);
+
+    uint64_t scalar_ns = 0;
+    uint64_t batch_ns  = 0;
+    double   checksum  = 0.0;
+    size_t   rounds    = BENCH_ROUNDS / 10;
+
+    for (size_t round = 0; round < rounds; ++round) {
+        uint64_t start = nanos_since_unspecified_epoch();
+        for (size_t i = 0; i < count; ++i) {
+            out[i] = pow(fabs(td_errors[i]) + EPS, alpha);
+        }
+        scalar_ns += nanos_since_unspecified_epoch() - start;
+        checksum += out[count - 1];
+
+        start = nanos_since_unspecified_epoch();
+        calculate_priorities(&per, td_errors, out, count);
+        batch_ns += nanos_since_unspecified_epoch() - start;
+        checksum += out[count - 1];
+    }
+
+    double scalar_us = (double)scalar_ns / rounds / 1000.0;
+    double batch_us  = (double)batch_ns / rounds / 1000.0;
+    printf("count %6zu alpha %.2f | pow loop %8.3f us | batch %8.3f us | speedup %5.2fx (checksum %.3f)\n",
+           count, alpha, scalar_us, batch_us, scalar_us / batch_us, checksum);
+
+    free(td_errors);
+    free(out);
+}
+
+// Learner side latency of update_per_priorities against pushing the same batch to the async applier
+static void bench_async_update(size_t capacity) {
+    PER *sync_per  = create_prioritized_replay(capacity, 8, 0.6, 0.4);
+    PER *async_per = create_prioritized_replay(capacity, 8, 0.6, 0.4);
+    if (sync_per == NULL || async_per == NULL) {
+        fprintf(stderr, "Could not allocate a PER with capacity %zu\n", capacity);
+        free_per(sync_per);
+        free_per(async_per);
+        return;
+    }
+    char item[8] = {0};
+    for (size_t i = 0; i < capacity; ++i) {
+        add_to_per(sync_per, item);
+        add_to_per(async_per, item);
+    }
+
+    AsyncPER *ap = create_async_per(async_per, (AsyncUpdateConfig){0});
+    if (ap == NULL) {
+        free_per(sync_per);
+        free_per(async_per);
+        return;
+    }
+
+    size_t   indices[BATCH_SIZE];
+    double   td_errors[BATCH_SIZE];
+    uint64_t sync_ns  = 0;
+    uint64_t async_ns = 0;
+
+    for (size_t round = 0; round < BENCH_ROUNDS; ++round) {
+        for (size_t i = 0; i < BATCH_SIZE; ++i)
+            indices[i] = sumtree_leaf_index(sync_per->tree, rng_next_below(&bench_rng, capacity));
+        rng_fill_uniform(&bench_rng, td_errors, BATCH_SIZE, -1.0, 1.0);
+        TD_ERRORS td = {.items = td_errors, .count = BATCH_SIZE, .capacity = BATCH_SIZE};
+
+        uint64_t start = nanos_since_unspecified_epoch();
+        update_per_priorities(sync_per, &td, indices);
+        sync_ns += nanos_since_unspecified_epoch() - start;
+
+        start = nanos_since_unspecified_epoch();
+        async_per_push(ap, indices, td_errors, BATCH_SIZE);
+        async_ns += nanos_since_unspecified_epoch() - start;
+    }
+
+    uint64_t start = nanos_since_unspecified_epoch();
+    async_per_flush(ap);
+    uint64_t flush_ns = nanos_since_unspecified_epoch() - start;
+
+    double sync_us  = (double)sync_ns / BENCH_ROUNDS / 1000.0;
+    double async_us = (double)async_ns / BENCH_ROUNDS / 1000.0;
+    printf("capacity %9zu | sync update %8.3f us | async push %8.3f us | final flush %8.3f us\n",
+           capacity, sync_us, async_us, (double)flush_ns / 1000.0);
+
+    free_async_per(ap);
+    free_per(sync_per);
+    free_per(async_per);
+}
+
+// Learner side time to get a gathered batch: sample_from_per_into against popping a prefetched one
+static void bench_prefetch(size_t capacity, size_t elem_size, PrefetchPolicy policy) {
+    PER *per = create_prioritized_replay(capacity, elem_size, 0.6, 0.4);
+    if (per == NULL) {
+        fprintf(stderr, "Could not allocate a PER with capacity %zu\n", capacity);
+        return;
+    }
+    char *item  = (char *)calloc(1, elem_size);
+    char *items = (char *)malloc(BATCH_SIZE * elem_size);
+    for (size_t i = 0; i < capacity; ++i) {
+        add_to_per(per, item);
+    }
+
+    Batch    batch     = create_batch(BATCH_SIZE);
+    uint64_t direct_ns = 0;
+    for (size_t round = 0; round < BENCH_ROUNDS; ++round) {
+        uint64_t start = nanos_since_unspecified_epoch();
+        sample_from_per_into(per, &batch, BATCH_SIZE, items);
+        direct_ns += nanos_since_unspecified_epoch() - start;
+    }
+
+    PrefetchPER *pp = create_prefetch_per(per, (PrefetchConfig){.batch_size = BATCH_SIZE, .policy = policy});
+    if (pp == NULL) {
+        free_batch(&batch);
+        free(item);
+        free(items);
+        free_per(per);
+        return;
+    }
+
+    // The learner's own work between pops is what the worker overlaps with
+    uint64_t pop_ns = 0;
+    double   td_errors[BATCH_SIZE];
+    size_t   indices[BATCH_SIZE];
+    for (size_t round = 0; round < BENCH_ROUNDS; ++round) {
+        uint64_t             start = nanos_since_unspecified_epoch();
+        const PrefetchBatch *ready = prefetch_per_pop(pp);
+        pop_ns += nanos_since_unspecified_epoch() - start;
+
+        for (size_t i = 0; i < BATCH_SIZE; ++i)
+            indices[i] = ready->samples[i].p_idx;
+        rng_fill_uniform(&bench_rng, td_errors, BATCH_SIZE, -1.0, 1.0);
+        prefetch_per_update(pp, indices, td_errors, BATCH_SIZE);
+    }
+
+    static const char *policy_name[] = {"allow-stale", "discard-stale", "refresh"};
+    double direct_us = (double)direct_ns / BENCH_ROUNDS / 1000.0;
+    double pop_us    = (double)pop_ns / BENCH_ROUNDS / 1000.0;
+    printf("capacity %9zu elem %6zu B %-13s | sample + gather %8.3f us | prefetched pop %8.3f us | dropped %llu\n",
+           capacity, elem_size, policy_name[policy], direct_us, pop_us, (unsigned long long)pp->dropped);
+
+    free_prefetch_per(pp);
+    free_batch(&batch);
+    free(item);
+    free(items);
+    free_per(per);
+}
+
+// One opaque transition blob per slot against per field columns, for a learner needing every field or
+// only the observations
+static void bench_schema_gather(size_t capacity, size_t obs_bytes) {
+    PerField fields[] = {
+        {.name = "obs", .dtype = PER_DTYPE_U8, .rank = 1, .shape = {obs_bytes}},
+        {.name = "action", .dtype = PER_DTYPE_I64},
+        {.name = "reward", .dtype = PER_DTYPE_F32},
+        {.name = "next_obs", .dtype = PER_DTYPE_U8, .rank = 1, .shape = {obs_bytes}},
+        {.name = "done", .dtype = PER_DTYPE_U8},
+    };
+    size_t field_count = sizeof(fields) / sizeof(fields[0]);
+    size_t blob_bytes  = 0;
+    for (size_t f = 0; f < field_count; ++f)
+        blob_bytes += per_field_bytes(&fields[f]);
+
+    PER       *per = create_prioritized_replay(capacity, blob_bytes, 0.6, 0.4);
+    SchemaPER *sp  = create_schema_per(capacity, fields, field_count, 0.6, 0.4, (SumTreeConfig){0});
+    char      *out = (char *)sumtree_aligned_calloc(BATCH_SIZE, blob_bytes, SUM_TREE_CACHE_LINE);
+    if (per == NULL || sp == NULL || out == NULL) {
+        fprintf(stderr, "Could not allocate the schema benchmark with capacity %zu\n", capacity);
+        free_per(per);
+        free_schema_per(sp);
+        sumtree_aligned_free(out);
+        return;
+    }
+
+    char       *blob      = (char *)calloc(1, blob_bytes);
+    const void *values[5] = {blob, blob, blob, blob, blob};
+    for (size_t i = 0; i < capacity; ++i) {
+        add_to_per(per, blob);
+        schema_per_add(sp, values);
+    }
+    per_seed(per, 7);
+    per_seed(sp->per, 7);
+
+    SumTreeSample samples[BATCH_SIZE];
+    double        weights[BATCH_SIZE];
+    Batch         batch   = create_batch(BATCH_SIZE);
+    uint64_t      blob_ns = 0;
+    uint64_t      all_ns  = 0;
+    uint64_t      obs_ns  = 0;
+    size_t        obs     = (size_t)schema_per_field(sp, "obs");
+    size_t        rounds  = BENCH_ROUNDS / 4;
+
+    for (size_t round = 0; round < rounds; ++round) {
+        uint64_t start = nanos_since_unspecified_epoch();
+        sample_from_per_fused(per, BATCH_SIZE, samples, weights, out);
+        blob_ns += nanos_since_unspecified_epoch() - start;
+
+        start = nanos_since_unspecified_epoch();
+        schema_per_sample(sp, &batch, BATCH_SIZE);
+        char *dst = out;
+        for (size_t f = 0; f < field_count; ++f) {
+            schema_per_gather(sp, &batch, f, dst);
+            dst += BATCH_SIZE * sp->field_bytes[f];
+        }
+        all_ns += nanos_since_unspecified_epoch() - start;
+
+        start = nanos_since_unspecified_epoch();
+        schema_per_sample(sp, &batch, BATCH_SIZE);
+        schema_per_gather(sp, &batch, obs, out);
+        obs_ns += nanos_since_unspecified_epoch() - start;
+    }
+
+    printf("capacity %9zu obs %6zu B | blob %8.3f us | columns, all fields %8.3f us | columns, obs only %8.3f us\n",
+           capacity, obs_bytes, (double)blob_ns / rounds / 1000.0, (double)all_ns / rounds / 1000.0, (double)obs_ns / rounds / 1000.0);
+
+    free_batch(&batch);
+    free(blob);
+    sumtree_aligned_free(out);
+    free_schema_per(sp);
+    free_per(per);
+}
+
+// What the frames bench stores next to every transition, tracked independently of the FrameRecord
+typedef struct {
+    uint64_t obs_frame;
+    uint64_t episode_start;
+    uint64_t transition;
+} BenchFrameExtra;
+
+// Every frame starts with its sequence number + 1 and is filled with its low byte, so a zero frame, a
+// stale frame and the right frame can all be told apart
+static void bench_frame_fill(char *frame, size_t frame_bytes, uint64_t seq) {
+    uint64_t stamp = seq + 1;
+    memset(frame, (int)(seq & 0xff), frame_bytes);
+    memcpy(frame, &stamp, sizeof(stamp));
+}
+
+static bool bench_frame_check(const char *frame, size_t frame_bytes, uint64_t newest, size_t back, uint64_t episode_start) {
+    uint64_t stamp;
+    memcpy(&stamp, frame, sizeof(stamp));
+    if (newest < episode_start + back)
+        return stamp == 0 && frame[frame_bytes - 1] == 0;
+    uint64_t seq = newest - back;
+    return stamp == seq + 1 && frame[frame_bytes - 1] == (char)(seq & 0xff);
+}
+
+// Frame deduplicated storage over short episodes: the frame ring wraps many times, stacks that reach back
+// before the episode start have to come out zero filled, and transitions that lost a frame to the ring
+// must never be sampled. Every gathered stack is checked, then the memory is set against per slot stacks.
+static bool bench_frames(size_t capacity, size_t frame_bytes, size_t stack, size_t episode_steps) {
+    size_t    stack_bytes = stack * frame_bytes;
+    FramePER *fp          = create_frame_per(capacity, frame_bytes, stack, 0, sizeof(BenchFrameExtra), 0.6, 0.4, (SumTreeConfig){0});
+    char     *frame       = (char *)malloc(frame_bytes);
+    char     *obs         = (char *)malloc(BATCH_SIZE * stack_bytes);
+    char     *next_obs    = (char *)malloc(BATCH_SIZE * stack_bytes);
+    Batch     batch       = create_batch(BATCH_SIZE);
+    bool      ok          = false;
+    if (fp == NULL || frame == NULL || obs == NULL || next_obs == NULL || batch.items == NULL) {
+        fprintf(stderr, "Could not allocate a frame PER with capacity %zu\n", capacity);
+        goto defer;
+    }
+
+    BenchFrameExtra extra[BATCH_SIZE];
+    uint64_t        next_seq      = 0;
+    uint64_t        current       = 0;
+    uint64_t        episode_start = 0;
+    size_t          steps         = 4 * fp->frame_capacity;
+    size_t          batches       = 0;
+    size_t          bad           = 0;
+    uint64_t        gather_ns     = 0;
+
+    for (size_t step = 0; step < steps; ++step) {
+        if (step % episode_steps == 0) {
+            bench_frame_fill(frame, frame_bytes, next_seq);
+            frame_per_begin_episode(fp, frame);
+            episode_start = current = next_seq++;
+        }
+
+        BenchFrameExtra record = {.obs_frame = current, .episode_start = episode_start, .transition = step};
+        bench_frame_fill(frame, frame_bytes, next_seq);
+        frame_per_add(fp, frame, &record);
+        current = next_seq++;
+
+        if (step % 16 != 0 || fp->per->tree->num_entries < BATCH_SIZE)
+            continue;
+
+        frame_per_sample(fp, &batch, BATCH_SIZE);
+        uint64_t start = nanos_since_unspecified_epoch();
+        frame_per_gather(fp, &batch, obs, next_obs);
+        gather_ns += nanos_since_unspecified_epoch() - start;
+        frame_per_gather_extra(fp, &batch, extra);
+        batches++;
+
+        for (size_t i = 0; i < BATCH_SIZE; ++i) {
+            // A retired transition has priority 0 and sits before first_valid
+            bool retired = batch.items[i].priority <= 0.0 || extra[i].transition < fp->first_valid;
+            for (size_t k = 0; k < stack && !retired; ++k) {
+                size_t back = stack - 1 - k;
+                retired |= !bench_frame_check(obs + i * stack_bytes + k * frame_bytes, frame_bytes, extra[i].obs_frame, back, extra[i].episode_start);
+                retired |= !bench_frame_check(next_obs + i * stack_bytes + k * frame_bytes, frame_bytes, extra[i].obs_frame + 1, back,
+                                              extra[i].episode_start);
+            }
+            bad += retired;
+        }
+    }
+
+    size_t oldest  = fp->adds > capacity ? (size_t)(fp->adds - capacity) : 0;
+    size_t retired = (size_t)fp->first_valid - oldest;
+    double stacks  = (double)capacity * (2 * stack_bytes + sizeof(BenchFrameExtra)) / (1 << 20);
+    double frames  = ((double)fp->frame_capacity * frame_bytes + (double)capacity * (sizeof(FrameRecord) + sizeof(BenchFrameExtra))) / (1 << 20);
+    printf("capacity %7zu stack %zu episode %3zu steps | ring laps %4.1f | retired %5zu | gather %8.3f us | stacks %7.1f MB, frames %6.1f MB, "
+           "%4.1fx smaller | %zu samples, %zu bad\n",
+           capacity, stack, episode_steps, (double)fp->next_frame / (double)fp->frame_capacity, retired, (double)gather_ns / (double)batches / 1000.0,
+           stacks, frames, stacks / frames, batches * BATCH_SIZE, bad);
+    ok = bad == 0;
+
+defer:
+    free_batch(&batch);
+    free(next_obs);
+    free(obs);
+    free(frame);
+    free_frame_per(fp);
+    return ok;
+}
+
+// Wall time of a full snapshot round trip, the mapped load only touches the header up front. The snapshot
+// goes to $TMPDIR (/tmp without it) and is removed afterwards.
+static void bench_snapshot(size_t capacity, size_t elem_size) {
+    const char *tmpdir = getenv("TMPDIR");
+    char        path[4096];
+    snprintf(path, sizeof(path), "%s/per_bench_%d.snapshot", tmpdir != NULL && tmpdir[0] != '\0' ? tmpdir : "/tmp", (int)getpid());
+
+    PER *per = create_prioritized_replay(capacity, elem_size, 0.6, 0.4);
+    if (per == NULL) {
+        fprintf(stderr, "Could not allocate a PER with capacity %zu\n", capacity);
+        return;
+    }
+    char *item = (char *)calloc(1, elem_size);
+    for (size_t i = 0; i < capacity; ++i) {
+        add_to_per(per, item);
+    }
+
+    uint64_t start = nanos_since_unspecified_epoch();
+    bool     saved = per_save(per, path);
+    uint64_t save  = nanos_since_unspecified_epoch() - start;
+
+    start           = nanos_since_unspecified_epoch();
+    PER     *loaded = saved ? per_load(path) : NULL;
+    uint64_t load   = nanos_since_unspecified_epoch() - start;
+
+    start           = nanos_since_unspecified_epoch();
+    PER     *mapped = saved ? per_load_mmap(path) : NULL;
+    uint64_t map    = nanos_since_unspecified_epoch() - start;
+
+    double mb = (double)(capacity * elem_size + per->tree->tree_size * sizeof(double)) / (1 << 20);
+    if (!saved) {
+        printf("%8.1f MB | save to %s failed\n", mb, path);
+        goto defer;
+    }
+    printf("%8.1f MB | save %8.1f ms | load %8.1f ms | mmap load %8.3f ms\n", mb, save / 1e6, load / 1e6, map / 1e6);
+
+    // Incremental checkpoint after 1% of the slots were rewritten
+    PerCheckpoint *ckpt = create_per_checkpoint(per, path, 0, 0.0);
+    if (ckpt != NULL) {
+        for (size_t i = 0; i < capacity / 100; ++i) {
+            add_to_per(per, item);
+        }
+        start               = nanos_since_unspecified_epoch();
+        bool     written    = per_checkpoint_write(ckpt, per);
+        uint64_t checkpoint = nanos_since_unspecified_epoch() - start;
+        printf("           | 1%% rewritten, incremental checkpoint %8.1f ms, %.1f MB appended%s\n", checkpoint / 1e6,
+               (double)ckpt->log_bytes / (1 << 20), written ? "" : " (failed)");
+
+        char log_path[sizeof(path) + 8];
+        snprintf(log_path, sizeof(log_path), "%s.log", path);
+        unlink(log_path);
+        free_per_checkpoint(ckpt);
+    }
+
+defer:
+    free_per(loaded);
+    free_per(mapped);
+    free_per(per);
+    free(item);
+    unlink(path);
+}
+
+// What the min and max trees add to sum_tree_update_batch, and the O(1) global min / max queries
+static void bench_min_max(size_t capacity) {
+    SumTree *plain   = bench_filled_tree(capacity, SUM_TREE_BINARY);
+    SumTree *tracked = bench_filled_tree(capacity, SUM_TREE_BINARY);
+    if (plain == NULL || tracked == NULL || !sum_tree_track_min_max(tracked)) {
+        fprintf(stderr, "Could not allocate min / max trees with capacity %zu\n", capacity);
+        free_sum_tree(plain);
+        free_sum_tree(tracked);
+        return;
+    }
+
+    size_t   indices[BATCH_SIZE];
+    double   priorities[BATCH_SIZE];
+    uint64_t plain_ns   = 0;
+    uint64_t tracked_ns = 0;
+    double   checksum   = 0.0;
+
+    for (size_t round = 0; round < BENCH_ROUNDS; ++round) {
+        bench_random_updates(plain, indices, priorities, BATCH_SIZE);
+
+        uint64_t start = nanos_since_unspecified_epoch();
+        sum_tree_update_batch(plain, indices, priorities, BATCH_SIZE);
+        plain_ns += nanos_since_unspecified_epoch() - start;
+
+        start = nanos_since_unspecified_epoch();
+        sum_tree_update_batch(tracked, indices, priorities, BATCH_SIZE);
+        checksum += sum_tree_min_priority(tracked) + sum_tree_max_priority(tracked);
+        tracked_ns += nanos_since_unspecified_epoch() - start;
+    }
+
+    double plain_us   = (double)plain_ns / BENCH_ROUNDS / 1000.0;
+    double tracked_us = (double)tracked_ns / BENCH_ROUNDS / 1000.0;
+    printf("capacity %9zu | sum tree %8.3f us | + min / max %8.3f us | overhead %5.2fx | min %.4f max %.4f (%.0f)\n", capacity, plain_us,
+           tracked_us, tracked_us / plain_us, sum_tree_min_priority(tracked), sum_tree_max_priority(tracked), checksum);
+
+    free_sum_tree(plain);
+    free_sum_tree(tracked);
+}
+
+// Frozen priorities: tree descents against alias table draws per batch, and what a rebuild costs
+static void bench_alias(size_t capacity, size_t threads) {
+    PER *per = create_prioritized_replay(capacity, 0, 0.6, 0.4);
+    if (per == NULL) {
+        fprintf(stderr, "Could not allocate a PER with capacity %zu\n", capacity);
+        return;
+    }
+    AliasPER *ap = create_alias_per(per, (AliasConfig){.threads = threads});
+    if (ap == NULL) {
+        free_per(per);
+        return;
+    }
+    for (size_t i = 0; i < capacity; ++i) {
+        sum_tree_add(per->tree, NULL, rng_double_range(&bench_rng, 0.01, 1.0));
+    }
+
+    uint64_t start = nanos_since_unspecified_epoch();
+    alias_per_rebuild(ap);
+    uint64_t rebuild_ns = nanos_since_unspecified_epoch() - start;
+
+    Batch    batch   = create_batch(BATCH_SIZE);
+    uint64_t tree_ns = 0;
+    uint64_t draw_ns = 0;
+    for (size_t round = 0; round < BENCH_ROUNDS; ++round) {
+        start = nanos_since_unspecified_epoch();
+        sample_from_per_into(per, &batch, BATCH_SIZE, NULL);
+        tree_ns += nanos_since_unspecified_epoch() - start;
+
+        start = nanos_since_unspecified_epoch();
+        alias_per_sample(ap, &batch, BATCH_SIZE, NULL);
+        draw_ns += nanos_since_unspecified_epoch() - start;
+    }
+
+    double tree_us = (double)tree_ns / BENCH_ROUNDS / 1000.0;
+    double draw_us = (double)draw_ns / BENCH_ROUNDS / 1000.0;
+    printf("capacity %9zu | tree %8.3f us | alias %8.3f us | speedup %5.2fx | rebuild %8.2f ms on %zu block(s)\n", capacity, tree_us,
+           draw_us, tree_us / draw_us, rebuild_ns / 1e6, ap->block_count);
+
+    free_batch(&batch);
+    free_alias_per(ap);
+    free_per(per);
+}
+
+// Learner steps of rank based sampling: draw, then update the sampled priorities, against the
+// proportional PER doing the same. The rank step includes its slice of the amortized sort.
+static void bench_rank(size_t capacity, size_t sort_interval) {
+    PER     *per = create_prioritized_replay(capacity, 0, 0.6, 0.4);
+    RankPER *rp  = create_rank_per(capacity, 0, 0.7, 0.4, (RankConfig){.batch_size = BATCH_SIZE, .sort_interval = sort_interval});
+    if (per == NULL || rp == NULL) {
+        fprintf(stderr, "Could not allocate a rank PER with capacity %zu\n", capacity);
+        free_per(per);
+        free_rank_per(rp);
+        return;
+    }
+    for (size_t i = 0; i < capacity; ++i) {
+        add_to_per(per, NULL);
+        rank_per_add(rp, NULL);
+    }
+
+    Batch     batch = create_batch(BATCH_SIZE);
+    size_t    indices[BATCH_SIZE];
+    double    errors[BATCH_SIZE];
+    TD_ERRORS td = {.items = errors, .count = BATCH_SIZE, .capacity = BATCH_SIZE};
+
+    // The first sample computes the segment boundaries for the full buffer, once
+    uint64_t start = nanos_since_unspecified_epoch();
+    rank_per_sample(rp, &batch, NULL);
+    uint64_t bounds_ns = nanos_since_unspecified_epoch() - start;
+
+    uint64_t proportional_ns = 0;
+    uint64_t rank_ns         = 0;
+    uint64_t worst_rank_ns   = 0;
+    for (size_t round = 0; round < BENCH_ROUNDS; ++round) {
+        for (size_t i = 0; i < BATCH_SIZE; ++i) {
+            errors[i] = rng_double_range(&bench_rng, 0.01, 1.0);
+        }
+
+        start = nanos_since_unspecified_epoch();
+        sample_from_per_into(per, &batch, BATCH_SIZE, NULL);
+        for (size_t i = 0; i < BATCH_SIZE; ++i) {
+            indices[i] = batch.items[i].p_idx;
+        }
+        update_per_priorities(per, &td, indices);
+        proportional_ns += nanos_since_unspecified_epoch() - start;
+
+        start = nanos_since_unspecified_epoch();
+        rank_per_sample(rp, &batch, NULL);
+        for (size_t i = 0; i < BATCH_SIZE; ++i) {
+            indices[i] = batch.items[i].d_idx;
+        }
+        rank_per_update(rp, indices, errors, BATCH_SIZE);
+        uint64_t step_ns = nanos_since_unspecified_epoch() - start;
+        rank_ns += step_ns;
+        if (step_ns > worst_rank_ns)
+            worst_rank_ns = step_ns;
+    }
+
+    printf("capacity %9zu | proportional %8.3f us | rank %8.3f us (worst %8.3f us) | %zu sort cycle(s) of %zu steps | bounds %6.2f ms\n",
+           capacity, (double)proportional_ns / BENCH_ROUNDS / 1000.0, (double)rank_ns / BENCH_ROUNDS / 1000.0, worst_rank_ns / 1000.0,
+           (size_t)rp->sorts, rp->config.sort_interval, bounds_ns / 1e6);
+
+    free_batch(&batch);
+    free_rank_per(rp);
+    free_per(per);
+}
+
+// Total variation distance between the leaf frequencies of `draws` batches and the exact distribution,
+// for the tree and for the log buckets over the same priorities. The tree figure is the sampling noise
+// floor, anything the buckets add on top of it is their approximation error.
+static void bench_bucket_accuracy(size_t capacity, size_t draws) {
+    PER       *per         = create_prioritized_replay(capacity, 0, 0.6, 0.4);
+    BucketPER *bp          = create_bucket_per(capacity, 0, 0.6, 0.4);
+    double    *hits_tree   = (double *)calloc(capacity, sizeof(double));
+    double    *hits_bucket = (double *)calloc(capacity, sizeof(double));
+    if (per == NULL || bp == NULL || hits_tree == NULL || hits_bucket == NULL) {
+        fprintf(stderr, "Could not allocate the accuracy run for capacity %zu\n", capacity);
+        goto defer;
+    }
+
+    // Priorities spread over nine decades, so most buckets are in use
+    for (size_t i = 0; i < capacity; ++i) {
+        double priority = pow(10.0, rng_double_range(&bench_rng, -6.0, 3.0));
+        sum_tree_add(per->tree, NULL, priority);
+        bucket_sampler_add(bp->sampler, NULL, priority);
+    }
+
+    Batch batch = create_batch(BATCH_SIZE);
+    for (size_t round = 0; round < draws; ++round) {
+        sample_from_per_into(per, &batch, BATCH_SIZE, NULL);
+        for (size_t i = 0; i < BATCH_SIZE; ++i) {
+            hits_tree[batch.items[i].d_idx] += 1.0;
+        }
+        bucket_per_sample(bp, &batch, BATCH_SIZE, NULL);
+        for (size_t i = 0; i < BATCH_SIZE; ++i) {
+            hits_bucket[batch.items[i].d_idx] += 1.0;
+        }
+    }
+    free_batch(&batch);
+
+    double total     = sum_tree_total(per->tree);
+    double samples   = (double)draws * BATCH_SIZE;
+    double tv_tree   = 0.0;
+    double tv_bucket = 0.0;
+    for (size_t i = 0; i < capacity; ++i) {
+        double exact = bucket_sampler_priority(bp->sampler, i) / total;
+        tv_tree += fabs(hits_tree[i] / samples - exact);
+        tv_bucket += fabs(hits_bucket[i] / samples - exact);
+    }
+    BucketSampler *bs = bp->sampler;
+    printf("capacity %9zu | %.0f samples | TV tree %.5f | TV buckets %.5f | %.2f tries per draw\n", capacity, samples, tv_tree / 2.0,
+           tv_bucket / 2.0, (double)(bs->draws + bs->rejections) / (double)bs->draws);
+
+defer:
+    free(hits_tree);
+    free(hits_bucket);
+    free_bucket_per(bp);
+    free_per(per);
+}
+
+// Learner step latency, sample then update the sampled priorities, tree against buckets
+static void bench_bucket(size_t capacity) {
+    PER       *per = create_prioritized_replay(capacity, 0, 0.6, 0.4);
+    BucketPER *bp  = create_bucket_per(capacity, 0, 0.6, 0.4);
+    if (per == NULL || bp == NULL) {
+        fprintf(stderr, "Could not allocate a bucket PER with capacity %zu\n", capacity);
+        free_per(per);
+        free_bucket_per(bp);
+        return;
+    }
+    for (size_t i = 0; i < capacity; ++i) {
+        double priority = rng_double_range(&bench_rng, 0.01, 10.0);
+        sum_tree_add(per->tree, NULL, priority);
+        bucket_sampler_add(bp->sampler, NULL, priority);
+    }
+
+    Batch     batch = create_batch(BATCH_SIZE);
+    size_t    indices[BATCH_SIZE];
+    double    errors[BATCH_SIZE];
+    TD_ERRORS td = {.items = errors, .count = BATCH_SIZE, .capacity = BATCH_SIZE};
+
+    uint64_t tree_ns   = 0;
+    uint64_t bucket_ns = 0;
+    for (size_t round = 0; round < BENCH_ROUNDS; ++round) {
+        for (size_t i = 0; i < BATCH_SIZE; ++i) {
+            errors[i] = rng_double_range(&bench_rng, 0.01, 10.0);
+        }
+
+        uint64_t start = nanos_since_unspecified_epoch();
+        sample_from_per_into(per, &batch, BATCH_SIZE, NULL);
+        for (size_t i = 0; i < BATCH_SIZE; ++i) {
+            indices[i] = batch.items[i].p_idx;
+        }
+        update_per_priorities(per, &td, indices);
+        tree_ns += nanos_since_unspecified_epoch() - start;
+
+        start = nanos_since_unspecified_epoch();
+        bucket_per_sample(bp, &batch, BATCH_SIZE, NULL);
+        for (size_t i = 0; i < BATCH_SIZE; ++i) {
+            indices[i] = batch.items[i].d_idx;
+        }
+        bucket_per_update(bp, indices, errors, BATCH_SIZE);
+        bucket_ns += nanos_since_unspecified_epoch() - start;
+    }
+
+    double tree_us   = (double)tree_ns / BENCH_ROUNDS / 1000.0;
+    double bucket_us = (double)bucket_ns / BENCH_ROUNDS / 1000.0;
+    printf("capacity %9zu | tree %8.3f us | buckets %8.3f us | speedup %5.2fx\n", capacity, tree_us, bucket_us, tree_us / bucket_us);
+
+    free_batch(&batch);
+    free_bucket_per(bp);
+    free_per(per);
+}
+
+// Actor processes add rollouts of 64 items into a shared memory PER while this process samples and
+// gathers batches from it in place, all for the same wall time
+static void bench_shm(size_t capacity, size_t elem_size, size_t actors, double seconds) {
+#if defined(__linux__)
+    const char *name = "/per-bench-shm";
+    shm_unlink(name);
+    ShmPER *sp = create_shm_per(name, capacity, elem_size, 0.6, 0.4, (SumTreeConfig){.layout = SUM_TREE_BARY});
+    if (sp == NULL)
+        return;
+
+    char *items = (char *)calloc(64, elem_size);
+    for (size_t i = 0; i < capacity && shm_per_add_batch(sp, items, 64); i += 64) {
+    }
+
+    // One add counter per actor, shared with the children
+    uint64_t *added = (uint64_t *)mmap(NULL, actors * sizeof(uint64_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (added == MAP_FAILED) {
+        perror("mmap");
+        free(items);
+        free_shm_per(sp);
+        shm_per_unlink(name);
+        return;
+    }
+    memset(added, 0, actors * sizeof(uint64_t));
+
+    uint64_t deadline = nanos_since_unspecified_epoch() + (uint64_t)(seconds * 1e9);
+    for (size_t a = 0; a < actors; ++a) {
+        if (fork() == 0) {
+            ShmPER *actor = open_shm_per(name);
+            while (actor != NULL && nanos_since_unspecified_epoch() < deadline && shm_per_add_batch(actor, items, 64)) {
+                added[a] += 64;
+            }
+            free_shm_per(actor);
+            _exit(0);
+        }
+    }
+
+    Batch    batch   = create_batch(BATCH_SIZE);
+    char    *out     = (char *)malloc(BATCH_SIZE * elem_size);
+    uint64_t sampled = 0;
+    uint64_t start   = nanos_since_unspecified_epoch();
+    while (nanos_since_unspecified_epoch() < deadline && shm_per_sample_into(sp, &batch, BATCH_SIZE, out)) {
+        sampled += BATCH_SIZE;
+    }
+    double elapsed = (nanos_since_unspecified_epoch() - start) / 1e9;
+    while (wait(NULL) > 0) {
+    }
+
+    uint64_t total_added = 0;
+    for (size_t a = 0; a < actors; ++a) {
+        total_added += added[a];
+    }
+    printf("%zu actors | elem %5zu B | adds %10.0f /s | sampled items %10.0f /s\n", actors, elem_size, total_added / elapsed,
+           sampled / elapsed);
+
+    munmap(added, actors * sizeof(uint64_t));
+    free(out);
+    free_batch(&batch);
+    free(items);
+    free_shm_per(sp);
+    shm_per_unlink(name);
+#else
+    (void)capacity, (void)elem_size, (void)actors, (void)seconds;
+#endif
+}
+
+// dTLB load misses of this thread through perf_event_open, -1 when the counter is unavailable (no PMU in
+// the VM, perf_event_paranoid, other platforms)
+static int bench_tlb_open(void) {
+#if defined(__linux__)
+    struct perf_event_attr attr = {0};
+    attr.type                   = PERF_TYPE_HW_CACHE;
+    attr.size                   = sizeof(attr);
+    attr.config                 = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled               = 1;
+    attr.exclude_kernel         = 1;
+    attr.exclude_hv             = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+    return -1;
+#endif
+}
+
+static void bench_tlb_start(int fd) {
+#if defined(__linux__)
+    if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+#else
+    (void)fd;
+#endif
+}
+
+static long long bench_tlb_stop(int fd) {
+#if defined(__linux__)
+    long long count = -1;
+    if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(fd, &count, sizeof(count)) != sizeof(count))
+            count = -1;
+    }
+    return count;
+#else
+    (void)fd;
+    return -1;
+#endif
+}
+
+// Sample + gather latency and dTLB misses per batch under each page policy
+static void bench_pages(size_t capacity, size_t elem_size, SumTreePages pages) {
+    static const char *pages_name[] = {"4k pages", "transparent", "hugetlb"};
+
+    PER *per = create_prioritized_replay_ex(capacity, elem_size, 0.6, 0.4, (SumTreeConfig){.pages = pages});
+    if (per == NULL) {
+        fprintf(stderr, "Could not allocate a PER with capacity %zu\n", capacity);
+        return;
+    }
+    per_seed(per, 11);
+
+    char *item  = (char *)calloc(1, elem_size);
+    char *items = (char *)malloc(BATCH_SIZE * elem_size);
+    for (size_t i = 0; i < capacity; ++i) {
+        add_to_per(per, item);
+        sum_tree_update(per->tree, sumtree_leaf_index(per->tree, i), rng_double_range(&bench_rng, 0.01, 1.0));
+    }
+
+    SumTreeSample samples[BATCH_SIZE];
+    double        weights[BATCH_SIZE];
+    int           tlb = bench_tlb_open();
+
+    bench_tlb_start(tlb);
+    uint64_t start = nanos_since_unspecified_epoch();
+    for (size_t round = 0; round < BENCH_ROUNDS; ++round) {
+        sample_from_per_fused(per, BATCH_SIZE, samples, weights, items);
+    }
+    uint64_t  elapsed = nanos_since_unspecified_epoch() - start;
+    long long misses  = bench_tlb_stop(tlb);
+    if (tlb >= 0)
+        close(tlb);
+
+    char label[64];
+    snprintf(label, sizeof(label), "%s%s", pages_name[pages],
+             pages == SUM_TREE_PAGES_EXPLICIT && per->tree->tree_hugetlb_bytes == 0 ? " (fell back)" : "");
+    printf("capacity %9zu elem %4zu B %-23s | sample + gather %8.3f us | dTLB misses / batch ", capacity, elem_size, label,
+           (double)elapsed / BENCH_ROUNDS / 1000.0);
+    if (misses >= 0)
+        printf("%8.1f\n", (double)misses / BENCH_ROUNDS);
+    else
+        printf("     n/a\n");
+
+    free(item);
+    free(items);
+    free_per(per);
+}
+
+static bool bench_micro(void) {
+    bool ok = true;
+
+    printf("Stratified descent latency per batch of %d\n", BATCH_SIZE);
+    for (size_t capacity = (size_t)1 << 10; capacity <= (size_t)1 << 22; capacity <<= 4) {
+        bench_get_batch(capacity, SUM_TREE_BINARY);
+        bench_get_batch(capacity, SUM_TREE_BARY);
+        bench_get_batch(capacity, SUM_TREE_FENWICK);
+    }
+
+    printf("Priority update latency per batch of %d\n", BATCH_SIZE);
+    for (size_t capacity = (size_t)1 << 10; capacity <= (size_t)1 << 22; capacity <<= 4) {
+        bench_update_batch(capacity, SUM_TREE_BINARY);
+        bench_update_batch(capacity, SUM_TREE_BARY);
+        bench_update_batch(capacity, SUM_TREE_FENWICK);
+    }
+
+    printf("Priority tree memory per layout\n");
+    for (size_t capacity = (size_t)1 << 16; capacity <= (size_t)1 << 24; capacity <<= 4) {
+        bench_tree_memory(capacity);
+    }
+
+    printf("Priority update latency per batch of %d with min / max trees\n", BATCH_SIZE);
+    for (size_t capacity = (size_t)1 << 10; capacity <= (size_t)1 << 22; capacity <<= 4) {
+        bench_min_max(capacity);
+    }
+
+    printf("Frozen priorities, tree descent against alias table per batch of %d\n", BATCH_SIZE);
+    bench_alias((size_t)1 << 16, 0);
+    bench_alias((size_t)1 << 20, 1);
+    bench_alias((size_t)1 << 20, 4);
+    bench_alias((size_t)1 << 22, 0);
+
+    printf("Learner step (sample + update) per batch of %d, proportional against rank based\n", BATCH_SIZE);
+    bench_rank((size_t)1 << 16, 0);
+    bench_rank((size_t)1 << 20, 0);
+    bench_rank((size_t)1 << 20, 256);
+
+    printf("Log buckets against exact sampling, batches of %d\n", BATCH_SIZE);
+    bench_bucket_accuracy((size_t)1 << 12, 100000);
+    bench_bucket_accuracy((size_t)1 << 16, 100000);
+    printf("Learner step (sample + update) per batch of %d, tree against log buckets\n", BATCH_SIZE);
+    bench_bucket((size_t)1 << 16);
+    bench_bucket((size_t)1 << 20);
+    bench_bucket((size_t)1 << 22);
+
+    printf("Sample + gather latency per batch of %d\n", BATCH_SIZE);
+    bench_fused_sample((size_t)1 << 16, 64);
+    bench_fused_sample((size_t)1 << 16, 4096);
+    bench_fused_sample((size_t)1 << 20, 64);
+    bench_fused_sample((size_t)1 << 18, 1024);
+
+    printf("Priority math for a whole TD error array\n");
+    bench_priority_math(4096, 0.6);
+    bench_priority_math(4096, 0.5);
+    bench_priority_math(4096, 1.0);
+
+    printf("Learner side priority update latency per batch of %d\n", BATCH_SIZE);
+    bench_async_update((size_t)1 << 16);
+    bench_async_update((size_t)1 << 20);
+
+    printf("Learner side wait for a gathered batch of %d\n", BATCH_SIZE);
+    bench_prefetch((size_t)1 << 20, 64, PREFETCH_ALLOW_STALE);
+    bench_prefetch((size_t)1 << 18, 1024, PREFETCH_ALLOW_STALE);
+    bench_prefetch((size_t)1 << 18, 1024, PREFETCH_REFRESH);
+
+    printf("Transition gather per batch of %d, blob per slot against field columns\n", BATCH_SIZE);
+    bench_schema_gather((size_t)1 << 16, 1024);
+    bench_schema_gather((size_t)1 << 14, 8192);
+
+    printf("Page size policy, sample + gather per batch of %d\n", BATCH_SIZE);
+    for (int pages = SUM_TREE_PAGES_DEFAULT; pages <= SUM_TREE_PAGES_EXPLICIT; ++pages) {
+        bench_pages((size_t)1 << 22, 64, (SumTreePages)pages);
+    }
+
+    printf("Stacked frames of %zu B, deduplicated ring against per slot stacks, checked gathers of %d\n", (size_t)84 * 84, BATCH_SIZE);
+    ok &= bench_frames((size_t)1 << 13, 84 * 84, 4, 1);
+    ok &= bench_frames((size_t)1 << 13, 84 * 84, 4, 3);
+    ok &= bench_frames((size_t)1 << 13, 84 * 84, 4, 200);
+
+    printf("Snapshot save and restore, incremental checkpoints\n");
+    bench_snapshot((size_t)1 << 18, 1024);
+
+    printf("Shared memory PER, actor processes adding while the learner samples batches of %d\n", BATCH_SIZE);
+    bench_shm((size_t)1 << 18, 256, 1, 0.5);
+    bench_shm((size_t)1 << 18, 256, 4, 0.5);
+    return ok;
+}
+
+// Matrix suite: add, sample, update and sample + update cycle over capacities, payload sizes and batch sizes
+
+typedef struct {
+    bool        quick;
+    size_t      max_bytes;
+    size_t      calls;
+    int         layouts; // bit per SumTreeLayout
+    const char *mmap_path;
+    int         mmap_tree;
+    const char *csv_path;
+    const char *json_path;
+} BenchOptions;
+
+typedef struct {
+    SumTreeLayout layout;
+    size_t        capacity;
+    size_t        elem_size;
+    size_t        batch_size;
+    const char   *op;
+    size_t        calls;
+    double        items_per_sec;
+    uint64_t      p50_ns;
+    uint64_t      p90_ns;
+    uint64_t      p99_ns;
+    uint64_t      p999_ns;
+    uint64_t      max_ns;
+} BenchResult;
+
+typedef struct {
+    BenchResult *items;
+    size_t       count;
+    size_t       capacity;
+} BenchResults;
+
+static int bench_compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static uint64_t bench_percentile(const uint64_t *sorted, size_t count, double q) {
+    size_t rank = (size_t)ceil(q * (double)count);
+    return sorted[rank == 0 ? 0 : rank - 1];
+}
+
+// Turns per call latencies into throughput and percentiles, then prints and records the row
+static void bench_record(BenchResults *results, BenchResult row, uint64_t *latencies, size_t calls, size_t items_per_call) {
+    uint64_t total_ns = 0;
+    for (size_t i = 0; i < calls; ++i)
+        total_ns += latencies[i];
+
+    qsort(latencies, calls, sizeof(latencies[0]), bench_compare_u64);
+
+    row.calls         = calls;
+    row.items_per_sec = total_ns > 0 ? (double)(calls * items_per_call) * 1e9 / (double)total_ns : 0.0;
+    row.p50_ns        = bench_percentile(latencies, calls, 0.50);
+    row.p90_ns        = bench_percentile(latencies, calls, 0.90);
+    row.p99_ns        = bench_percentile(latencies, calls, 0.99);
+    row.p999_ns       = bench_percentile(latencies, calls, 0.999);
+    row.max_ns        = latencies[calls - 1];
+
+    printf("%-6s cap %9zu elem %6zu batch %4zu %-6s | %12.0f items/s | p50 %7" PRIu64 " p99 %8" PRIu64 " p99.9 %8" PRIu64 " ns\n",
+           bench_layout_name[row.layout], row.capacity, row.elem_size, row.batch_size, row.op,
+           row.items_per_sec, row.p50_ns, row.p99_ns, row.p999_ns);
+    fflush(stdout);
+
+    da_append(results, row);
+}
+
+static void bench_matrix_case(BenchResults *results, const BenchOptions *opt, SumTreeLayout layout, size_t capacity, size_t elem_size, const size_t *batch_sizes, size_t batch_count) {
+    PER *per = create_prioritized_replay_ex(capacity, elem_size, 0.6, 0.4,
+                                            (SumTreeConfig){.layout = layout, .backing_path = opt->mmap_path, .backing_tree = opt->mmap_tree});
+    if (per == NULL) {
+        fprintf(stderr, "Could not allocate a PER with capacity %zu and elem_size %zu\n", capacity, elem_size);
+        return;
+    }
+    per_seed(per, rng_next_u64(&bench_rng));
+
+    size_t    max_batch = batch_sizes[batch_count - 1];
+    char     *item      = (char *)calloc(1, elem_size);
+    char     *items     = (char *)malloc(max_batch * elem_size);
+    uint64_t *latencies = (uint64_t *)malloc(opt->calls * sizeof(uint64_t));
+    Batch     batch     = create_batch(max_batch);
+    TD_ERRORS td_errors = {0};
+    size_t   *indices   = (size_t *)malloc(max_batch * sizeof(size_t));
+
+    if (!item || !items || !latencies || !batch.items || !indices) {
+        fprintf(stderr, "Out of memory for capacity %zu and elem_size %zu\n", capacity, elem_size);
+        goto defer;
+    }
+
+    for (size_t i = 0; i < capacity; ++i) {
+        add_to_per(per, item);
+    }
+
+    BenchResult row = {.layout = layout, .capacity = capacity, .elem_size = elem_size, .batch_size = 1, .op = "add"};
+
+    // Steady state inserts overwrite the oldest entries of a full buffer
+    for (size_t i = 0; i < opt->calls; ++i) {
+        uint64_t start = nanos_since_unspecified_epoch();
+        add_to_per(per, item);
+        latencies[i] = nanos_since_unspecified_epoch() - start;
+    }
+    bench_record(results, row, latencies, opt->calls, 1);
+
+    for (size_t b = 0; b < batch_count; ++b) {
+        size_t batch_size = batch_sizes[b];
+        row.batch_size    = batch_size;
+
+        td_errors.count = 0;
+        for (size_t i = 0; i < batch_size; ++i)
+            da_append(&td_errors, 0.0);
+
+        row.op = "sample";
+        for (size_t i = 0; i < opt->calls; ++i) {
+            uint64_t start = nanos_since_unspecified_epoch();
+            sample_from_per_into(per, &batch, batch_size, items);
+            latencies[i] = nanos_since_unspecified_epoch() - start;
+        }
+        bench_record(results, row, latencies, opt->calls, batch_size);
+
+        row.op = "update";
+        for (size_t i = 0; i < opt->calls; ++i) {
+            rng_fill_uniform(&bench_rng, td_errors.items, batch_size, -1.0, 1.0);
+            for (size_t j = 0; j < batch_size; ++j)
+                indices[j] = sumtree_leaf_index(per->tree, rng_next_below(&bench_rng, capacity));
+
+            uint64_t start = nanos_since_unspecified_epoch();
+            update_per_priorities(per, &td_errors, indices);
+            latencies[i] = nanos_since_unspecified_epoch() - start;
+        }
+        bench_record(results, row, latencies, opt->calls, batch_size);
+
+        row.op = "cycle";
+        for (size_t i = 0; i < opt->calls; ++i) {
+            rng_fill_uniform(&bench_rng, td_errors.items, batch_size, -1.0, 1.0);
+
+            uint64_t start = nanos_since_unspecified_epoch();
+            sample_from_per_into(per, &batch, batch_size, items);
+            for (size_t j = 0; j < batch_size; ++j)
+                indices[j] = batch.items[j].p_idx;
+            update_per_priorities(per, &td_errors, indices);
+            latencies[i] = nanos_since_unspecified_epoch() - start;
+        }
+        bench_record(results, row, latencies, opt->calls, batch_size);
+    }
+
+defer:
+    free(item);
+    free(items);
+    free(latencies);
+    free(indices);
+    free_batch(&batch);
+    da_free(td_errors);
+    free_per(per);
+}
+
+static bool bench_write_csv(const char *path, const BenchResults *results) {
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        fprintf(stderr, "Could not open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    fprintf(f, "layout,capacity,elem_size,batch_size,op,calls,items_per_sec,p50_ns,p90_ns,p99_ns,p999_ns,max_ns\n");
+    for (size_t i = 0; i < results->count; ++i) {
+        const BenchResult *r = &results->items[i];
+        fprintf(f, "%s,%zu,%zu,%zu,%s,%zu,%.1f,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 "\n",
+                bench_layout_key[r->layout], r->capacity, r->elem_size, r->batch_size, r->op, r->calls,
+                r->items_per_sec, r->p50_ns, r->p90_ns, r->p99_ns, r->p999_ns, r->max_ns);
+    }
+
+    fclose(f);
+    return true;
+}
+
+static bool bench_write_json(const char *path, const BenchResults *results) {
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        fprintf(stderr, "Could not open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    fprintf(f, "[\n");
+    for (size_t i = 0; i < results->count; ++i) {
+        const BenchResult *r = &results->items[i];
+        fprintf(f, "  {\"layout\": \"%s\", \"capacity\": %zu, \"elem_size\": %zu, \"batch_size\": %zu, \"op\": \"%s\", "
+                   "\"calls\": %zu, \"items_per_sec\": %.1f, \"p50_ns\": %" PRIu64 ", \"p90_ns\": %" PRIu64 ", "
+                   "\"p99_ns\": %" PRIu64 ", \"p999_ns\": %" PRIu64 ", \"max_ns\": %" PRIu64 "}%s\n",
+                bench_layout_key[r->layout], r->capacity, r->elem_size, r->batch_size, r->op, r->calls,
+                r->items_per_sec, r->p50_ns, r->p90_ns, r->p99_ns, r->p999_ns, r->max_ns, i + 1 < results->count ? "," : "");
+    }
+    fprintf(f, "]\n");
+
+    fclose(f);
+    return true;
+}
+
+static int bench_matrix(const BenchOptions *opt) {
+    static const size_t elem_sizes[]        = {4, 64, 1024, 16 * 1024, 64 * 1024};
+    static const size_t batch_sizes[]       = {32, 256};
+    static const size_t quick_elem_sizes[]  = {4, 1024};
+    static const size_t quick_batch_sizes[] = {32};
+
+    const size_t *elems       = opt->quick ? quick_elem_sizes : elem_sizes;
+    size_t        elem_count  = opt->quick ? ARRAY_LEN(quick_elem_sizes) : ARRAY_LEN(elem_sizes);
+    const size_t *batches     = opt->quick ? quick_batch_sizes : batch_sizes;
+    size_t        batch_count = opt->quick ? ARRAY_LEN(quick_batch_sizes) : ARRAY_LEN(batch_sizes);
+    size_t        max_shift   = opt->quick ? 16 : 24;
+
+    BenchResults results = {0};
+
+    for (int layout = SUM_TREE_BINARY; layout <= SUM_TREE_FENWICK; ++layout) {
+        if (!(opt->layouts & (1 << layout)))
+            continue;
+
+        for (size_t shift = 10; shift <= max_shift; shift += 2) {
+            size_t capacity = (size_t)1 << shift;
+            for (size_t e = 0; e < elem_count; ++e) {
+                // Data plus the priority tree has to fit in the memory budget
+                if (capacity * (elems[e] + 2 * sizeof(double)) > opt->max_bytes) {
+                    printf("skip   cap %9zu elem %6zu (over the %zu MB budget)\n", capacity, elems[e], opt->max_bytes >> 20);
+                    continue;
+                }
+                bench_matrix_case(&results, opt, (SumTreeLayout)layout, capacity, elems[e], batches, batch_count);
+            }
+        }
+    }
+
+    bool ok = true;
+    if (opt->csv_path)
+        ok = bench_write_csv(opt->csv_path, &results) && ok;
+    if (opt->json_path)
+        ok = bench_write_json(opt->json_path, &results) && ok;
+
+    da_free(results);
+    return ok ? 0 : 1;
+}
+
+// Threads suite: actors adding while learners sample and update, striped ConcurrentPER and ShardedPER
+// against one global mutex around a plain PER
+
+#define BENCH_THREADS_CAPACITY ((size_t)1 << 20)
+#define BENCH_THREADS_ELEM_SIZE 64
+#define BENCH_THREADS_SHARDS 16
+
+typedef enum {
+    BENCH_THREADS_GLOBAL = 0,
+    BENCH_THREADS_STRIPED,
+    BENCH_THREADS_SHARDED,
+} BenchThreadsMode;
+
+static const char *bench_threads_mode_name[] = {"global-mutex", "striped", "sharded"};
+
+typedef struct {
+    ConcurrentPER   *cper;        // striped mode when not NULL
+    ShardedPER      *sharded;     // sharded mode when not NULL
+    PER             *per;         // global mutex mode otherwise
+    pthread_mutex_t *global_lock;
+    int             *stop;
+    uint64_t         seed;
+    uint64_t         items;
+} BenchWorker;
+
+static void *bench_producer(void *arg) {
+    BenchWorker *w = (BenchWorker *)arg;
+    char         item[BENCH_THREADS_ELEM_SIZE] = {0};
+
+    while (!__atomic_load_n(w->stop, __ATOMIC_RELAXED)) {
+        if (w->cper) {
+            concurrent_per_add(w->cper, item);
+        } else if (w->sharded) {
+            sharded_per_add(w->sharded, item);
+        } else {
+            pthread_mutex_lock(w->global_lock);
+            add_to_per(w->per, item);
+            pthread_mutex_unlock(w->global_lock);
+        }
+        w->items++;
+    }
+    return NULL;
+}
+
+static void *bench_consumer(void *arg) {
+    BenchWorker  *w = (BenchWorker *)arg;
+    Rng           rng;
+    SumTreeSample samples[BATCH_SIZE];
+    ShardedSample sharded[BATCH_SIZE];
+    double        weights[BATCH_SIZE];
+    double        td_errors[BATCH_SIZE];
+    size_t        indices[BATCH_SIZE];
+    char          items[BATCH_SIZE * BENCH_THREADS_ELEM_SIZE];
+    Batch         batch = create_batch(BATCH_SIZE);
+
+    rng_seed(&rng, w->seed);
+    while (!__atomic_load_n(w->stop, __ATOMIC_RELAXED)) {
+        rng_fill_uniform(&rng, td_errors, BATCH_SIZE, -1.0, 1.0);
+
+        if (w->cper) {
+            if (!concurrent_per_sample(w->cper, &rng, BATCH_SIZE, samples, weights, items))
+                continue;
+            for (size_t i = 0; i < BATCH_SIZE; ++i)
+                indices[i] = samples[i].p_idx;
+            concurrent_per_update(w->cper, indices, td_errors, BATCH_SIZE);
+        } else if (w->sharded) {
+            if (!sharded_per_sample(w->sharded, &rng, BATCH_SIZE, sharded, weights, items))
+                continue;
+            sharded_per_update(w->sharded, sharded, td_errors, BATCH_SIZE);
+        } else {
+            TD_ERRORS td = {.items = td_errors, .count = BATCH_SIZE, .capacity = BATCH_SIZE};
+            pthread_mutex_lock(w->global_lock);
+            sample_from_per_into(w->per, &batch, BATCH_SIZE, items);
+            for (size_t i = 0; i < BATCH_SIZE; ++i)
+                indices[i] = batch.items[i].p_idx;
+            update_per_priorities(w->per, &td, indices);
+            pthread_mutex_unlock(w->global_lock);
+        }
+        w->items += BATCH_SIZE;
+    }
+
+    free_batch(&batch);
+    return NULL;
+}
+
+static void bench_threads_case(BenchThreadsMode mode, size_t producers, size_t consumers, double seconds) {
+    pthread_mutex_t global_lock = PTHREAD_MUTEX_INITIALIZER;
+    int             stop        = 0;
+    ConcurrentPER  *cper        = NULL;
+    ShardedPER     *sharded     = NULL;
+    PER            *per         = NULL;
+    char            item[BENCH_THREADS_ELEM_SIZE] = {0};
+
+    if (mode == BENCH_THREADS_STRIPED) {
+        cper = create_concurrent_per(BENCH_THREADS_CAPACITY, BENCH_THREADS_ELEM_SIZE, 0.6, 0.4, 0);
+        if (cper == NULL)
+            return;
+        for (size_t i = 0; i < BENCH_THREADS_CAPACITY; ++i)
+            concurrent_per_add(cper, item);
+    } else if (mode == BENCH_THREADS_SHARDED) {
+        sharded = create_sharded_per(BENCH_THREADS_SHARDS, BENCH_THREADS_CAPACITY / BENCH_THREADS_SHARDS, BENCH_THREADS_ELEM_SIZE, 0.6, 0.4, (SumTreeConfig){0});
+        if (sharded == NULL)
+            return;
+        for (size_t i = 0; i < BENCH_THREADS_CAPACITY; ++i)
+            sharded_per_add(sharded, item);
+    } else {
+        per = create_prioritized_replay(BENCH_THREADS_CAPACITY, BENCH_THREADS_ELEM_SIZE, 0.6, 0.4);
+        if (per == NULL)
+            return;
+        for (size_t i = 0; i < BENCH_THREADS_CAPACITY; ++i)
+            add_to_per(per, item);
+    }
+
+    size_t       count   = producers + consumers;
+    BenchWorker *workers = (BenchWorker *)calloc(count, sizeof(BenchWorker));
+    pthread_t   *threads = (pthread_t *)calloc(count, sizeof(pthread_t));
+
+    for (size_t i = 0; i < count; ++i) {
+        workers[i] = (BenchWorker){.cper = cper, .sharded = sharded, .per = per, .global_lock = &global_lock, .stop = &stop, .seed = rng_next_u64(&bench_rng)};
+        pthread_create(&threads[i], NULL, i < producers ? bench_producer : bench_consumer, &workers[i]);
+    }
+
+    struct timespec duration = {.tv_sec = (time_t)seconds, .tv_nsec = (long)((seconds - floor(seconds)) * 1e9)};
+    nanosleep(&duration, NULL);
+    __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+
+    uint64_t added   = 0;
+    uint64_t sampled = 0;
+    for (size_t i = 0; i < count; ++i) {
+        pthread_join(threads[i], NULL);
+        if (i < producers)
+            added += workers[i].items;
+        else
+            sampled += workers[i].items;
+    }
+
+    printf("%-12s producers %2zu consumers %2zu | adds %12.0f /s | sampled + updated %12.0f items/s\n",
+           bench_threads_mode_name[mode], producers, consumers, (double)added / seconds, (double)sampled / seconds);
+    fflush(stdout);
+
+    free(workers);
+    free(threads);
+    free_concurrent_per(cper);
+    free_sharded_per(sharded);
+    free_per(per);
+}
+
+static void bench_threads(double seconds, size_t max_threads) {
+    printf("Concurrent actors + learners, capacity %zu, elem %d B, batch %d, %.1f s per case\n",
+           BENCH_THREADS_CAPACITY, BENCH_THREADS_ELEM_SIZE, BATCH_SIZE, seconds);
+    for (size_t producers = 1; producers <= max_threads; producers *= 2) {
+        for (size_t consumers = 1; consumers <= 2; ++consumers) {
+            bench_threads_case(BENCH_THREADS_GLOBAL, producers, consumers, seconds);
+            bench_threads_case(BENCH_THREADS_STRIPED, producers, consumers, seconds);
+            bench_threads_case(BENCH_THREADS_SHARDED, producers, consumers, seconds);
+        }
+    }
+}
+
+// Server suite: round trips of sample requests against a running per_server, one at a time against
+// pipelined, with payloads in the response against payloads handed off through shared memory
+
+#define BENCH_SERVER_ELEM 4096
+
+static bool bench_server_call(int fd, uint16_t op, uint16_t table, const struct iovec *parts, size_t part_count, void *body, size_t capacity) {
+    PerWireResponse response;
+    return per_client_send(fd, op, table, 0, parts, part_count) && per_client_recv(fd, &response, body, capacity) &&
+           response.status == PER_WIRE_OK;
+}
+
+static void bench_server_case(int fd, uint16_t table, size_t depth, bool shm, size_t calls, char *body, size_t body_capacity) {
+    uint64_t start = nanos_since_unspecified_epoch();
+    for (size_t done = 0; done < calls; done += depth) {
+        for (size_t k = 0; k < depth; ++k) {
+            PerWireSample sample = {.batch_size = BATCH_SIZE, .flags = shm ? PER_WIRE_SHM : 0, .shm_offset = k * BATCH_SIZE * BENCH_SERVER_ELEM};
+            per_client_send(fd, PER_OP_SAMPLE, table, k, &(struct iovec){.iov_base = &sample, .iov_len = sizeof(sample)}, 1);
+        }
+        for (size_t k = 0; k < depth; ++k) {
+            PerWireResponse response;
+            if (!per_client_recv(fd, &response, body, body_capacity) || response.status != PER_WIRE_OK) {
+                fprintf(stderr, "Sample request failed\n");
+                return;
+            }
+        }
+    }
+    double seconds = (nanos_since_unspecified_epoch() - start) / 1e9;
+    printf("depth %3zu | %-6s | %8.0f batches/s | %7.1f MB/s of items\n", depth, shm ? "shm" : "inline", calls / seconds,
+           calls * (double)BATCH_SIZE * BENCH_SERVER_ELEM / seconds / (1 << 20));
+}
+
+static int bench_server(const char *socket_path, size_t calls) {
+    int fd = per_client_connect(socket_path);
+    if (fd < 0)
+        return 1;
+
+    const size_t  max_depth  = 16;
+    const char   *shm_name   = "/per-bench-server";
+    size_t        shm_bytes  = max_depth * BATCH_SIZE * BENCH_SERVER_ELEM;
+    size_t        body_bytes = BATCH_SIZE * (sizeof(PerWireSampleItem) + BENCH_SERVER_ELEM);
+    char         *body       = (char *)malloc(body_bytes);
+    char         *items      = (char *)calloc(64, BENCH_SERVER_ELEM);
+    PerWireCreate create     = {.capacity = (size_t)1 << 14, .elem_size = BENCH_SERVER_ELEM, .alpha = 0.6, .beta = 0.4};
+    int           status     = 1;
+
+    shm_unlink(shm_name);
+    int shm_fd = shm_open(shm_name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (shm_fd < 0 || ftruncate(shm_fd, (off_t)shm_bytes) != 0) {
+        perror(shm_name);
+        goto defer;
+    }
+
+    if (!bench_server_call(fd, PER_OP_CREATE, 0, &(struct iovec){.iov_base = &create, .iov_len = sizeof(create)}, 1, body, body_bytes) ||
+        !bench_server_call(fd, PER_OP_ATTACH, 0, &(struct iovec){.iov_base = (void *)shm_name, .iov_len = strlen(shm_name)}, 1, body, body_bytes)) {
+        fprintf(stderr, "%s: server refused the benchmark table\n", socket_path);
+        goto defer;
+    }
+    uint16_t table = (uint16_t)((PerWireCreated *)body)->table;
+
+    PerWireInsert insert = {.count = 64};
+    for (size_t i = 0; i < create.capacity; i += insert.count) {
+        struct iovec parts[] = {{.iov_base = &insert, .iov_len = sizeof(insert)}, {.iov_base = items, .iov_len = insert.count * BENCH_SERVER_ELEM}};
+        if (!bench_server_call(fd, PER_OP_INSERT, table, parts, 2, body, body_bytes))
+            goto defer;
+    }
+
+    printf("Sample round trips, batches of %d items of %d B\n", BATCH_SIZE, BENCH_SERVER_ELEM);
+    for (size_t depth = 1; depth <= max_depth; depth *= 4) {
+        bench_server_case(fd, table, depth, false, calls, body, body_bytes);
+        bench_server_case(fd, table, depth, true, calls, body, body_bytes);
+    }
+    status = 0;
+
+defer:
+    if (shm_fd >= 0) {
+        close(shm_fd);
+        shm_unlink(shm_name);
+    }
+    close(fd);
+    free(items);
+    free(body);
+    return status;
+}
+
+static void bench_usage(const char *program) {
+    fprintf(stderr, "Usage: %s [matrix] [--quick] [--calls N] [--max-mb N] [--layout binary|bary|fenwick|both|all] [--mmap FILE [--mmap-tree]] [--csv FILE] [--json FILE]\n", program);
+    fprintf(stderr, "       %s micro\n", program);
+    fprintf(stderr, "       %s threads [--seconds S] [--max-threads N]\n", program);
+    fprintf(stderr, "       %s server --socket PATH [--calls N]   (against a running build/per_server)\n", program);
+}
+
+int main(int argc, char **argv) {
+    rng_seed(&bench_rng, (uint64_t)time(NULL));
+
+    const char  *program = shift(argv, argc);
+    BenchOptions opt     = {
+            .max_bytes = (size_t)2048 << 20,
+            .calls     = 2000,
+            .layouts   = 1 << SUM_TREE_BINARY,
+            .csv_path  = "build/bench.csv",
+            .json_path = "build/bench.json",
+    };
+
+    if (argc > 0 && strcmp(argv[0], "micro") == 0) {
+        return bench_micro() ? 0 : 1;
+    }
+    if (argc > 0 && strcmp(argv[0], "threads") == 0) {
+        shift(argv, argc);
+        double seconds     = 1.0;
+        size_t max_threads = (size_t)nob_nprocs();
+        while (argc > 1) {
+            const char *flag = shift(argv, argc);
+            if (strcmp(flag, "--seconds") == 0)
+                seconds = strtod(shift(argv, argc), NULL);
+            else if (strcmp(flag, "--max-threads") == 0)
+                max_threads = (size_t)strtoull(shift(argv, argc), NULL, 10);
+            else
+                break;
+        }
+        if (argc > 0 || seconds <= 0.0 || max_threads == 0) {
+            bench_usage(program);
+            return 1;
+        }
+        bench_threads(seconds, max_threads);
+        return 0;
+    }
+    if (argc > 0 && strcmp(argv[0], "server") == 0) {
+        shift(argv, argc);
+        const char *socket_path = NULL;
+        size_t      calls       = 4096;
+        while (argc > 1) {
+            const char *flag = shift(argv, argc);
+            if (strcmp(flag, "--socket") == 0)
+                socket_path = shift(argv, argc);
+            else if (strcmp(flag, "--calls") == 0)
+                calls = (size_t)strtoull(shift(argv, argc), NULL, 10);
+            else
+                break;
+        }
+        if (argc > 0 || socket_path == NULL || calls == 0) {
+            bench_usage(program);
+            return 1;
+        }
+        return bench_server(socket_path, calls);
+    }
+    if (argc > 0 && strcmp(argv[0], "matrix") == 0)
+        shift(argv, argc);
+
+    while (argc > 0) {
+        const char *flag = shift(argv, argc);
+        if (strcmp(flag, "--quick") == 0) {
+            opt.quick = true;
+        } else if (strcmp(flag, "--calls") == 0 && argc > 0) {
+            opt.calls = (size_t)strtoull(shift(argv, argc), NULL, 10);
+        } else if (strcmp(flag, "--max-mb") == 0 && argc > 0) {
+            opt.max_bytes = (size_t)strtoull(shift(argv, argc), NULL, 10) << 20;
+        } else if (strcmp(flag, "--layout") == 0 && argc > 0) {
+            const char *layout = shift(argv, argc);
+            opt.layouts        = strcmp(layout, "binary") == 0    ? 1 << SUM_TREE_BINARY
+                                 : strcmp(layout, "bary") == 0    ? 1 << SUM_TREE_BARY
+                                 : strcmp(layout, "fenwick") == 0 ? 1 << SUM_TREE_FENWICK
+                                 : strcmp(layout, "both") == 0    ? (1 << SUM_TREE_BINARY) | (1 << SUM_TREE_BARY)
+                                 : strcmp(layout, "all") == 0     ? (1 << SUM_TREE_BINARY) | (1 << SUM_TREE_BARY) | (1 << SUM_TREE_FENWICK)
+                                                                  : 0;
+            if (opt.layouts == 0) {
+                bench_usage(program);
+                return 1;
+            }
+        } else if (strcmp(flag, "--mmap") == 0 && argc > 0) {
+            opt.mmap_path = shift(argv, argc);
+        } else if (strcmp(flag, "--mmap-tree") == 0) {
+            opt.mmap_tree = 1;
+        } else if (strcmp(flag, "--csv") == 0 && argc > 0) {
+            opt.csv_path = shift(argv, argc);
+        } else if (strcmp(flag, "--json") == 0 && argc > 0) {
+            opt.json_path = shift(argv, argc);
+        } else {
+            bench_usage(program);
+            return 1;
+        }
+    }
+
+    if (opt.calls == 0) {
+        bench_usage(program);
+        return 1;
+    }
+
+    return bench_matrix(&opt);
+}
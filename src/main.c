@@ -76,6 +76,15 @@ void test_prioritized_replay() {
 
     update_per_priorities(per, &td_errors, sampled_indices);
 
+    // Steady state training loop: the batch and the payload buffer are allocated once and refilled
+    Batch reusable_batch = create_batch(BATCH_SIZE);
+    int   sampled_values[BATCH_SIZE];
+    for (size_t step = 0; step < 4; ++step) {
+        sample_from_per_into(per, &reusable_batch, BATCH_SIZE, sampled_values);
+        printf("Step %zu first sample: idx %zu value %d weight %f\n", step, reusable_batch.items[0].d_idx, sampled_values[0], reusable_batch.importance_weights[0]);
+    }
+    free_batch(&reusable_batch);
+
     free(sampled_indices);
     free_per(per);
     da_free(td_errors);
@@ -0,0 +1,521 @@
+// per_server: owns PER tables and serves insert / sample / update over a Unix domain socket, so actors and
+// learners in any language can use the engine without linking against it. The wire format is in
+// header/per_protocol.h.
+//
+//   build/per_server --socket /tmp/per.sock [--table CAPACITY:ELEM_SIZE[:ALPHA:BETA]] ...
+//
+// A single thread polls every connection. All complete requests that arrived with one read are handled
+// back to back and their responses leave with one write, so pipelining clients pay one syscall pair per
+// burst instead of per request.
+
+#define _GNU_SOURCE // accept4
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define NOB_IMPLEMENTATION
+#define NOB_STRIP_PREFIX
+
+#include "../header/per.h"
+#include "../header/per_protocol.h"
+#include "../header/nob.h"
+
+#define PER_SERVER_MAX_TABLES 64
+#define PER_SERVER_MAX_CLIENTS 256
+#define PER_SERVER_MAX_CAPACITY ((uint64_t)1 << 32)
+#define PER_SERVER_READ_CHUNK ((size_t)256 << 10)
+
+// A client whose unread responses pass this stops being read until it catches up
+#define PER_SERVER_MAX_PENDING_OUTPUT ((size_t)64 << 20)
+
+typedef struct {
+    int            fd;
+    String_Builder in;
+    size_t         in_pos; // start of the first unhandled request
+    String_Builder out;
+    size_t         out_pos; // start of the first unsent byte
+    char          *shm;     // attached segment, NULL when none
+    size_t         shm_bytes;
+} PerConn;
+
+typedef struct {
+    PER           *tables[PER_SERVER_MAX_TABLES];
+    size_t         table_count;
+    PerConn        conns[PER_SERVER_MAX_CLIENTS];
+    size_t         conn_count;
+    SumTreeSample *samples; // scratch for PER_OP_SAMPLE and PER_OP_UPDATE
+    double        *weights;
+    size_t        *indices;
+    size_t         scratch_capacity;
+} PerServer;
+
+static volatile sig_atomic_t per_server_stop = 0;
+
+static void per_server_on_signal(int sig) {
+    (void)sig;
+    per_server_stop = 1;
+}
+
+static bool per_server_reserve_scratch(PerServer *server, size_t count) {
+    if (count <= server->scratch_capacity)
+        return true;
+
+    SumTreeSample *samples = (SumTreeSample *)realloc(server->samples, count * sizeof(SumTreeSample));
+    if (samples != NULL)
+        server->samples = samples;
+    double *weights = (double *)realloc(server->weights, count * sizeof(double));
+    if (weights != NULL)
+        server->weights = weights;
+    size_t *indices = (size_t *)realloc(server->indices, count * sizeof(size_t));
+    if (indices != NULL)
+        server->indices = indices;
+
+    if (samples == NULL || weights == NULL || indices == NULL)
+        return false;
+    server->scratch_capacity = count;
+    return true;
+}
+
+static PER *per_server_create_table(PerServer *server, uint64_t capacity, uint64_t elem_size, double alpha, double beta, uint32_t layout) {
+    if (server->table_count == PER_SERVER_MAX_TABLES || capacity == 0 || (capacity & (capacity - 1)) != 0 ||
+        capacity > PER_SERVER_MAX_CAPACITY || layout > SUM_TREE_FENWICK || elem_size > PER_WIRE_MAX_MESSAGE || !isfinite(alpha) ||
+        !isfinite(beta))
+        return NULL;
+
+    PER *per = create_prioritized_replay_ex((size_t)capacity, (size_t)elem_size, alpha, beta, (SumTreeConfig){.layout = (SumTreeLayout)layout});
+    if (per != NULL)
+        server->tables[server->table_count++] = per;
+    return per;
+}
+
+// Appends a response header and reserves its body, returns a pointer to the body
+static char *per_server_respond(PerConn *conn, const PerWireRequest *request, PerWireStatus status, size_t body_bytes) {
+    PerWireResponse response = {.op = request->op, .status = (int16_t)status, .tag = request->tag};
+    if (status != PER_WIRE_OK)
+        body_bytes = 0;
+    response.length = (uint32_t)body_bytes;
+
+    da_reserve(&conn->out, conn->out.count + sizeof(response) + body_bytes);
+    memcpy(conn->out.items + conn->out.count, &response, sizeof(response));
+    char *body = conn->out.items + conn->out.count + sizeof(response);
+    conn->out.count += sizeof(response) + body_bytes;
+    return body;
+}
+
+static bool per_server_shm_range(const PerConn *conn, uint64_t offset, uint64_t bytes) {
+    return conn->shm != NULL && offset <= conn->shm_bytes && bytes <= conn->shm_bytes - offset;
+}
+
+static PerWireStatus per_server_attach(PerConn *conn, const char *name_bytes, size_t length) {
+    if (length == 0 || length > PER_WIRE_MAX_SHM_NAME)
+        return PER_WIRE_EMALFORMED;
+
+    char name[PER_WIRE_MAX_SHM_NAME + 1];
+    memcpy(name, name_bytes, length);
+    name[length] = '\0';
+
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0)
+        return PER_WIRE_ESHM;
+
+    struct stat st;
+    void       *mapping = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+        mapping = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+        return PER_WIRE_ESHM;
+
+    if (conn->shm != NULL)
+        munmap(conn->shm, conn->shm_bytes);
+    conn->shm       = (char *)mapping;
+    conn->shm_bytes = (size_t)st.st_size;
+    return PER_WIRE_OK;
+}
+
+static PerWireStatus per_server_insert(PerConn *conn, PER *per, const char *body, size_t length) {
+    PerWireInsert insert;
+    if (length < sizeof(insert))
+        return PER_WIRE_EMALFORMED;
+    memcpy(&insert, body, sizeof(insert));
+
+    size_t      elem_size = per->tree->elem_size;
+    uint64_t    bytes     = (uint64_t)insert.count * elem_size;
+    const char *items     = body + sizeof(insert);
+    if (insert.flags & PER_WIRE_SHM) {
+        if (length != sizeof(insert))
+            return PER_WIRE_EMALFORMED;
+        if (!per_server_shm_range(conn, insert.shm_offset, bytes))
+            return PER_WIRE_ESHM;
+        items = conn->shm + insert.shm_offset;
+    } else if (length != sizeof(insert) + bytes) {
+        return PER_WIRE_EMALFORMED;
+    }
+
+    for (size_t i = 0; i < insert.count; ++i) {
+        add_to_per(per, elem_size > 0 ? items + i * elem_size : NULL);
+    }
+    return PER_WIRE_OK;
+}
+
+static void per_server_sample(PerServer *server, PerConn *conn, const PerWireRequest *request, PER *per, const char *body) {
+    PerWireSample sample;
+    if (request->length != sizeof(sample)) {
+        per_server_respond(conn, request, PER_WIRE_EMALFORMED, 0);
+        return;
+    }
+    memcpy(&sample, body, sizeof(sample));
+
+    size_t count      = sample.batch_size;
+    size_t elem_size  = per->tree->elem_size;
+    bool   shm        = (sample.flags & PER_WIRE_SHM) != 0;
+    size_t item_bytes = count * elem_size;
+
+    if (count == 0 || count > per->tree->num_entries) {
+        per_server_respond(conn, request, PER_WIRE_EEMPTY, 0);
+        return;
+    }
+    if (shm && !per_server_shm_range(conn, sample.shm_offset, item_bytes)) {
+        per_server_respond(conn, request, PER_WIRE_ESHM, 0);
+        return;
+    }
+    size_t body_bytes = count * sizeof(PerWireSampleItem) + (shm ? 0 : item_bytes);
+    if (body_bytes > PER_WIRE_MAX_MESSAGE || !per_server_reserve_scratch(server, count)) {
+        per_server_respond(conn, request, PER_WIRE_ENOMEM, 0);
+        return;
+    }
+
+    // Payloads are gathered straight into the response (or the segment), behind the sample records
+    char *out   = per_server_respond(conn, request, PER_WIRE_OK, body_bytes);
+    char *items = shm ? conn->shm + sample.shm_offset : out + count * sizeof(PerWireSampleItem);
+    sample_from_per_fused(per, count, server->samples, server->weights, elem_size > 0 ? items : NULL);
+
+    for (size_t i = 0; i < count; ++i) {
+        PerWireSampleItem record = {.p_idx = server->samples[i].p_idx, .d_idx = server->samples[i].d_idx, .weight = server->weights[i]};
+        memcpy(out + i * sizeof(record), &record, sizeof(record));
+    }
+}
+
+static PerWireStatus per_server_update(PerServer *server, PER *per, const char *body, size_t length) {
+    PerWireUpdate update;
+    if (length < sizeof(update))
+        return PER_WIRE_EMALFORMED;
+    memcpy(&update, body, sizeof(update));
+
+    size_t count = update.count;
+    if (length != sizeof(update) + count * (sizeof(uint64_t) + sizeof(double)))
+        return PER_WIRE_EMALFORMED;
+    if (!per_server_reserve_scratch(server, count))
+        return PER_WIRE_ENOMEM;
+
+    // A bad index would corrupt the inner sums, so check the whole request before touching the tree
+    const char *indices   = body + sizeof(update);
+    const char *td_errors = indices + count * sizeof(uint64_t);
+    size_t      leaf_base = sumtree_leaf_base(per->tree);
+    for (size_t i = 0; i < count; ++i) {
+        uint64_t p_idx;
+        memcpy(&p_idx, indices + i * sizeof(uint64_t), sizeof(p_idx));
+        memcpy(&server->weights[i], td_errors + i * sizeof(double), sizeof(double));
+        if (p_idx < leaf_base || p_idx - leaf_base >= per->tree->capacity || !isfinite(server->weights[i]))
+            return PER_WIRE_EMALFORMED;
+        server->indices[i] = (size_t)p_idx;
+    }
+
+    TD_ERRORS td = {.items = server->weights, .count = count, .capacity = count};
+    update_per_priorities(per, &td, server->indices);
+    return PER_WIRE_OK;
+}
+
+static void per_server_handle(PerServer *server, PerConn *conn, const PerWireRequest *request, const char *body) {
+    if (request->op == PER_OP_CREATE) {
+        PerWireCreate create;
+        PER          *per = NULL;
+        if (request->length == sizeof(create)) {
+            memcpy(&create, body, sizeof(create));
+            per = per_server_create_table(server, create.capacity, create.elem_size, create.alpha, create.beta, create.layout);
+        }
+        if (per == NULL) {
+            per_server_respond(conn, request, request->length == sizeof(create) ? PER_WIRE_ETABLE : PER_WIRE_EMALFORMED, 0);
+            return;
+        }
+        PerWireCreated created = {.table = (uint32_t)(server->table_count - 1)};
+        memcpy(per_server_respond(conn, request, PER_WIRE_OK, sizeof(created)), &created, sizeof(created));
+        return;
+    }
+    if (request->op == PER_OP_ATTACH) {
+        per_server_respond(conn, request, per_server_attach(conn, body, request->length), 0);
+        return;
+    }
+
+    if (request->op < PER_OP_CREATE || request->op > PER_OP_ATTACH) {
+        per_server_respond(conn, request, PER_WIRE_EBADOP, 0);
+        return;
+    }
+    if (request->table >= server->table_count) {
+        per_server_respond(conn, request, PER_WIRE_ETABLE, 0);
+        return;
+    }
+
+    PER *per = server->tables[request->table];
+    switch ((PerWireOp)request->op) {
+    case PER_OP_INSERT:
+        per_server_respond(conn, request, per_server_insert(conn, per, body, request->length), 0);
+        break;
+    case PER_OP_SAMPLE:
+        per_server_sample(server, conn, request, per, body);
+        break;
+    case PER_OP_UPDATE:
+        per_server_respond(conn, request, per_server_update(server, per, body, request->length), 0);
+        break;
+    case PER_OP_STATS: {
+        PerWireStats stats = {
+            .size         = per->tree->num_entries,
+            .capacity     = per->tree->capacity,
+            .elem_size    = per->tree->elem_size,
+            .total        = sum_tree_total(per->tree),
+            .max_priority = per->max_priority,
+            .beta         = per->beta,
+        };
+        memcpy(per_server_respond(conn, request, PER_WIRE_OK, sizeof(stats)), &stats, sizeof(stats));
+        break;
+    }
+    default:
+        per_server_respond(conn, request, PER_WIRE_EBADOP, 0);
+        break;
+    }
+}
+
+static inline size_t per_server_pending_output(const PerConn *conn) {
+    return conn->out.count - conn->out_pos;
+}
+
+static bool per_server_has_request(const PerConn *conn) {
+    size_t available = conn->in.count - conn->in_pos;
+    if (available < sizeof(PerWireRequest))
+        return false;
+    PerWireRequest request;
+    memcpy(&request, conn->in.items + conn->in_pos, sizeof(request));
+    return available >= sizeof(request) + request.length;
+}
+
+// Handles every complete request in the input buffer. Returns false when the stream is corrupt.
+static bool per_server_drain_input(PerServer *server, PerConn *conn) {
+    while (per_server_pending_output(conn) < PER_SERVER_MAX_PENDING_OUTPUT) {
+        size_t available = conn->in.count - conn->in_pos;
+        if (available < sizeof(PerWireRequest))
+            break;
+
+        PerWireRequest request;
+        memcpy(&request, conn->in.items + conn->in_pos, sizeof(request));
+        if (request.length > PER_WIRE_MAX_MESSAGE)
+            return false;
+        if (available < sizeof(request) + request.length)
+            break;
+
+        per_server_handle(server, conn, &request, conn->in.items + conn->in_pos + sizeof(request));
+        conn->in_pos += sizeof(request) + request.length;
+    }
+
+    // Keep the unhandled tail at the front of the buffer
+    size_t tail = conn->in.count - conn->in_pos;
+    memmove(conn->in.items, conn->in.items + conn->in_pos, tail);
+    conn->in.count = tail;
+    conn->in_pos   = 0;
+    return true;
+}
+
+static bool per_server_read(PerConn *conn) {
+    for (;;) {
+        da_reserve(&conn->in, conn->in.count + PER_SERVER_READ_CHUNK);
+        ssize_t got = recv(conn->fd, conn->in.items + conn->in.count, conn->in.capacity - conn->in.count, 0);
+        if (got > 0) {
+            conn->in.count += (size_t)got;
+            if (conn->in.count - conn->in_pos >= PER_SERVER_READ_CHUNK)
+                return true; // handle what is there before reading more
+            continue;
+        }
+        if (got == 0)
+            return false;
+        if (errno == EINTR)
+            continue;
+        return errno == EAGAIN || errno == EWOULDBLOCK;
+    }
+}
+
+static bool per_server_flush(PerConn *conn) {
+    while (per_server_pending_output(conn) > 0) {
+        ssize_t sent = send(conn->fd, conn->out.items + conn->out_pos, per_server_pending_output(conn), MSG_NOSIGNAL);
+        if (sent > 0) {
+            conn->out_pos += (size_t)sent;
+            continue;
+        }
+        if (sent < 0 && errno == EINTR)
+            continue;
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return true;
+        return false;
+    }
+    conn->out.count = 0;
+    conn->out_pos   = 0;
+    return true;
+}
+
+static void per_server_close(PerServer *server, size_t index) {
+    PerConn *conn = &server->conns[index];
+    close(conn->fd);
+    if (conn->shm != NULL)
+        munmap(conn->shm, conn->shm_bytes);
+    sb_free(conn->in);
+    sb_free(conn->out);
+    server->conns[index] = server->conns[--server->conn_count];
+}
+
+static int per_server_listen(const char *socket_path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "%s: socket path too long\n", socket_path);
+        return -1;
+    }
+    strcpy(addr.sun_path, socket_path);
+    unlink(socket_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 64) != 0) {
+        perror(socket_path);
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void per_server_run(PerServer *server, int listen_fd) {
+    struct pollfd fds[PER_SERVER_MAX_CLIENTS + 1];
+
+    while (!per_server_stop) {
+        // Requests held back by a full output buffer need no new input, do not block on them
+        int timeout = -1;
+        fds[0]      = (struct pollfd){.fd = listen_fd, .events = POLLIN};
+        for (size_t i = 0; i < server->conn_count; ++i) {
+            PerConn *conn   = &server->conns[i];
+            short    events = 0;
+            if (per_server_pending_output(conn) < PER_SERVER_MAX_PENDING_OUTPUT) {
+                events |= POLLIN;
+                if (per_server_has_request(conn))
+                    timeout = 0;
+            }
+            if (per_server_pending_output(conn) > 0)
+                events |= POLLOUT;
+            fds[i + 1] = (struct pollfd){.fd = conn->fd, .events = events};
+        }
+
+        size_t polled = server->conn_count;
+        if (poll(fds, polled + 1, timeout) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            return;
+        }
+
+        // Walk backwards so closing a connection (which moves the last one into its slot) skips nothing
+        for (size_t i = polled; i-- > 0;) {
+            PerConn *conn = &server->conns[i];
+            bool     ok   = !(fds[i + 1].revents & (POLLERR | POLLNVAL));
+            if (ok && (fds[i + 1].revents & (POLLIN | POLLHUP)))
+                ok = per_server_read(conn);
+            // Pipelined requests are all handled before the single flush below
+            if (ok)
+                ok = per_server_drain_input(server, conn);
+            if (ok)
+                ok = per_server_flush(conn);
+            if (!ok)
+                per_server_close(server, i);
+        }
+
+        if (fds[0].revents & POLLIN) {
+            for (;;) {
+                int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK);
+                if (fd < 0)
+                    break;
+                if (server->conn_count == PER_SERVER_MAX_CLIENTS) {
+                    close(fd);
+                    continue;
+                }
+                server->conns[server->conn_count++] = (PerConn){.fd = fd};
+            }
+        }
+    }
+}
+
+static void per_server_usage(const char *program) {
+    fprintf(stderr, "Usage: %s --socket PATH [--table CAPACITY:ELEM_SIZE[:ALPHA:BETA]] ...\n", program);
+    fprintf(stderr, "       tables are numbered in order, clients can add more with PER_OP_CREATE\n");
+}
+
+int main(int argc, char **argv) {
+    const char *program     = shift(argv, argc);
+    const char *socket_path = NULL;
+    PerServer   server      = {0};
+    int         status      = 1;
+
+    while (argc > 0) {
+        const char *flag = shift(argv, argc);
+        if (strcmp(flag, "--socket") == 0 && argc > 0) {
+            socket_path = shift(argv, argc);
+        } else if (strcmp(flag, "--table") == 0 && argc > 0) {
+            const char        *spec      = shift(argv, argc);
+            unsigned long long capacity  = 0;
+            unsigned long long elem_size = 0;
+            double             alpha     = 0.6;
+            double             beta      = 0.4;
+            int                fields    = sscanf(spec, "%llu:%llu:%lf:%lf", &capacity, &elem_size, &alpha, &beta);
+            if ((fields != 2 && fields != 4) || per_server_create_table(&server, capacity, elem_size, alpha, beta, SUM_TREE_BINARY) == NULL) {
+                fprintf(stderr, "Invalid table `%s`, capacity must be a power of two\n", spec);
+                goto defer;
+            }
+        } else {
+            per_server_usage(program);
+            goto defer;
+        }
+    }
+    if (socket_path == NULL) {
+        per_server_usage(program);
+        goto defer;
+    }
+
+    int listen_fd = per_server_listen(socket_path);
+    if (listen_fd < 0)
+        goto defer;
+
+    struct sigaction action = {.sa_handler = per_server_on_signal};
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    nob_log(INFO, "Serving %zu table(s) on %s", server.table_count, socket_path);
+    per_server_run(&server, listen_fd);
+
+    while (server.conn_count > 0) {
+        per_server_close(&server, server.conn_count - 1);
+    }
+    close(listen_fd);
+    unlink(socket_path);
+    status = 0;
+
+defer:
+    for (size_t i = 0; i < server.table_count; ++i) {
+        free_per(server.tables[i]);
+    }
+    free(server.samples);
+    free(server.weights);
+    free(server.indices);
+    return status;
+}